@@ -1,25 +1,108 @@
 #ifndef _EKF_CLASS_H
 #define _EKF_CLASS_H
 
-#include <ros/ros.h>
-#include <nav_msgs/Odometry.h>
-#include <geometry_msgs/PoseStamped.h>
-#include <fstream>
-#include <Eigen/Dense>
+#include <Eigen/Core>
+#include <Eigen/LU>
 
 using namespace Eigen;
 
+
+/* EKF with compile-time state / control dimensions
+ *
+ * fixed-size Eigen types only: nothing is allocated on the heap, and the inverse of
+ * the innovation covariance is the closed form one of Eigen (up to 4x4).
+ * The filter is stateless, the state x and its covariance P belong to the caller.
+ *
+ * motion model (e.g. DiffDriveModel):
+ *   void operator()(const State& x, const Control& u, float dt,
+ *                   State& next, StateMatrix& G, ControlJacobian& V, ControlMatrix& M) const;
+ *   next = f(x, u, dt), G = df/dx, V = df/du, M: covariance of u
+ * observation model (e.g. PoseObservation):
+ *   static const int DIM;
+ *   void operator()(const State& x, Matrix<float, DIM, 1>& z, Matrix<float, DIM, STATE_DIM>& H) const;
+ *   z = h(x), H = dh/dx
+ */
+template<int STATE_DIM, int CONTROL_DIM>
 class EKF{
 
 public:
+    typedef Matrix<float, STATE_DIM, 1> State;
+    typedef Matrix<float, STATE_DIM, STATE_DIM> StateMatrix;
+    typedef Matrix<float, CONTROL_DIM, 1> Control;
+    typedef Matrix<float, CONTROL_DIM, CONTROL_DIM> ControlMatrix;
+    typedef Matrix<float, STATE_DIM, CONTROL_DIM> ControlJacobian;
+
+    template<class Model>
+    static void predict(const Model& model, const Control& u, float dt, State& x, StateMatrix& P)
+    {
+        State next;
+        StateMatrix G;
+        ControlJacobian V;
+        ControlMatrix M;
+        model(x, u, dt, next, G, V, M);
+        x = next;
+        P = G * P * G.transpose() + V * M * V.transpose();
+    }
+
+    // n inputs in turn (e.g. every imu sample since the last step)
+    template<class Model>
+    static void predict(const Model& model, const Control* u, const float* dt, int n, State& x, StateMatrix& P)
+    {
+        for(int i = 0; i < n; i++) predict(model, u[i], dt[i], x, P);
+    }
+
+    template<class Observation>
+    static void update(const Observation& model, const Matrix<float, Observation::DIM, 1>& z,
+            const Matrix<float, Observation::DIM, Observation::DIM>& Q, State& x, StateMatrix& P)
+    {
+        typedef Matrix<float, Observation::DIM, 1> Measurement;
+        typedef Matrix<float, Observation::DIM, Observation::DIM> MeasurementMatrix;
+
+        Measurement h;
+        Matrix<float, Observation::DIM, STATE_DIM> H;
+        model(x, h, H);
+
+        const MeasurementMatrix S = H * P * H.transpose() + Q;
+        const Matrix<float, STATE_DIM, Observation::DIM> K = P * H.transpose() * S.inverse();
+        x += K * (z - h);
+        P = (StateMatrix::Identity() - K * H) * P;
+    }
+
+    // n independent observations in turn (e.g. every scan matched since the last step)
+    template<class Observation>
+    static void update(const Observation& model, const Matrix<float, Observation::DIM, 1>* z,
+            const Matrix<float, Observation::DIM, Observation::DIM>* Q, int n, State& x, StateMatrix& P)
+    {
+        for(int i = 0; i < n; i++) update(model, z[i], Q[i], x, P);
+    }
+};
+
+
+/* odometry of (x, y, yaw) with the control (v, w),
+ * the velocity is projected on the ground by the pitch
+ */
+struct DiffDriveModel{
+    typedef EKF<3, 2> Filter;
+
+    const double* s_input;  // 制御の誤差パラメータ a1..a4
+    float pitch;
+
+    DiffDriveModel(const double* s_input_, float pitch_) : s_input(s_input_), pitch(pitch_) {}
+
+    void operator()(const Filter::State& x, const Filter::Control& u, float dt,
+            Filter::State& next, Filter::StateMatrix& G, Filter::ControlJacobian& V, Filter::ControlMatrix& M) const;
+};
+
+
+/* the pose (x, y, yaw) itself, as NDT observes it */
+struct PoseObservation{
+    static const int DIM = 3;
 
-    MatrixXf move(MatrixXf x, MatrixXf u, float dt, float pitch);
-    MatrixXf jacobF(MatrixXf x, MatrixXf u, float dt);
-    MatrixXf jacobG(MatrixXf x, MatrixXf u, float dt, float pitch);
-    MatrixXf jacobV(MatrixXf x, MatrixXf u, float dt, float pitch);
-    MatrixXf jacobM(MatrixXf u, double s_input[]);
-    MatrixXf jacobH(MatrixXf x);
-    MatrixXf h(MatrixXf x);
+    void operator()(const EKF<3, 2>::State& x, Matrix<float, 3, 1>& z, Matrix<float, 3, 3>& H) const
+    {
+        z = x;
+        H.setIdentity();
+    }
 };
 
 
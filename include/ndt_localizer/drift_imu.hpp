@@ -0,0 +1,46 @@
+#ifndef _DRIFT_IMU_HPP_
+#define _DRIFT_IMU_HPP_
+
+#include <ros/ros.h>
+#include <sensor_msgs/Imu.h>
+#include <std_msgs/Bool.h>
+
+
+/* yaw rate offset calibration of the IMU and rotation detection (/not_matching)
+ * used by both the drift_imu node and the drift_imu nodelet
+ */
+class DriftImu{
+
+    private:
+        ros::Subscriber imu_sub;
+        ros::Publisher imu_pub;
+        ros::Publisher notmatching_pub;
+        ros::Timer timer;
+
+        sensor_msgs::Imu imu_data;
+
+        bool received_flag;
+        double offset_yawrate;
+
+        /*calibration*/
+        bool first_flag;
+        double yawrate_;
+        int imu_count;
+        ros::Time first_time;
+
+        /*param*/
+        // /not_matching is true above this yaw rate [rad/s]
+        double ROTATION_RATE;
+
+        void imu_callback(const sensor_msgs::ImuConstPtr& msg);
+        void not_matching(double yaw_velo);
+        void timer_callback(const ros::TimerEvent& event);
+
+    public:
+        static const double OFFSET_YAWRATE;
+        static const double SAVE_DURATION;
+
+        DriftImu(ros::NodeHandle nh, ros::NodeHandle local_nh);
+};
+
+#endif
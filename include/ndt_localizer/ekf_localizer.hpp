@@ -0,0 +1,177 @@
+#ifndef _EKF_LOCALIZER_HPP_
+#define _EKF_LOCALIZER_HPP_
+
+#include <memory>
+#include <vector>
+#include <deque>
+
+#include <ros/ros.h>
+#include <tf/tf.h>
+#include <tf/transform_broadcaster.h>
+#include <tf/transform_listener.h>
+#include <Eigen/Core>
+#include <Eigen/LU>
+#include <Eigen/Geometry>
+#include <sensor_msgs/Imu.h>
+#include <nav_msgs/Odometry.h>
+#include <geometry_msgs/PoseStamped.h>
+#include <std_msgs/Bool.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+
+#include "ndt_localizer/EKF.h"
+#include "ndt_localizer/param_map.hpp"
+#include "ndt_localizer/latency_histogram.hpp"
+
+
+/* EKF of odometry / IMU (input) and NDT (observation)
+ * used by both the ekf node and the ekf nodelet
+ */
+class EKFLocalizer{
+
+    public:
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    private:
+        typedef EKF<3, 2> Filter;
+
+        // NDT result waiting for the next step
+        struct NdtObservation{
+            double stamp;           // of the scan [s], 0: unknown (fused at the step)
+            Filter::State z;
+            Filter::StateMatrix Q;
+        };
+        // filter state at a step or at the stamp of an NDT result
+        struct HistoryEntry{
+            double stamp;
+            Filter::Control u;      // input from the previous entry to this one
+            bool observed;
+            NdtObservation observation;
+            Filter::State x;        // after the prediction and the observation
+            Filter::StateMatrix Sigma;
+        };
+
+        ros::Subscriber odom_sub;
+        ros::Subscriber imu_sub;
+        ros::Subscriber ndt_sub;
+        ros::Subscriber hantei_sub;
+        ros::Subscriber init_sub;
+        ros::Subscriber relocalize_sub;
+
+        ros::Publisher ekf_pub;
+        ros::Publisher vis_ekf_pub;
+        ros::Publisher diag_pub;
+
+        ros::Timer timer;
+        ros::WallTimer diag_timer;
+
+        // only with ROS (null in offline use)
+        std::unique_ptr<tf::TransformBroadcaster> broadcaster;
+        std::unique_ptr<tf::TransformListener> listener;
+
+        /*flag*/
+        bool init_pose_flag;
+        bool imu_flag;
+        bool odom_flag;
+        bool init_flag;
+
+        std::string map_frame_id;
+        std::string odom_frame_id;
+
+        nav_msgs::Odometry ekf_odom;
+        Filter::State x;            // 状態 (x,y,θ)
+        Filter::StateMatrix Sigma;
+        Filter::Control u;          // 制御 (v, w)
+        std::vector<NdtObservation> ndt_observations;   // NDT観測 (x,y,θ), 次のステップで融合
+        // states of the last NDT_MAX_DELAY, a late NDT result is fused at its scan stamp and the
+        // steps after it are replayed. bounded by time, not by count: with PREDICT_ON_INPUT there is
+        // a step on every imu / odom message
+        std::deque<HistoryEntry> history;
+
+        /*param*/
+        double init_x[3];       // 初期状態 (x,y,θ) [rad]
+        double init_sig[3];     // 初期分散 (sig_x, sig_y, sig_yaw)
+        double s_ndt[3];        // NDT観測値の分散 (sig_x, sig_y, sig_yaw)
+        double ndt_sig[2];
+        double s_input[4];      // 制御の誤差パラメータ (要素数[0],[2]は並進速度，[1],[3]は回頭速度のパラメータ)
+        float pitch;            // ピッチ角
+        std::string parent_frame_id;
+        bool mode_pointing_ini_pose_on_rviz;
+        bool ENABLE_TF, ENABLE_ODOM_TF;
+        double HZ;
+        double DIAGNOSTICS_PERIOD;
+        double NDT_MAX_DELAY;   // NDT results older than this [s] are dropped
+        bool PREDICT_ON_INPUT;  // predict and publish on every odom / imu message (sensor stamps), not at HZ
+        double VIS_RATE;        // [Hz] of /vis/odometry at most (stamps), 0: every output
+
+        // windows of DIAGNOSTICS_PERIOD, published on /diagnostics
+        LatencyHistogram step_histogram;
+        LatencyHistogram predict_histogram;
+        LatencyHistogram update_histogram;
+        LatencyHistogram ndt_delay_histogram;
+        uint64_t delayed_ndt, dropped_ndt;
+
+        double last_time;
+        double last_input_stamp;    // of the last prediction with PREDICT_ON_INPUT, 0: none yet
+        double last_vis_stamp;      // of the last /vis/odometry
+
+        /*expand*/
+        bool init_imu;
+        float yaw_before;
+        float yaw_sum;
+
+        /*odom tf*/
+        Eigen::Vector3d first_odom_pose;
+        double first_odom_yaw;
+        bool first_odom_flag;
+
+        bool init_pose_once;
+
+        EKFLocalizer();
+        template<class ParamT>
+        void load_params(const ParamT& pnh);
+        void setup();
+
+        void InputOdomCov(nav_msgs::Odometry& odom);
+        void predict(const Filter::Control& input, float dt);
+        void NDTUpdate(const NdtObservation& observation);
+        // step (or NDT stamp) into the history, the ones older than NDT_MAX_DELAY out
+        void push_history(double stamp, const Filter::Control& input, const NdtObservation* observation);
+        // the observation at its stamp, now_time: time of the current step
+        void fuse(const NdtObservation& observation, double now_time);
+        // from the entry before 'from', every later entry is predicted and updated again
+        void replay(size_t from);
+        void clear_history();
+        // prediction to stamp with the last input and the pending NDT results
+        void step(double stamp, float dt);
+        double input_stamp(const ros::Time& stamp);
+        // a step up to the stamp of an input message, false if nothing was predicted
+        bool propagate(double stamp);
+        void set_output();
+        void publish();
+        float expand(float after);
+        void poseInit(nav_msgs::Odometry &msg);
+        void printParam(void);
+
+        void timerCallback(const ros::TimerEvent& event);
+        void diagnosticsCallback(const ros::WallTimerEvent& event);
+
+    public:
+        EKFLocalizer(ros::NodeHandle n, ros::NodeHandle pnh);
+        // without ROS master (offline tools): nothing is advertised or subscribed, no TF
+        explicit EKFLocalizer(const ParamMap& param);
+
+        void odomCallback(const nav_msgs::OdometryConstPtr& msg);
+        void imuCallback(const sensor_msgs::ImuConstPtr& msg);
+        void ndtCallback(const nav_msgs::OdometryConstPtr& msg);
+        void hanteiCallback(const std_msgs::BoolConstPtr& msg);
+        void initposeCallback(const geometry_msgs::PoseStampedConstPtr& msg);
+        // re-seed from the global relocalization of the matcher (any time, also before the initial pose)
+        void relocalizeCallback(const geometry_msgs::PoseStampedConstPtr& msg);
+
+        // one filter step at now_time [s] (the timer calls it at HZ), false until the pose is initialized.
+        // with PREDICT_ON_INPUT the callbacks have predicted already, only the output is updated
+        bool update(double now_time);
+        const nav_msgs::Odometry& get_odom() const { return ekf_odom; }
+};
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef _LATENCY_HISTOGRAM_HPP_
+#define _LATENCY_HISTOGRAM_HPP_
+
+#include<atomic>
+#include<chrono>
+#include<vector>
+#include<cstdint>
+
+
+/* Lock-free histogram of non-negative integer values (durations in ns, iteration counts, ...).
+ *
+ * Buckets are exact below 16 and log-linear above (8 buckets per power of two),
+ * so a percentile is off by at most 12.5 %. record() is a few relaxed atomic
+ * adds and can be called from any thread on the hot path; snapshot() is for the
+ * (slow) reporting side and optionally starts a new window.
+ */
+class LatencyHistogram{
+
+    public:
+        static const int LINEAR_NUM = 16;
+        static const int SUB_BITS = 3;
+        static const int BUCKET_NUM = LINEAR_NUM + (64 - 4) * (1 << SUB_BITS);
+
+        struct Snapshot{
+            std::vector<uint64_t> counts;
+            uint64_t num;
+            uint64_t sum;
+            uint64_t max;
+
+            Snapshot() : counts(BUCKET_NUM, 0), num(0), sum(0), max(0) {}
+
+            // upper bound of the bucket which holds the p-quantile (0 <= p <= 1)
+            uint64_t percentile(double p) const
+            {
+                if(num == 0) return 0;
+                uint64_t rank = static_cast<uint64_t>(p * num + 0.5);
+                if(rank < 1) rank = 1;
+                uint64_t seen = 0;
+                for(int i = 0; i < BUCKET_NUM; i++){
+                    seen += counts[i];
+                    if(seen >= rank){
+                        const uint64_t upper = bucket_upper(i);
+                        return upper < max ? upper : max;
+                    }
+                }
+                return max;
+            }
+
+            double mean() const { return num == 0 ? 0.0 : static_cast<double>(sum) / num; }
+        };
+
+        LatencyHistogram() : counts(BUCKET_NUM), num(0), sum(0), max(0)
+        {
+            for(auto& count : counts) count.store(0, std::memory_order_relaxed);
+        }
+
+        void record(uint64_t value)
+        {
+            counts[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+            num.fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(value, std::memory_order_relaxed);
+            uint64_t current = max.load(std::memory_order_relaxed);
+            while(value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed));
+        }
+
+        template<class Rep, class Period>
+        void record(std::chrono::duration<Rep, Period> duration)
+        {
+            const int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+            record(static_cast<uint64_t>(ns < 0 ? 0 : ns));
+        }
+
+        // the buckets are read one by one, a record() running meanwhile may land in either window
+        void snapshot(Snapshot& out, bool reset)
+        {
+            for(int i = 0; i < BUCKET_NUM; i++){
+                out.counts[i] = reset ? counts[i].exchange(0, std::memory_order_relaxed)
+                                      : counts[i].load(std::memory_order_relaxed);
+            }
+            out.num = reset ? num.exchange(0, std::memory_order_relaxed) : num.load(std::memory_order_relaxed);
+            out.sum = reset ? sum.exchange(0, std::memory_order_relaxed) : sum.load(std::memory_order_relaxed);
+            out.max = reset ? max.exchange(0, std::memory_order_relaxed) : max.load(std::memory_order_relaxed);
+        }
+
+        static int bucket_index(uint64_t value)
+        {
+            if(value < LINEAR_NUM) return static_cast<int>(value);
+            const int exponent = 63 - __builtin_clzll(value);
+            const int sub = static_cast<int>((value >> (exponent - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+            return LINEAR_NUM + (exponent - 4) * (1 << SUB_BITS) + sub;
+        }
+
+        static uint64_t bucket_upper(int index)
+        {
+            if(index < LINEAR_NUM) return index;
+            const int exponent = (index - LINEAR_NUM) / (1 << SUB_BITS) + 4;
+            const uint64_t sub = (index - LINEAR_NUM) % (1 << SUB_BITS);
+            const uint64_t lower = ((1ull << SUB_BITS) + sub) << (exponent - SUB_BITS);
+            return lower + (1ull << (exponent - SUB_BITS)) - 1;
+        }
+
+    private:
+        std::vector<std::atomic<uint64_t> > counts;
+        std::atomic<uint64_t> num;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+};
+
+
+/* Records the time from construction to destruction (steady clock, ns) into a histogram.
+ * A null histogram turns the timer off.
+ */
+class ScopedTimer{
+
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+        explicit ScopedTimer(LatencyHistogram* histogram_) :
+            histogram(histogram_),
+            start(Clock::now())
+        {
+        }
+
+        ~ScopedTimer()
+        {
+            if(histogram) histogram->record(Clock::now() - start);
+        }
+
+        // [s]
+        double elapsed() const
+        {
+            return std::chrono::duration<double>(Clock::now() - start).count();
+        }
+
+    private:
+        LatencyHistogram* histogram;
+        Clock::time_point start;
+
+        ScopedTimer(const ScopedTimer&);
+        ScopedTimer& operator=(const ScopedTimer&);
+};
+
+#endif
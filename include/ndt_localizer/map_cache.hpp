@@ -0,0 +1,53 @@
+#ifndef _MAP_CACHE_HPP_
+#define _MAP_CACHE_HPP_
+
+#include<string>
+#include<cstdint>
+
+#include<pcl/point_cloud.h>
+#include<pcl/point_types.h>
+
+
+/* Binary cache of the preprocessed map.
+ *
+ * The cache keeps the downsampled, offset-applied map cloud and the
+ * voxel-filtered NDT target cloud as packed (x, y, z, intensity) floats.
+ * It is memory-mapped on load, and is only used when the size / mtime of the
+ * source PCD and the preprocessing parameters match the ones it was made with.
+ */
+class MapCache{
+
+    public:
+        typedef pcl::PointCloud<pcl::PointXYZI> Cloud;
+
+        MapCache(const std::string& cache_file, const std::string& source_file,
+                double voxel_size, const double offset[6]);
+
+        bool load(Cloud& map, Cloud& target) const;
+        bool save(const Cloud& map, const Cloud& target) const;
+
+        const std::string& get_file() const { return cache_file; }
+
+    private:
+        struct Header{
+            char magic[8];
+            uint32_t version;
+            uint32_t point_step;
+            uint64_t source_size;
+            int64_t source_mtime_sec;
+            int64_t source_mtime_nsec;
+            double voxel_size;
+            double offset[6];
+            uint64_t map_num;
+            uint64_t target_num;
+        };
+
+        std::string cache_file;
+        std::string source_file;
+        double voxel_size;
+        double offset[6];
+
+        bool make_header(Header& header) const;
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _MAP_LOD_HPP_
+#define _MAP_LOD_HPP_
+
+#include<vector>
+#include<memory>
+
+#include<pcl/point_cloud.h>
+#include<pcl/point_types.h>
+
+#include"map_tile_index.hpp"
+
+
+/* Level-of-detail pyramid of the map for the visualization.
+ *
+ * Level 0 is the tile index of the map itself, every further level is voxelized
+ * at twice the size of the one before and kept as compact tiles as well.
+ * query() returns the finest level whose points in the area stay within a
+ * budget, so a view of the whole map is coarse and a close one is detailed.
+ */
+class MapLod{
+
+    public:
+        typedef pcl::PointCloud<pcl::PointXYZI> Cloud;
+
+        MapLod();
+
+        // base: the tile index of map (kept, not copied), level_num: levels including it
+        void build(const Cloud& map, const MapTileIndex& base, double resolution, int level_num);
+        bool is_built() const { return base != NULL; }
+
+        // the points of the area from the finest level with at most max_points there, returns the level
+        int query(double x_min, double x_max, double y_min, double y_max, size_t max_points, Cloud& output) const;
+        // the whole map
+        int query(size_t max_points, Cloud& output) const;
+
+        int get_level_num() const { return levels.size() + (base ? 1 : 0); }
+        double get_resolution(int level) const { return resolution * (1 << level); }
+        // of the levels above 0
+        size_t get_memory_bytes() const;
+
+    private:
+        const MapTileIndex* base;
+        double resolution;
+        std::vector<std::unique_ptr<MapTileIndex> > levels;   // 1, 2, ...
+        double bounds[4];   // x_min, x_max, y_min, y_max of the map
+
+        const MapTileIndex& level(int i) const { return i == 0 ? *base : *levels[i - 1]; }
+};
+
+#endif
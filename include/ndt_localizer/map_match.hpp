@@ -4,9 +4,19 @@
 #include<iostream>
 #include<ros/ros.h>
 #include<vector>
+#include<deque>
+#include<mutex>
+#include<condition_variable>
+#include<thread>
+#include<atomic>
+#include<memory>
+#include<functional>
 
 #include<sensor_msgs/PointCloud2.h>
 #include<nav_msgs/Odometry.h>
+#include<geometry_msgs/PoseStamped.h>
+#include<geometry_msgs/PolygonStamped.h>
+#include<diagnostic_msgs/DiagnosticArray.h>
 
 #include<tf/transform_broadcaster.h>
 
@@ -18,23 +28,115 @@
 // #include<pcl/ros/conversions.h>
 #include<pcl/point_cloud.h>
 
+#include"map_tile_index.hpp"
+#include"map_tile_store.hpp"
+#include"map_lod.hpp"
+#include"map_cache.hpp"
+#include"scan_preprocess.hpp"
+#include"spsc_queue.hpp"
+#include"param_map.hpp"
+#include"latency_histogram.hpp"
+#include"pose_history.hpp"
+#include"relocalizer.hpp"
+
 
 
 class Matcher{
 
+    public:
+        // matching result of one scan, handed to the result callback
+        struct Result{
+            uint64_t seq;
+            ros::Time stamp;
+            nav_msgs::Odometry odom;    // pose is the matched one only when accepted
+            double score;
+            bool accepted;
+            bool truncated;     // the alignment has been cut short by ALIGN_TIME_BUDGET
+            bool relocalized;   // found by the global relocalization, the ekf is re-seeded with it (not /NDT/result)
+            bool reused;        // standing still with the same scan: the last accepted pose, not aligned
+            int iterations;     // ndt iterations (all levels)
+            double guess_gap;   // scan stamp - stamp of the pose the initial guess is predicted from [s]
+            double preprocess_time, align_time, publish_time;   // [s]
+            double latency;     // reception -> end of publish [s]
+        };
+
     private:
+        // what to do with scans which arrive while an alignment is running
+        enum ScanPolicy{
+            SCAN_LATEST,    // keep only the newest pending scan
+            SCAN_DROP,      // drop scans arriving during an alignment
+            SCAN_QUEUE,     // keep up to SCAN_QUEUE_SIZE pending scans
+        };
+        // where the initial guess of the alignment comes from
+        enum GuessMode{
+            GUESS_PREDICTED,    // /EKF/result history interpolated / extrapolated to the scan stamp
+            GUESS_LATEST,       // latest /EKF/result as it is (x, y, z, yaw)
+        };
+        struct Scan{
+            uint64_t seq;
+            double receive_time;    // wall clock
+            sensor_msgs::PointCloud2ConstPtr msg;
+        };
+        // one scan on its way through preprocess -> align -> publish
+        struct Frame{
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+            uint64_t seq;
+            ros::Time stamp;
+            nav_msgs::Odometry odom;
+            pcl::PointCloud<pcl::PointXYZI>::Ptr cloud;
+            pcl::PointCloud<pcl::PointXYZI>::Ptr aligned_cloud;    // output of the ndt, /vis/ndt is made from cloud and result
+            pcl::PointCloud<pcl::PointXYZI>::Ptr target;    // ndt target of a new window (MAP_STREAMING), null: unchanged
+            Eigen::Matrix4f guess;
+            Eigen::Matrix4f result;
+            double score;
+            bool truncated;
+            bool relocalized;
+            bool reused;
+            int iterations;
+            double guess_gap;
+            double receive_time;
+            double preprocess_time, align_time;
+        };
+        // frames in flight: one per stage
+        static const int FRAME_NUM = 3;
+        // timed parts of the hot path
+        enum Stage{
+            STAGE_PREPROCESS,
+            STAGE_READ_CROP,
+            STAGE_DESKEW,
+            STAGE_VOXEL,
+            STAGE_LOCAL_MAP,
+            STAGE_ALIGN,
+            STAGE_FITNESS,
+            STAGE_PUBLISH,
+            STAGE_LATENCY,
+            STAGE_NUM
+        };
+
         ros::Publisher pc_pub;
         ros::Publisher map_pub;
+        ros::Publisher map_detail_pub;
+        ros::Publisher local_map_pub;
         ros::Publisher odom_pub;
+        ros::Publisher relocalize_pub;
+        ros::Publisher diag_pub;
+        ros::WallTimer diag_timer;
 
         ros::Subscriber pc_sub;
         ros::Subscriber odom_sub;
+        ros::Subscriber map_request_sub;
 
-        pcl::PointCloud<pcl::PointXYZI>::Ptr local_lidar_cloud;
         pcl::PointCloud<pcl::PointXYZI>::Ptr map_cloud;
         pcl::PointCloud<pcl::PointXYZI>::Ptr local_map_cloud;
-        pcl::PointCloud<pcl::PointXYZI>::Ptr ndt_cloud;
         pcl::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI> ndt;//default value
+        // coarser levels of the multi-resolution alignment (coarsest first), ndt is the finest one
+        typedef pcl::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI> NDT;
+        std::vector<std::unique_ptr<NDT> > coarse_ndt;
+        std::vector<double> coarse_resolutions;
+        // of the last ndt_matching() (align thread)
+        NDT* last_level;
+        int align_iterations;
+        bool align_truncated;
 
         std::string PARENT_FRAME, CHILD_FRAME;
         double VOXEL_SIZE, LIMIT_RANGE;
@@ -46,31 +148,219 @@ class Matcher{
         double CLOUD_MAP_OFFSET_PITCH;
         double CLOUD_MAP_OFFSET_YAW;
         double RESOLUTION;
+        std::string MULTI_RESOLUTION;
+        int COARSE_MAX_ITERATIONS;
+        int MAX_ITERATIONS;
+        double STEP_SIZE;
+        double TRANSFORMATION_EPSILON;
+        double ALIGN_TIME_BUDGET;
+        int ALIGN_CHUNK_ITERATIONS;
+        double TRUNCATED_VARIANCE_XY, TRUNCATED_VARIANCE_YAW;
+        double MAP_TILE_SIZE;
+        bool MAP_INTENSITY;     // intensity of the map kept in the compact tiles (for /vis/local_map)
+        // the map is read from a tile file around the robot instead of loaded as a whole
+        bool MAP_STREAMING;
+        // more ndt target points are streamed as well: the whole-map target, its kd-tree and voxel grids,
+        // the levels of detail and the relocalizer stay in memory otherwise (0: no limit)
+        int MAP_MAX_POINTS;
+        std::string MAP_TILE_FILE;
+        int MAP_CACHE_TILES;
+        double MAP_PREFETCH_DISTANCE;   // [m] ahead along the heading
+        // /vis/map and /vis/map_detail: levels of detail, points of one message at most
+        int MAP_VIS_LEVELS;
+        int MAP_VIS_MAX_POINTS;
+        double MIN_HEIGHT, MAX_HEIGHT;
+        int PREPROCESS_THREADS;
+        bool DESKEW;
+        double SCAN_PERIOD;
+        bool SCAN_STAMP_AT_END;
+        bool USE_MAP_CACHE;
+        std::string MAP_CACHE_FILE;
+        double DIAGNOSTICS_PERIOD;
+        double VIS_RATE;    // [Hz] of /vis/ndt and /vis/local_map at most (scan stamps), 0: every scan
+
+        std::string SCAN_POLICY;
+        int SCAN_QUEUE_SIZE;
+        ScanPolicy scan_policy;
+
+        std::string INITIAL_GUESS;
+        int POSE_HISTORY_SIZE;
+        double GUESS_MAX_EXTRAPOLATION;
+        GuessMode guess_mode;
 
-        ros::Time buffer_time;
-        sensor_msgs::PointCloud2 buffer_pc;
+        int RELOCALIZE_AFTER_FAILURES;
+        bool RELOCALIZE_ON_START;
+        std::string RELOCALIZE_ROI;
+        double RELOCALIZE_RESOLUTION, RELOCALIZE_XY_STEP;
+        int RELOCALIZE_YAW_STEPS, RELOCALIZE_POINTS, RELOCALIZE_CANDIDATES;
+        int RELOCALIZE_THREADS;
+        double relocalize_roi[4];   // x_min, x_max, y_min, y_max (x_min >= x_max: whole map)
+
+        // a scan is only aligned when the pose needs it (ADAPTIVE_MATCHING)
+        bool ADAPTIVE_MATCHING;
+        double ADAPTIVE_MIN_RATE, ADAPTIVE_MAX_RATE;    // [Hz] of aligned scans
+        double ADAPTIVE_DISTANCE, ADAPTIVE_ANGLE;       // since the last accepted match [m], [rad]
+        double ADAPTIVE_SIGMA_XY, ADAPTIVE_SIGMA_YAW;   // growth of the ekf sigma since then [m], [rad]
+        double STATIONARY_VELOCITY, STATIONARY_YAW_RATE;
+        // standing still (twist of /EKF/result: odom velocity, imu yaw rate) for STATIONARY_TIME with an
+        // unchanged scan, the last accepted pose is reused, aligned again every STATIONARY_RECHECK_PERIOD
+        bool STATIONARY_SKIP;
+        double STATIONARY_TIME, STATIONARY_RECHECK_PERIOD;
+        double STATIONARY_SCAN_TOLERANCE;
+
+        MapTileIndex map_index;
+        MapTileStore map_store;
+        MapLod map_lod;
+        std::atomic<bool> map_vis_ready;
+        // the ndt has a target (the whole map, or the window of the tile file)
+        std::atomic<bool> has_target;
+        // the ndt target is the window around the robot: MAP_STREAMING, or a map too large for one voxel grid
+        bool window_target;
+        ScanPreprocessor scan_preprocessor;
+        Relocalizer relocalizer;
+
+        std::mutex buffer_mutex;
+        std::condition_variable scan_cv;
+        std::deque<Scan> scan_queue;
         nav_msgs::Odometry buffer_odom;
+        PoseHistory pose_history;
+        std::atomic<bool> is_aligning;
+        // z, roll and pitch of the last accepted match (the ekf is planar)
+        bool has_last_match;
+        double last_match_z, last_match_roll, last_match_pitch;
+        // the next scan is relocalized globally instead of aligned from the guess
+        std::atomic<bool> relocalize_requested;
+        int consecutive_failures;
+        // /EKF/result far from the re-seed is from before it, ignored until this wall time
+        bool reseed_pending;
+        double reseed_deadline;
+        // adaptive matching: stamp of the last aligned scan, pose of the last accepted match and
+        // the smallest ekf variance since then (right after the match has been fused)
+        double last_aligned_stamp;
+        bool has_accepted_pose;
+        double accepted_x, accepted_y, accepted_yaw;
+        double min_variance_xy, min_variance_yaw;
+        // stamp of the /EKF/result since which the robot stands still (0: moving)
+        double stationary_since;
+        // last accepted alignment (align thread) and its scan: number of points, centroid in the sensor frame
+        bool has_reference_match;
+        double reference_stamp;
+        Eigen::Matrix4f reference_result;
+        double reference_score;
+        size_t reference_point_num;
+        Eigen::Vector3f reference_centroid;
+
+        // stamps of the last /vis/ndt and /vis/local_map, the local map changed since it was published
+        double last_vis_ndt_stamp, last_vis_local_map_stamp;
+        bool local_map_dirty;
+
+        uint64_t scan_seq;
+        ros::Time last_scan_stamp;
+        uint64_t processed_scans, skipped_scans, duplicate_scans, adaptive_skipped_scans;
+        std::atomic<uint64_t> truncated_alignments;
+        uint64_t relocalizations;
+        uint64_t reused_scans;
+        int frames_in_flight;
+
+        std::vector<std::unique_ptr<Frame> > frames;
+        SPSCQueue<Frame*> free_frames;      // publish    -> preprocess
+        SPSCQueue<Frame*> align_queue;      // preprocess -> align
+        SPSCQueue<Frame*> publish_queue;    // align      -> publish
+        std::atomic<bool> running;
+        std::thread preprocess_thread, align_thread, publish_thread;
 
+        std::function<void(const Result&)> result_callback;
+
+        // windows of DIAGNOSTICS_PERIOD, published on /diagnostics
+        LatencyHistogram stage_histograms[STAGE_NUM];
+        LatencyHistogram iteration_histogram;
+        LatencyHistogram guess_gap_histogram;
+        double map_load_time;
+        std::atomic<double> target_build_time;   // written by the align thread as well
+        size_t map_memory, target_memory;   // [byte] compact tiles, ndt target cloud
+        double relocalizer_build_time;
+        std::atomic<double> relocalize_time;     // written by the align thread
+
+        Matcher();
+        template<class ParamT>
+        void load_params(const ParamT& private_nh_);
+        void setup();
+
+        bool wait_for_scan(double timeout);
+        void preprocess_loop();
+        void align_loop();
+        void publish_loop();
+
+        // one stage of one scan, shared by the threads and process()
+        bool preprocess_frame(Frame* frame, const Scan& scan);
+        void align_frame(Frame* frame);
+        void publish_frame(Frame* frame);
+
+        void diagnostics_callback(const ros::WallTimerEvent& event);
+        // a new subscriber of /vis/map gets the overview, nobody else
+        void map_connect_callback(const ros::SingleSubscriberPublisher& pub);
+        // bounding box of the polygon as detailed as MAP_VIS_MAX_POINTS allows, on /vis/map_detail
+        void map_request_callback(const geometry_msgs::PolygonStampedConstPtr& msg);
+        void make_vis_map(const pcl::PointCloud<pcl::PointXYZI>& cloud, sensor_msgs::PointCloud2& msg);
+
+        // ADAPTIVE_MATCHING: whether the scan is aligned, from the ekf covariance, the motion since the
+        // last accepted match and the rate limits (buffer_mutex must be held); the caller takes the
+        // stamp as last_aligned_stamp once the scan is queued or aligned
+        bool needs_alignment(const ros::Time& stamp) const;
+        // standing still and the scan as at the last accepted alignment: its result (align thread)
+        bool reuse_reference(Frame* frame);
+        // pub has subscribers and VIS_RATE allows a message at stamp, which is taken as the last one then
+        bool vis_due(const ros::Publisher& pub, const ros::Time& stamp, double& last_stamp) const;
+
+        // initial guess at the scan stamp (buffer_mutex must be held)
+        Eigen::Matrix4f initial_guess(const ros::Time& stamp, double& gap);
+
+        // one level in chunks of ALIGN_CHUNK_ITERATIONS, false when the deadline has cut it short
+        bool align_level(NDT& level, pcl::PointCloud<pcl::PointXYZI>::Ptr cloud_src,
+                pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud, int max_iterations,
+                const ScopedTimer::Clock::time_point* deadline, Eigen::Matrix4f& pose);
+
+        // time_budget: ALIGN_TIME_BUDGET or 0 (no deadline)
         Eigen::Matrix4f ndt_matching(
-                pcl::PointCloud<pcl::PointXYZI>::Ptr cloud_tgt,
                 pcl::PointCloud<pcl::PointXYZI>::Ptr cloud_src,
-                pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud, nav_msgs::Odometry odo);
+                pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud, const Eigen::Matrix4f& init_guess, double time_budget);
 
+        // candidates of the relocalizer refined by ndt_matching(), the best one is frame->result
+        bool relocalize(Frame* frame);
 
-        void local_pc(
-                pcl::PointCloud<pcl::PointXYZI>::Ptr input_cloud,
-                pcl::PointCloud<pcl::PointXYZI>::Ptr& output_cloud,
-                double x_now,double y_now);
+
+        void preprocess_map(std::string filename, pcl::PointCloud<pcl::PointXYZI>::Ptr& map_target_cloud);
+        // MAP_STREAMING: the tile file is opened (made from the PCD the first time, or from the
+        // prepared ndt target points when given)
+        bool open_map_tiles(const std::string& filename,
+                pcl::PointCloud<pcl::PointXYZI>::Ptr map_target_cloud = pcl::PointCloud<pcl::PointXYZI>::Ptr());
+        // all levels, false when target is empty or too large for the voxel grid of RESOLUTION
+        bool set_target(const pcl::PointCloud<pcl::PointXYZI>::Ptr& target);
 
 
         void calc_rpy(Eigen::Matrix4f ans, double &yaw);
+        void calc_rpy(Eigen::Matrix4f ans, double &roll, double &pitch, double &yaw);
 
     public:
         Matcher(ros::NodeHandle n,ros::NodeHandle priv_nh);
+        // without ROS master (offline tools): nothing is advertised or subscribed
+        explicit Matcher(const ParamMap& param);
+        ~Matcher();
         void map_read(std::string filename);
-        void lidarcallback(const sensor_msgs::PointCloud2::Ptr msg);
+        void lidarcallback(const sensor_msgs::PointCloud2ConstPtr& msg);
         void odomcallback(const nav_msgs::OdometryConstPtr& msg);
-        void process();
+        void start();
+        void stop();
+
+        // called from the publish stage for every processed scan
+        void set_result_callback(const std::function<void(const Result&)>& callback) { result_callback = callback; }
+        // preprocess, align and publish one scan on the calling thread (only while the threads are stopped)
+        bool process(const sensor_msgs::PointCloud2ConstPtr& msg);
+        // no scan is waiting or in flight
+        bool is_idle();
+        // the next scan is relocalized globally (only when the relocalizer has been built in map_read)
+        void request_relocalization();
+        bool is_relocalizing() const { return relocalize_requested; }
 
         bool is_start;
 };
@@ -0,0 +1,99 @@
+#ifndef _MAP_TILE_INDEX_HPP_
+#define _MAP_TILE_INDEX_HPP_
+
+#include<vector>
+#include<unordered_map>
+#include<cstdint>
+
+#include<pcl/point_cloud.h>
+#include<pcl/point_types.h>
+
+
+/* 2D (x, y) tile index of the map cloud.
+ *
+ * build() sorts the map points by tile once, so that every tile is a
+ * contiguous range of points. update_window() keeps the local map (all tiles
+ * overlapping the square window around the robot) and only copies the tiles
+ * which entered or left the window since the last call.
+ *
+ * The points are stored compactly: 16-bit offsets from the origin of their tile
+ * (x, y over the tile size, z over the height range of the tile) and optionally
+ * a 16-bit intensity, 6 or 8 bytes instead of the 32 of pcl::PointXYZI.
+ * They are decoded on demand by query() / update_window(). With a tile size of
+ * 10 m the quantization step is 0.15 mm in x and y.
+ */
+class MapTileIndex{
+
+    public:
+        typedef pcl::PointCloud<pcl::PointXYZI> Cloud;
+
+        // compact points of one tile (e.g. to write them out)
+        struct TileView{
+            int ix, iy;
+            float origin[3];
+            float z_scale;
+            size_t num;
+            const uint16_t* coords;         // 3 * num
+            const uint16_t* intensities;    // num, NULL without intensity
+        };
+
+        // keep_intensity: false decodes every intensity as 0
+        explicit MapTileIndex(double tile_size = 10.0, bool keep_intensity = true);
+
+        void build(const Cloud& cloud);
+
+        // exact crop of [x_min, x_max] x [y_min, y_max], only visits the overlapping tiles
+        void query(double x_min, double x_max, double y_min, double y_max, Cloud& output) const;
+
+        // points of the tiles overlapping the area (an upper bound of query(), nothing is decoded)
+        size_t count(double x_min, double x_max, double y_min, double y_max) const;
+
+        // returns true when the set of tiles in the window has changed (output is updated)
+        bool update_window(double x_now, double y_now, double range, Cloud& output);
+
+        void reset_window();
+
+        double get_tile_size() const { return tile_size; }
+        size_t get_tile_num() const { return tiles.size(); }
+        size_t get_point_num() const { return coords.size() / 3; }
+        // of the compact points and the tile table
+        size_t get_memory_bytes() const;
+        bool has_intensity() const { return keep_intensity; }
+        float get_xy_scale() const { return xy_scale; }
+        float get_intensity_scale() const { return intensity_scale; }
+        void get_tiles(std::vector<TileView>& views) const;
+
+    private:
+        struct Tile{
+            size_t begin;       // range of the points
+            size_t end;
+            float origin[3];    // corner of the tile, lowest z
+            float z_scale;      // [m] per step of z
+        };
+        struct Segment{
+            uint64_t key;
+            size_t begin;
+            size_t size;
+        };
+
+        double tile_size;
+        bool keep_intensity;
+        float xy_scale;         // [m] per step of x, y
+        float intensity_scale;  // per step of the intensity
+        std::vector<uint16_t> coords;       // x, y, z of every point
+        std::vector<uint16_t> intensities;  // empty without keep_intensity
+        std::unordered_map<uint64_t, Tile> tiles;
+
+        bool has_window;
+        int win_min_ix, win_max_ix, win_min_iy, win_max_iy;
+        std::vector<Segment> window_segments;
+
+        int to_index(double v) const;
+        static uint64_t to_key(int ix, int iy);
+        static void from_key(uint64_t key, int &ix, int &iy);
+        void decode(const Tile& tile, size_t i, pcl::PointXYZI& p) const;
+        // all points of the tile appended
+        void append(const Tile& tile, Cloud& output) const;
+};
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef _MAP_TILE_STORE_HPP_
+#define _MAP_TILE_STORE_HPP_
+
+#include<string>
+#include<vector>
+#include<list>
+#include<unordered_map>
+#include<memory>
+#include<mutex>
+#include<condition_variable>
+#include<thread>
+#include<atomic>
+#include<cstdint>
+
+#include<pcl/point_cloud.h>
+#include<pcl/point_types.h>
+
+#include"map_tile_index.hpp"
+
+
+/* Out-of-core map: the compact tiles of MapTileIndex in one indexed file.
+ *
+ * As MapCache, the file is only used when the size / mtime of the source PCD
+ * and the preprocessing parameters (voxel size, offset, tile size, intensity)
+ * match the ones it was made with (set_source()), otherwise it is stale.
+ * open() only reads the tile table. The points of a tile are read from the
+ * file when it is needed and kept in an LRU cache of a bounded number of tiles.
+ * A background thread prefetches the tiles around the robot and ahead of it
+ * along the direction of travel, so that update_window() finds them in the
+ * cache and the caller does not wait for the disk.
+ */
+class MapTileStore{
+
+    public:
+        typedef pcl::PointCloud<pcl::PointXYZI> Cloud;
+
+        struct Stats{
+            uint64_t hits, misses;      // tiles of update_window() found / not found in the cache
+            uint64_t loads;             // read by update_window() itself (wait)
+            uint64_t prefetched;        // read by the prefetch thread
+            uint64_t evictions;
+        };
+
+        MapTileStore();
+        ~MapTileStore();
+
+        // the PCD and the parameters the tiles are made from
+        void set_source(const std::string& source_file, double voxel_size, const double offset[6],
+                double tile_size, bool keep_intensity);
+
+        // the tiles of index into file (written to a temporary file first)
+        bool save(const std::string& file, const MapTileIndex& index) const;
+
+        // cache_size: tiles kept in memory, grown to twice the window when smaller. false when the file
+        // is missing, stale or broken.
+        // the prefetch thread runs until close()
+        bool open(const std::string& file, size_t cache_size);
+        void close();
+        bool is_open() const { return fd >= 0; }
+
+        // tiles within range of (x, y) and of the points up to distance ahead along (dx, dy) (unit vector),
+        // only the latest request is served
+        void prefetch(double x, double y, double dx, double dy, double range, double distance);
+
+        // all tiles overlapping the square window, true when output has changed. Only the tiles which
+        // entered the window are decoded, the ones which left it are cut out (output is the window of
+        // the last call). Tiles which are not in the cache are read here with wait, otherwise they are
+        // left to the prefetch thread and a later call completes the window
+        bool update_window(double x_now, double y_now, double range, Cloud& output, bool wait);
+
+        double get_tile_size() const { return tile_size; }
+        size_t get_tile_num() const { return table.size(); }
+        size_t get_point_num() const { return point_num; }
+        // of the tile table and the cached tiles
+        size_t get_memory_bytes() const;
+        void get_stats(Stats& stats) const;
+
+    private:
+        struct Header{
+            char magic[8];
+            uint32_t version;
+            uint32_t keep_intensity;
+            uint64_t source_size;
+            int64_t source_mtime_sec;
+            int64_t source_mtime_nsec;
+            double voxel_size;
+            double offset[6];
+            double tile_size;
+            float xy_scale;
+            float intensity_scale;
+            uint64_t tile_num;
+        };
+        struct TileEntry{
+            int32_t ix, iy;
+            float origin[3];    // corner of the tile, lowest z
+            float z_scale;
+            uint64_t offset;    // of the points in the file [byte]
+            uint64_t num;
+        };
+        struct TileData{
+            std::vector<uint16_t> coords;       // x, y, z of every point
+            std::vector<uint16_t> intensities;  // empty without intensity
+        };
+        struct CacheEntry{
+            std::shared_ptr<const TileData> data;
+            std::list<uint64_t>::iterator lru;
+        };
+        // points of a decoded tile in the window
+        struct Segment{
+            uint64_t key;
+            size_t begin;
+            size_t size;
+        };
+        struct Request{
+            double x, y, dx, dy, range, distance;
+        };
+
+        std::string source_file;
+        double source_voxel_size;
+        double source_offset[6];
+        double source_tile_size;
+        bool source_keep_intensity;
+
+        int fd;
+        Header header;
+        double tile_size;
+        size_t point_num;
+        std::unordered_map<uint64_t, TileEntry> table;
+
+        // most recently used first
+        mutable std::mutex cache_mutex;
+        std::list<uint64_t> lru;
+        std::unordered_map<uint64_t, CacheEntry> cache;
+        size_t cache_size;
+        size_t cached_bytes;
+
+        bool has_window, window_complete;
+        int win_min_ix, win_max_ix, win_min_iy, win_max_iy;
+        std::vector<Segment> window_segments;
+
+        std::mutex request_mutex;
+        std::condition_variable request_cv;
+        bool has_request;
+        Request request;
+        std::atomic<bool> running;
+        std::thread prefetch_thread;
+
+        std::atomic<uint64_t> hits, misses, loads, prefetched, evictions;
+
+        // everything but the tile table and the scales, false when the source cannot be read
+        bool make_header(Header& header) const;
+        bool matches_source(const Header& header, const Header& expected) const;
+        int to_index(double v) const;
+        std::shared_ptr<const TileData> load(const TileEntry& entry) const;
+        // touches the tile
+        std::shared_ptr<const TileData> find(uint64_t key);
+        void insert(uint64_t key, const std::shared_ptr<const TileData>& data);
+        // keys of the tiles within range of (x, y) which are not in seen yet
+        void collect(double x, double y, double range, std::vector<uint64_t>& keys, std::unordered_map<uint64_t, bool>& seen) const;
+        void decode(const TileEntry& entry, const TileData& data, Cloud& output) const;
+        void prefetch_loop();
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _PARAM_MAP_HPP_
+#define _PARAM_MAP_HPP_
+
+#include<map>
+#include<string>
+#include<sstream>
+
+
+/* Parameters given as NAME:=value on the command line.
+ *
+ * param() has the same form as ros::NodeHandle::param(), so the classes which
+ * read their parameters through a template can be set up without a ROS master
+ * (offline tools such as the bag benchmark).
+ */
+class ParamMap{
+
+    public:
+        ParamMap() {}
+
+        // arguments which are not NAME:=value are left to the caller
+        void parse(int argc, char* argv[])
+        {
+            for(int i = 1; i < argc; i++){
+                const std::string arg(argv[i]);
+                const size_t pos = arg.find(":=");
+                if(pos == std::string::npos || pos == 0) continue;
+                // leading '_' is accepted as for private params of rosrun
+                const std::string name = arg.substr(arg[0] == '_' ? 1 : 0, pos - (arg[0] == '_' ? 1 : 0));
+                values[name] = arg.substr(pos + 2);
+            }
+        }
+
+        void set(const std::string& name, const std::string& value) { values[name] = value; }
+        bool has(const std::string& name) const { return values.count(name) > 0; }
+
+        template<class T>
+        bool param(const std::string& name, T& value, const T& default_value) const
+        {
+            std::map<std::string, std::string>::const_iterator it = values.find(name);
+            if(it == values.end() || !convert(it->second, value)){
+                value = default_value;
+                return false;
+            }
+            return true;
+        }
+
+        bool param(const std::string& name, std::string& value, const char* default_value) const
+        {
+            return param(name, value, std::string(default_value));
+        }
+
+        template<class T>
+        T param(const std::string& name, const T& default_value) const
+        {
+            T value;
+            param(name, value, default_value);
+            return value;
+        }
+
+    private:
+        std::map<std::string, std::string> values;
+
+        template<class T>
+        static bool convert(const std::string& text, T& value)
+        {
+            std::istringstream stream(text);
+            stream >> value;
+            return !stream.fail();
+        }
+
+        static bool convert(const std::string& text, std::string& value)
+        {
+            value = text;
+            return true;
+        }
+
+        static bool convert(const std::string& text, bool& value)
+        {
+            if(text == "true" || text == "True" || text == "1") value = true;
+            else if(text == "false" || text == "False" || text == "0") value = false;
+            else return false;
+            return true;
+        }
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef _POSE_HISTORY_HPP_
+#define _POSE_HISTORY_HPP_
+
+#include<deque>
+
+#include<Eigen/Core>
+#include<Eigen/Geometry>
+#include<Eigen/StdDeque>
+
+#include<nav_msgs/Odometry.h>
+
+
+/* Short history of stamped poses with their twist (e.g. /EKF/result).
+ *
+ * predict() gives the pose at any stamp: interpolated between the two samples
+ * around it, or extrapolated from the nearest sample with its twist (constant
+ * body velocity on SE(3)) when the stamp is outside the history.
+ */
+class PoseHistory{
+
+    public:
+        explicit PoseHistory(size_t capacity = 200, double max_extrapolation = 0.5);
+
+        void set_capacity(size_t capacity_) { capacity = capacity_ < 2 ? 2 : capacity_; }
+        // the extrapolation is clamped to this [s]
+        void set_max_extrapolation(double max_extrapolation_) { max_extrapolation = max_extrapolation_; }
+
+        // samples older than the newest one are ignored, the same stamp replaces the newest one
+        void add(const nav_msgs::Odometry& odom);
+        void clear() { samples.clear(); }
+        bool empty() const { return samples.empty(); }
+
+        // gap: time from the nearest sample to stamp [s] (0 when interpolated)
+        bool predict(double stamp, Eigen::Affine3d& pose, double& gap) const;
+
+    private:
+        struct Sample{
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+            double stamp;
+            Eigen::Vector3d position;
+            Eigen::Quaterniond orientation;
+            Eigen::Vector3d linear;     // body frame
+            Eigen::Vector3d angular;    // body frame
+        };
+
+        size_t capacity;
+        double max_extrapolation;
+        std::deque<Sample, Eigen::aligned_allocator<Sample> > samples;
+
+        static void extrapolate(const Sample& sample, double dt, Eigen::Affine3d& pose);
+};
+
+#endif
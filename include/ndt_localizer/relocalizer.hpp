@@ -0,0 +1,74 @@
+#ifndef _RELOCALIZER_HPP_
+#define _RELOCALIZER_HPP_
+
+#include<vector>
+#include<cstdint>
+
+#include<pcl/point_cloud.h>
+#include<pcl/point_types.h>
+
+
+/* Global relocalization: exhaustive search of (x, y, yaw) with a coarse NDT grid.
+ *
+ * build() puts the map into a dense grid of NDT cells (mean, inverse covariance)
+ * at a coarse resolution and marks the mapped (x, y) positions of the region.
+ * search() scores every candidate pose (mapped positions every xy_step x yaw_steps
+ * headings) by the NDT likelihood of a subsample of the scan above the ground, in
+ * parallel on all cores (OpenMP), and returns the best distinct candidates for the
+ * refinement with the full NDT.
+ */
+class Relocalizer{
+
+    public:
+        typedef pcl::PointCloud<pcl::PointXYZI> Cloud;
+
+        struct Candidate{
+            double x, y, z, yaw;
+            double score;   // sum of the NDT likelihood of the sampled points (larger is better)
+        };
+
+        Relocalizer();
+
+        void set_resolution(double resolution_) { resolution = resolution_; }
+        void set_xy_step(double xy_step_) { xy_step = xy_step_; }
+        void set_yaw_steps(int yaw_steps_) { yaw_steps = yaw_steps_ < 1 ? 1 : yaw_steps_; }
+        void set_sample_num(int sample_num_) { sample_num = sample_num_ < 1 ? 1 : sample_num_; }
+        void set_candidate_num(int candidate_num_) { candidate_num = candidate_num_ < 1 ? 1 : candidate_num_; }
+        // 0: all cores
+        void set_num_threads(int num_threads_) { num_threads = num_threads_ < 0 ? 0 : num_threads_; }
+
+        // candidates within [x_min, x_max] x [y_min, y_max] (the whole map when x_min >= x_max),
+        // range: scan range, the grid covers the region and this margin
+        bool build(const Cloud& map, double x_min, double x_max, double y_min, double y_max, double range);
+        bool is_built() const { return !cells.empty(); }
+
+        // scan in the sensor frame. the candidates are as high above the ground of their column
+        // as the sensor is above the ground of the scan.
+        // candidates: best first, none within two xy_steps and two yaw steps of a better one
+        bool search(const Cloud& scan, std::vector<Candidate>& candidates) const;
+
+        size_t get_position_num() const { return positions.size() / 3; }
+
+    private:
+        struct Cell{
+            float mean[3];
+            float inverse[6];   // xx, xy, xz, yy, yz, zz
+        };
+
+        double resolution;
+        double xy_step;
+        int yaw_steps;
+        int sample_num;
+        int candidate_num;
+        int num_threads;
+
+        // dense grid of cell indices (-1: no cell)
+        double origin[3];
+        int size[3];
+        std::vector<int32_t> grid;
+        std::vector<Cell> cells;
+        // mapped candidate positions (x, y, lowest z of the column)
+        std::vector<float> positions;
+};
+
+#endif
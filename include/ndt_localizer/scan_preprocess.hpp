@@ -0,0 +1,90 @@
+#ifndef _SCAN_PREPROCESS_HPP_
+#define _SCAN_PREPROCESS_HPP_
+
+#include<vector>
+#include<cstdint>
+
+#include<sensor_msgs/PointCloud2.h>
+
+#include<pcl/point_cloud.h>
+#include<pcl/point_types.h>
+
+#include"latency_histogram.hpp"
+
+
+/* Conversion of the received scans into the working cloud of the matcher.
+ *
+ * The PointCloud2 byte buffer is read directly (no pcl::fromROSMsg), and the
+ * XY range crop, the optional height band and the voxel downsample are fused
+ * into the conversion:
+ *   1. read + crop + band into flat (SoA) buffers   (OpenMP)
+ *      with deskew: read + point time, then motion compensation + crop + band (OpenMP simd)
+ *   2. voxel keys of the kept points                  (OpenMP simd)
+ *   3. centroid accumulation in an open addressing hash table
+ * A voxel is floor(p / voxel_size) as in pcl::VoxelGrid, and its point is the
+ * centroid of x, y, z and intensity, so the output equals VoxelGrid up to the
+ * order of the points and float rounding. All buffers are reused between scans.
+ *
+ * Deskew moves every point into the sensor frame at the header stamp, with a
+ * constant planar velocity and yaw rate over the sweep (set_motion()). The point
+ * time is taken from the "time" (float32 [s] from the sweep start), "t" (uint32
+ * [ns] from the sweep start) or "timestamp" (float64, absolute [s]) field, else
+ * from the column of an organized cloud or the azimuth (clockwise rotation).
+ */
+class ScanPreprocessor{
+
+    public:
+        typedef pcl::PointCloud<pcl::PointXYZI> Cloud;
+
+        ScanPreprocessor();
+
+        void set_range(double range_) { range = range_; }
+        // points outside [z_min, z_max] are removed, disabled when z_min >= z_max
+        void set_height_band(double z_min, double z_max) { height_min = z_min; height_max = z_max; }
+        // no downsample when voxel_size <= 0
+        void set_voxel_size(double voxel_size_) { voxel_size = voxel_size_; }
+        void set_num_threads(int num_threads_) { num_threads = num_threads_ < 1 ? 1 : num_threads_; }
+        // step 1 and steps 2 + 3 are timed into these (null: not timed)
+        void set_histograms(LatencyHistogram* read_crop, LatencyHistogram* voxel) { read_crop_histogram = read_crop; voxel_histogram = voxel; }
+        void set_deskew_histogram(LatencyHistogram* deskew) { deskew_histogram = deskew; }
+
+        // scan_period [s], stamp_at_end: the header stamp is the end of the sweep (velodyne driver), else its start
+        void set_deskew(bool enable, double scan_period_, bool stamp_at_end_) { deskew = enable; scan_period = scan_period_; stamp_at_end = stamp_at_end_; }
+        // motion of the sensor during the next scan: velocity [m/s] and yaw rate [rad/s] in the sensor frame
+        void set_motion(double vx, double vy, double yaw_rate_) { velocity_x = vx; velocity_y = vy; yaw_rate = yaw_rate_; }
+
+        bool convert(const sensor_msgs::PointCloud2& msg, Cloud& output);
+
+    private:
+        struct Voxel{
+            uint64_t key;
+            float x, y, z, intensity;
+            uint32_t count;
+            uint32_t generation;
+        };
+
+        double range;
+        double height_min, height_max;
+        double voxel_size;
+        int num_threads;
+        LatencyHistogram* read_crop_histogram;
+        LatencyHistogram* voxel_histogram;
+        LatencyHistogram* deskew_histogram;
+
+        bool deskew;
+        double scan_period;
+        bool stamp_at_end;
+        double velocity_x, velocity_y, yaw_rate;
+
+        std::vector<float> buffer_x, buffer_y, buffer_z, buffer_i, buffer_t;
+        std::vector<uint8_t> buffer_valid;
+        std::vector<uint64_t> keys;
+
+        std::vector<Voxel> table;
+        std::vector<uint32_t> order;
+        uint32_t generation;
+
+        void prepare_table(size_t num);
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef _SPSC_QUEUE_HPP_
+#define _SPSC_QUEUE_HPP_
+
+#include<atomic>
+#include<vector>
+#include<thread>
+#include<chrono>
+#include<cstddef>
+
+
+/* Bounded lock-free queue for exactly one producer thread and one consumer thread.
+ *
+ * push() fails when the queue is full and pop() fails when it is empty, neither blocks.
+ * wait_pop() polls with a backoff (up to 1 ms) until a value arrives or running turns false.
+ */
+template<typename T>
+class SPSCQueue{
+
+    public:
+        explicit SPSCQueue(size_t capacity) :
+            buffer(capacity + 1),
+            head(0),
+            tail(0)
+        {
+        }
+
+        bool push(const T& value)
+        {
+            const size_t t = tail.load(std::memory_order_relaxed);
+            const size_t next = increment(t);
+            if(next == head.load(std::memory_order_acquire)) return false;
+            buffer[t] = value;
+            tail.store(next, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T& value)
+        {
+            const size_t h = head.load(std::memory_order_relaxed);
+            if(h == tail.load(std::memory_order_acquire)) return false;
+            value = buffer[h];
+            head.store(increment(h), std::memory_order_release);
+            return true;
+        }
+
+        bool wait_pop(T& value, const std::atomic<bool>& running)
+        {
+            int sleep_us = 10;
+            while(!pop(value)){
+                if(!running) return false;
+                std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+                if(sleep_us < 1000) sleep_us *= 2;
+            }
+            return true;
+        }
+
+        bool empty() const
+        {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+        }
+
+        size_t capacity() const { return buffer.size() - 1; }
+
+    private:
+        std::vector<T> buffer;
+        // producer and consumer indices on separate cache lines
+        // (padding instead of alignas, so that owners can be created with plain new in C++11)
+        char pad0[64];
+        std::atomic<size_t> head;
+        char pad1[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> tail;
+        char pad2[64 - sizeof(std::atomic<size_t>)];
+
+        size_t increment(size_t i) const { return (i + 1 == buffer.size()) ? 0 : i + 1; }
+};
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef _TIMING_DIAGNOSTICS_HPP_
+#define _TIMING_DIAGNOSTICS_HPP_
+
+#include<cstdio>
+#include<string>
+
+#include<diagnostic_msgs/KeyValue.h>
+
+#include"latency_histogram.hpp"
+
+
+// "n: 20 p50: 12.10 p95: 15.02 p99: 17.33 max: 18.00", values multiplied by scale (1e-6 for ns -> ms)
+inline diagnostic_msgs::KeyValue
+histogram_key_value(const std::string& key, const LatencyHistogram::Snapshot& snapshot, double scale)
+{
+    char buffer[128];
+    std::snprintf(buffer, sizeof(buffer), "n: %llu p50: %.2f p95: %.2f p99: %.2f max: %.2f",
+            static_cast<unsigned long long>(snapshot.num),
+            snapshot.percentile(0.50) * scale, snapshot.percentile(0.95) * scale,
+            snapshot.percentile(0.99) * scale, snapshot.max * scale);
+    diagnostic_msgs::KeyValue key_value;
+    key_value.key = key;
+    key_value.value = buffer;
+    return key_value;
+}
+
+template<class T>
+inline diagnostic_msgs::KeyValue
+make_key_value(const std::string& key, const T& value)
+{
+    diagnostic_msgs::KeyValue key_value;
+    key_value.key = key;
+    key_value.value = std::to_string(value);
+    return key_value;
+}
+
+#endif
@@ -0,0 +1,423 @@
+/* bag_benchmark.cpp
+ *
+ * offline replay of a rosbag through the matcher and the EKF (no ROS master)
+ *
+ * usage:
+ *   rosrun ndt_localizer bag_benchmark BAG_FILE:=<bag> MAP_FILE:=<pcd> [REFERENCE_FILE:=<txt>] [RATE:=0] ...
+ *
+ *   RATE            0: as fast as possible (every scan is matched, stages run on the calling thread)
+ *                   r > 0: r times the recorded speed through the matcher threads (scans may be skipped)
+ *   SCAN_TOPIC, ODOM_TOPIC, IMU_TOPIC     topics in the bag (/velodyne_points, /odom, /imu/data)
+ *   REFERENCE_FILE  reference trajectory, one "stamp x y z qx qy qz qw" per line (TUM format)
+ *   OUTPUT_FILE     the EKF trajectory is written in the same format
+ *   EKF_HZ          rate of the EKF step in bag time (20)
+ *   QUIET           suppress the per-scan output of the matcher and the EKF (true)
+ * all other NAME:=value are the params of map_match and ekf,
+ * e.g. INITIAL_GUESS:=latest / predicted to compare the ndt iterations of the two initial guesses.
+ * the bag has to contain the scans as sensor_msgs/PointCloud2.
+ *
+*/
+
+#include<iostream>
+#include<iomanip>
+#include<fstream>
+#include<sstream>
+#include<vector>
+#include<deque>
+#include<mutex>
+#include<algorithm>
+#include<cmath>
+
+#include<ros/ros.h>
+#include<rosbag/bag.h>
+#include<rosbag/view.h>
+#include<tf/tf.h>
+
+#ifdef USE_NDT_OMP
+#include"map_match_omp.hpp"
+#else
+#include"map_match.hpp"
+#endif
+#include"ndt_localizer/ekf_localizer.hpp"
+#include"param_map.hpp"
+
+namespace{
+
+double
+normalize_angle(double angle)
+{
+    return atan2(sin(angle), cos(angle));
+}
+
+std::string
+strip_slash(const std::string& topic)
+{
+    return (!topic.empty() && topic[0] == '/') ? topic.substr(1) : topic;
+}
+
+
+class LatencyStats{
+
+    public:
+        explicit LatencyStats(const std::string& name_) : name(name_) {}
+
+        void add(double sec) { samples.push_back(sec * 1e3); }
+
+        void print(std::ostream& os) const
+        {
+            os << std::left << std::setw(12) << name << std::right;
+            if(samples.empty()){
+                os << " no samples" << std::endl;
+                return;
+            }
+            std::vector<double> sorted(samples);
+            std::sort(sorted.begin(), sorted.end());
+            double sum = 0;
+            for(double v : sorted) sum += v;
+            os << std::fixed << std::setprecision(3)
+               << std::setw(8) << sorted.size()
+               << std::setw(10) << sum / sorted.size()
+               << std::setw(10) << percentile(sorted, 0.5)
+               << std::setw(10) << percentile(sorted, 0.9)
+               << std::setw(10) << percentile(sorted, 0.99)
+               << std::setw(10) << sorted.back() << std::endl;
+        }
+
+        static void print_header(std::ostream& os)
+        {
+            os << std::left << std::setw(12) << "[ms]" << std::right
+               << std::setw(8) << "n" << std::setw(10) << "mean" << std::setw(10) << "p50"
+               << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "max" << std::endl;
+        }
+
+    private:
+        std::string name;
+        std::vector<double> samples;
+
+        static double percentile(const std::vector<double>& sorted, double p)
+        {
+            const size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+            return sorted[std::min(index, sorted.size() - 1)];
+        }
+};
+
+
+struct Pose2D{
+    double stamp;
+    double x, y, yaw;
+};
+
+
+class Trajectory{
+
+    public:
+        bool load(const std::string& filename)
+        {
+            std::ifstream ifs(filename.c_str());
+            if(!ifs) return false;
+            std::string line;
+            while(std::getline(ifs, line)){
+                if(line.empty() || line[0] == '#') continue;
+                std::istringstream iss(line);
+                double t, x, y, z, qx, qy, qz, qw;
+                if(!(iss >> t >> x >> y >> z >> qx >> qy >> qz >> qw)) continue;
+                Pose2D pose;
+                pose.stamp = t;
+                pose.x = x;
+                pose.y = y;
+                pose.yaw = tf::getYaw(tf::Quaternion(qx, qy, qz, qw));
+                poses.push_back(pose);
+            }
+            std::sort(poses.begin(), poses.end(),
+                    [](const Pose2D& a, const Pose2D& b){ return a.stamp < b.stamp; });
+            return !poses.empty();
+        }
+
+        // linear interpolation, no extrapolation
+        bool interpolate(double stamp, Pose2D& pose) const
+        {
+            if(poses.empty() || stamp < poses.front().stamp || poses.back().stamp < stamp) return false;
+            std::vector<Pose2D>::const_iterator it = std::lower_bound(poses.begin(), poses.end(), stamp,
+                    [](const Pose2D& p, double t){ return p.stamp < t; });
+            if(it == poses.begin()){
+                pose = *it;
+                return true;
+            }
+            const Pose2D& p0 = *(it - 1);
+            const Pose2D& p1 = *it;
+            const double a = (p1.stamp > p0.stamp) ? (stamp - p0.stamp) / (p1.stamp - p0.stamp) : 0.0;
+            pose.stamp = stamp;
+            pose.x = p0.x + a * (p1.x - p0.x);
+            pose.y = p0.y + a * (p1.y - p0.y);
+            pose.yaw = normalize_angle(p0.yaw + a * normalize_angle(p1.yaw - p0.yaw));
+            return true;
+        }
+
+        bool empty() const { return poses.empty(); }
+        const Pose2D& front() const { return poses.front(); }
+
+    private:
+        std::vector<Pose2D> poses;
+};
+
+
+class PoseError{
+
+    public:
+        explicit PoseError(const std::string& name_) : name(name_), sum_sq(0), sum(0), max(0), yaw_sum(0), yaw_max(0), num(0) {}
+
+        void add(const Trajectory& reference, const nav_msgs::Odometry& odom)
+        {
+            Pose2D ref;
+            if(!reference.interpolate(odom.header.stamp.toSec(), ref)) return;
+            const double dx = odom.pose.pose.position.x - ref.x;
+            const double dy = odom.pose.pose.position.y - ref.y;
+            const double d = sqrt(dx * dx + dy * dy);
+            const double dyaw = fabs(normalize_angle(tf::getYaw(odom.pose.pose.orientation) - ref.yaw));
+            sum += d;
+            sum_sq += d * d;
+            max = std::max(max, d);
+            yaw_sum += dyaw;
+            yaw_max = std::max(yaw_max, dyaw);
+            num++;
+        }
+
+        void print(std::ostream& os) const
+        {
+            os << std::left << std::setw(12) << name << std::right;
+            if(num == 0){
+                os << " no poses in the reference time range" << std::endl;
+                return;
+            }
+            os << std::fixed << std::setprecision(3)
+               << "n: " << num
+               << "  trans mean: " << sum / num << " rmse: " << sqrt(sum_sq / num) << " max: " << max << " [m]"
+               << "  yaw mean: " << yaw_sum / num * 180.0 / M_PI << " max: " << yaw_max * 180.0 / M_PI << " [deg]" << std::endl;
+        }
+
+    private:
+        std::string name;
+        double sum_sq, sum, max;
+        double yaw_sum, yaw_max;
+        size_t num;
+};
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    ParamMap param;
+    param.parse(argc, argv);
+
+    std::string bag_file, map_file, reference_file, output_file;
+    std::string scan_topic, odom_topic, imu_topic;
+    double rate, ekf_hz;
+    bool quiet;
+    param.param("BAG_FILE", bag_file, {""});
+    param.param("MAP_FILE", map_file, {""});
+    param.param("REFERENCE_FILE", reference_file, {""});
+    param.param("OUTPUT_FILE", output_file, {""});
+    param.param("SCAN_TOPIC", scan_topic, {"/velodyne_points"});
+    param.param("ODOM_TOPIC", odom_topic, {"/odom"});
+    param.param("IMU_TOPIC", imu_topic, {"/imu/data"});
+    param.param("RATE", rate, {0.0});
+    param.param("EKF_HZ", ekf_hz, {20.0});
+    param.param("QUIET", quiet, {true});
+
+    if(bag_file.empty() || map_file.empty()){
+        std::cout << "usage: bag_benchmark BAG_FILE:=<bag> MAP_FILE:=<pcd> [REFERENCE_FILE:=<txt>] [RATE:=0] [NAME:=value ...]" << std::endl;
+        return 1;
+    }
+
+    // ros::Time is used by the matcher, the wall clock is enough here
+    ros::Time::init();
+
+    Trajectory reference;
+    if(!reference_file.empty()){
+        if(!reference.load(reference_file)){
+            std::cout << "\033[31mcannot read reference trajectory: " << reference_file << "\033[0m" << std::endl;
+            return 1;
+        }
+        // the EKF starts from the reference unless an initial pose is given
+        if(!param.has("INIT_X")){
+            std::ostringstream x, y, yaw;
+            x << std::setprecision(10) << reference.front().x;
+            y << std::setprecision(10) << reference.front().y;
+            yaw << std::setprecision(10) << reference.front().yaw;
+            param.set("INIT_X", x.str());
+            param.set("INIT_Y", y.str());
+            param.set("INIT_YAW", yaw.str());
+        }
+    }
+    if(!param.has("mode_pointing_ini_pose_on_rviz")) param.set("mode_pointing_ini_pose_on_rviz", "false");
+
+    Matcher matcher(param);
+    EKFLocalizer ekf(param);
+    matcher.map_read(map_file);
+
+    rosbag::Bag bag;
+    try{
+        bag.open(bag_file, rosbag::bagmode::Read);
+    }catch(const rosbag::BagException& e){
+        std::cout << "\033[31mcannot open bag: " << e.what() << "\033[0m" << std::endl;
+        return 1;
+    }
+    std::vector<std::string> topics;
+    topics.push_back(scan_topic);
+    topics.push_back(odom_topic);
+    topics.push_back(imu_topic);
+    rosbag::View view(bag, rosbag::TopicQuery(topics));
+
+    std::ofstream output;
+    if(!output_file.empty()) output.open(output_file.c_str());
+
+    std::mutex result_mutex;
+    std::deque<Matcher::Result> results;
+    matcher.set_result_callback([&](const Matcher::Result& result){
+        std::lock_guard<std::mutex> lock(result_mutex);
+        results.push_back(result);
+    });
+
+    LatencyStats preprocess_stats("preprocess"), align_stats("align"), publish_stats("publish");
+    LatencyStats latency_stats("scan->pose"), ekf_stats("ekf step"), guess_gap_stats("guess gap");
+    PoseError ndt_error("ndt"), ekf_error("ekf");
+    uint64_t bag_scans = 0, matched_scans = 0, accepted_scans = 0, truncated_scans = 0, relocalized_scans = 0, reused_scans = 0;
+    uint64_t ndt_iterations = 0;
+    int max_ndt_iterations = 0;
+    bool ekf_started = false;
+
+    // matching results go into the EKF as /NDT/result does
+    auto drain_results = [&](){
+        std::deque<Matcher::Result> done;
+        {
+            std::lock_guard<std::mutex> lock(result_mutex);
+            done.swap(results);
+        }
+        for(const Matcher::Result& result : done){
+            preprocess_stats.add(result.preprocess_time);
+            align_stats.add(result.align_time);
+            publish_stats.add(result.publish_time);
+            latency_stats.add(result.latency);
+            guess_gap_stats.add(std::fabs(result.guess_gap));
+            ndt_iterations += result.iterations;
+            max_ndt_iterations = std::max(max_ndt_iterations, result.iterations);
+            matched_scans++;
+            if(result.truncated) truncated_scans++;
+            if(result.reused) reused_scans++;
+            // the re-seed goes into the EKF as /NDT/relocalized does
+            if(result.relocalized){
+                relocalized_scans++;
+                geometry_msgs::PoseStampedPtr pose(new geometry_msgs::PoseStamped);
+                pose->header = result.odom.header;
+                pose->pose = result.odom.pose.pose;
+                ekf.relocalizeCallback(pose);
+                continue;
+            }
+            if(!result.accepted) continue;
+            accepted_scans++;
+            ndt_error.add(reference, result.odom);
+            ekf.ndtCallback(nav_msgs::OdometryConstPtr(new nav_msgs::Odometry(result.odom)));
+        }
+    };
+
+    // EKF step and /EKF/result -> matcher, as the timer of the ekf node does
+    auto step_ekf = [&](double now_time){
+        drain_results();
+        double start_time = ros::WallTime::now().toSec();
+        if(!ekf.update(now_time)) return;
+        ekf_stats.add(ros::WallTime::now().toSec() - start_time);
+        const nav_msgs::Odometry& odom = ekf.get_odom();
+        matcher.odomcallback(nav_msgs::OdometryConstPtr(new nav_msgs::Odometry(odom)));
+        ekf_started = true;
+        ekf_error.add(reference, odom);
+        if(output.is_open()){
+            tf::Quaternion q;
+            q.setRPY(0, 0, tf::getYaw(odom.pose.pose.orientation));
+            output << std::fixed << std::setprecision(6) << odom.header.stamp.toSec() << " "
+                   << odom.pose.pose.position.x << " " << odom.pose.pose.position.y << " " << odom.pose.pose.position.z << " "
+                   << q.x() << " " << q.y() << " " << q.z() << " " << q.w() << std::endl;
+        }
+    };
+
+    std::cout << "replaying " << bag_file << " (" << (rate > 0 ? "rate " : "as fast as possible") ;
+    if(rate > 0) std::cout << rate;
+    std::cout << ")" << std::endl;
+    if(quiet) std::cout.setstate(std::ios::failbit);
+
+    if(rate > 0) matcher.start();
+
+    double bag_start = -1, bag_end = 0, wall_start = 0, next_tick = 0;
+    for(const rosbag::MessageInstance& m : view){
+        const double bag_time = m.getTime().toSec();
+        if(bag_start < 0){
+            bag_start = bag_time;
+            wall_start = ros::WallTime::now().toSec();
+            next_tick = bag_time;
+        }
+        bag_end = bag_time;
+
+        if(rate > 0){
+            const double wait = wall_start + (bag_time - bag_start) / rate - ros::WallTime::now().toSec();
+            if(wait > 0) ros::WallDuration(wait).sleep();
+        }
+        while(next_tick <= bag_time){
+            step_ekf(next_tick);
+            next_tick += 1.0 / ekf_hz;
+        }
+
+        const std::string topic = strip_slash(m.getTopic());
+        if(topic == strip_slash(scan_topic)){
+            sensor_msgs::PointCloud2ConstPtr scan = m.instantiate<sensor_msgs::PointCloud2>();
+            if(!scan) continue;
+            bag_scans++;
+            if(rate > 0){
+                matcher.lidarcallback(scan);
+            }else if(ekf_started || matcher.is_relocalizing()){
+                matcher.process(scan);
+                drain_results();
+            }
+        }else if(topic == strip_slash(odom_topic)){
+            nav_msgs::OdometryConstPtr odom = m.instantiate<nav_msgs::Odometry>();
+            if(odom) ekf.odomCallback(odom);
+        }else if(topic == strip_slash(imu_topic)){
+            sensor_msgs::ImuConstPtr imu = m.instantiate<sensor_msgs::Imu>();
+            if(imu) ekf.imuCallback(imu);
+        }
+    }
+
+    if(rate > 0){
+        while(!matcher.is_idle()) ros::WallDuration(0.001).sleep();
+        matcher.stop();
+    }
+    drain_results();
+    const double wall_time = ros::WallTime::now().toSec() - wall_start;
+    bag.close();
+
+    std::cout.clear();
+    std::cout << std::endl << "=== bag_benchmark ===" << std::endl;
+    std::cout << "bag duration: " << bag_end - bag_start << " [s], replay: " << wall_time << " [s] ("
+              << (wall_time > 0 ? (bag_end - bag_start) / wall_time : 0.0) << "x real time)" << std::endl;
+    std::cout << "scans: " << bag_scans << ", matched: " << matched_scans << ", accepted: " << accepted_scans
+              << ", not matched: " << bag_scans - matched_scans << ", truncated: " << truncated_scans
+              << ", relocalized: " << relocalized_scans << ", reused (stationary): " << reused_scans << std::endl;
+    std::cout << "throughput: " << (wall_time > 0 ? matched_scans / wall_time : 0.0) << " [scan/s]" << std::endl;
+    // compare INITIAL_GUESS:=predicted and INITIAL_GUESS:=latest on the same bag
+    std::cout << "ndt iterations: mean " << (matched_scans > 0 ? static_cast<double>(ndt_iterations) / matched_scans : 0.0)
+              << ", max " << max_ndt_iterations << std::endl;
+    std::cout << std::endl;
+    LatencyStats::print_header(std::cout);
+    preprocess_stats.print(std::cout);
+    align_stats.print(std::cout);
+    publish_stats.print(std::cout);
+    latency_stats.print(std::cout);
+    ekf_stats.print(std::cout);
+    guess_gap_stats.print(std::cout);
+    if(!reference.empty()){
+        std::cout << std::endl << "pose error against " << reference_file << std::endl;
+        ndt_error.print(std::cout);
+        ekf_error.print(std::cout);
+    }
+
+    return 0;
+}
@@ -6,27 +6,39 @@
  *
 */
 
-#include <ros/ros.h>
-#include <sensor_msgs/Imu.h>
-#include <std_msgs/Bool.h>
+#include <iostream>
 
 #include <tf/tf.h>
 
-sensor_msgs::Imu imu_data;
+#include "ndt_localizer/drift_imu.hpp"
 
-bool received_flag = false;
-double offset_yawrate = 0;
-const double OFFSET_YAWRATE = 0.00206676;
-const double SAVE_DURATION= 5.0;
-const double ROTATION_RATE = 0.20;
+const double DriftImu::OFFSET_YAWRATE = 0.00206676;
+const double DriftImu::SAVE_DURATION= 5.0;
 
-void imu_callback(const sensor_msgs::ImuConstPtr& msg)
+DriftImu::DriftImu(ros::NodeHandle nh, ros::NodeHandle local_nh) :
+    received_flag(false),
+    offset_yawrate(0),
+    first_flag(false),
+    yawrate_(0),
+    imu_count(0)
+{
+    // can be raised when map_match deskews the scans (DESKEW)
+    local_nh.param("ROTATION_RATE", ROTATION_RATE, {0.20});
+
+    std::cout << "SAVE_DURATION : " << SAVE_DURATION<<" [s]"<<std::endl;
+    std::cout << "ROTATION_RATE : " << ROTATION_RATE << std::endl;
+
+    imu_sub = nh.subscribe("/imu/data", 10, &DriftImu::imu_callback, this);
+
+    imu_pub = nh.advertise<sensor_msgs::Imu>("/imu/data/calibrated", 100);
+    notmatching_pub = nh.advertise<std_msgs::Bool>("/not_matching", 100);
+
+    timer = nh.createTimer(ros::Duration(1.0 / 50), &DriftImu::timer_callback, this);
+}
+
+void DriftImu::imu_callback(const sensor_msgs::ImuConstPtr& msg)
 {
     imu_data = *msg;
-    static bool first_flag = false;
-    static double yawrate_ = 0;
-    static int imu_count = 0;
-    static ros::Time first_time;
 
     if(!first_flag){
         first_time = msg->header.stamp;
@@ -46,50 +58,31 @@ void imu_callback(const sensor_msgs::ImuConstPtr& msg)
     }
 }
 
-void not_matching(double yaw_velo, ros::Publisher pub){
-    std_msgs::Bool is_notmatch;
+void DriftImu::not_matching(double yaw_velo){
+    std_msgs::BoolPtr is_notmatch(new std_msgs::Bool);
 
     if(yaw_velo < (-1) * ROTATION_RATE || ROTATION_RATE < yaw_velo){
         // std::cout<<"\r回転なう"<<std::flush;
-        is_notmatch.data = true;
+        is_notmatch->data = true;
     }
     else {
         // std::cout<<"\r-------"<<std::flush;
-        is_notmatch.data = false;
+        is_notmatch->data = false;
     }
 
-    pub.publish(is_notmatch);
+    notmatching_pub.publish(is_notmatch);
 
 }
 
-int main(int argc, char** argv)
+void DriftImu::timer_callback(const ros::TimerEvent& event)
 {
-    ros::init(argc, argv, "drift_imu");
-    ros::NodeHandle nh;
-    ros::NodeHandle local_nh("~");
-    ROS_INFO("\033[1;32m---->\033[0m drift_imu Started.");
-    std::cout << "SAVE_DURATION : " << SAVE_DURATION<<" [s]"<<std::endl;
-    std::cout << "ROTATION_RATE : " << ROTATION_RATE << std::endl;
-
-    ros::Subscriber imu_sub = nh.subscribe("/imu/data", 10, imu_callback);
-
-    ros::Publisher imu_pub = nh.advertise<sensor_msgs::Imu>("/imu/data/calibrated", 100);
-    ros::Publisher notmatching_pub = nh.advertise<std_msgs::Bool>("/not_matching", 100);
-
-    ros::Rate loop_rate(50);
-
-    while(ros::ok()){
-        if(received_flag){
-            // imu_data.angular_velocity.z -= OFFSET_YAWRATE;
-            imu_data.angular_velocity.z -= offset_yawrate;
-            imu_pub.publish(imu_data);
-            not_matching(imu_data.angular_velocity.z, notmatching_pub);
-
-            received_flag = false;
-        }
-
-        ros::spinOnce();
-        loop_rate.sleep();
+    if(received_flag){
+        // imu_data.angular_velocity.z -= OFFSET_YAWRATE;
+        imu_data.angular_velocity.z -= offset_yawrate;
+        // published as a shared pointer, so that nodelets in the same manager receive it without a copy
+        imu_pub.publish(sensor_msgs::ImuPtr(new sensor_msgs::Imu(imu_data)));
+        not_matching(imu_data.angular_velocity.z);
+
+        received_flag = false;
     }
-    return 0;
 }
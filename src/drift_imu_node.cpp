@@ -0,0 +1,24 @@
+/* drift_imu_node.cpp
+ *
+ * 2019.08.25
+ *
+ * author : R.Kusakari
+ *
+*/
+
+#include <ros/ros.h>
+
+#include "ndt_localizer/drift_imu.hpp"
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "drift_imu");
+    ros::NodeHandle nh;
+    ros::NodeHandle local_nh("~");
+    ROS_INFO("\033[1;32m---->\033[0m drift_imu Started.");
+
+    DriftImu drift_imu(nh, local_nh);
+
+    ros::spin();
+    return 0;
+}
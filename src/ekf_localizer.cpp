@@ -0,0 +1,663 @@
+/* ekf_localizer.cpp
+ * 2016.10.05
+ *
+ * author : Takashi Ienaga
+ *
+ * Distribution : rwrc16のD-GaussとNDTの拡張カルマンフィルタ(EKF)
+ *                入力：Gyro-Odometry
+ *                観測：D-Gauss
+ *                      NDT
+ * を参考に
+ */
+
+
+/*Library*/
+#include <iostream>
+#include <algorithm>
+#include <math.h>
+#include <geometry_msgs/Quaternion.h>
+
+#include "ndt_localizer/ekf_localizer.hpp"
+#include "ndt_localizer/timing_diagnostics.hpp"
+
+/*namespace*/
+using namespace std;
+using namespace Eigen;
+
+
+EKFLocalizer::EKFLocalizer() :
+    init_pose_flag(false), imu_flag(false), odom_flag(false), init_flag(true),
+    map_frame_id("map"), odom_frame_id("odom"),
+    pitch(0),
+    HZ(20.0),
+    DIAGNOSTICS_PERIOD(1.0),
+    NDT_MAX_DELAY(0.5),
+    PREDICT_ON_INPUT(true),
+    VIS_RATE(0.0),
+    delayed_ndt(0), dropped_ndt(0),
+    last_time(0), last_input_stamp(0), last_vis_stamp(0),
+    init_imu(true), yaw_before(0.000001), yaw_sum(0),
+    first_odom_pose(Eigen::Vector3d::Zero()), first_odom_yaw(0), first_odom_flag(true),
+    init_pose_once(true)
+{
+    x.setZero();
+    Sigma.setZero();
+    u.setZero();
+}
+
+
+EKFLocalizer::EKFLocalizer(ros::NodeHandle n, ros::NodeHandle pnh) :
+    EKFLocalizer()
+{
+    broadcaster.reset(new tf::TransformBroadcaster);
+    listener.reset(new tf::TransformListener);
+
+    load_params(pnh);
+    setup();
+
+    //Subscribe
+    odom_sub  = n.subscribe("/odom", 10, &EKFLocalizer::odomCallback, this);
+    imu_sub   = n.subscribe("/imu/data", 10, &EKFLocalizer::imuCallback, this);
+    ndt_sub   = n.subscribe("/NDT/result", 10, &EKFLocalizer::ndtCallback, this);//ndtによる結果
+    hantei_sub = n.subscribe("/not_matching", 1, &EKFLocalizer::hanteiCallback, this);
+    init_sub    = n.subscribe("/move_base_simple/goal", 1, &EKFLocalizer::initposeCallback, this);
+    relocalize_sub = n.subscribe("/NDT/relocalized", 1, &EKFLocalizer::relocalizeCallback, this);
+
+    //Publish
+    ekf_pub = n.advertise<nav_msgs::Odometry>("/EKF/result", 100);
+    vis_ekf_pub = n.advertise<nav_msgs::Odometry>("/vis/odometry", 100);
+    if(DIAGNOSTICS_PERIOD > 0){
+        diag_pub = n.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
+        diag_timer = n.createWallTimer(ros::WallDuration(DIAGNOSTICS_PERIOD), &EKFLocalizer::diagnosticsCallback, this);
+    }
+
+    last_time = ros::Time::now().toSec();
+    // otherwise the pose is predicted and published on every input message
+    if(!PREDICT_ON_INPUT) timer = n.createTimer(ros::Duration(1.0 / HZ), &EKFLocalizer::timerCallback, this);
+}
+
+
+EKFLocalizer::EKFLocalizer(const ParamMap& param) :
+    EKFLocalizer()
+{
+    load_params(param);
+    // no TF without ROS
+    ENABLE_TF = ENABLE_ODOM_TF = false;
+    setup();
+}
+
+
+template<class ParamT>
+void
+EKFLocalizer::load_params(const ParamT& pnh)
+{
+    //パラメータ
+    pnh.param("INIT_X", init_x[0], 0.0);
+    pnh.param("INIT_Y", init_x[1], 0.0);
+    pnh.param("INIT_YAW", init_x[2], -30.0);
+    pnh.param("init_sig_x", init_sig[0], 0.0);
+    pnh.param("init_sig_y", init_sig[1], 0.0);
+    pnh.param("init_sig_yaw", init_sig[2], 0.0);
+    pnh.param("Pred_a1", s_input[0], 0.0);
+    pnh.param("Pred_a2", s_input[1], 0.0);
+    pnh.param("Pred_a3", s_input[2], 0.0);
+    pnh.param("Pred_a4", s_input[3], 0.0);
+    pnh.param("NDT_sig_X", s_ndt[0], 0.0);
+    pnh.param("NDT_sig_Y", s_ndt[1], 0.0);
+    pnh.param("NDT_sig_Yaw", s_ndt[2], 0.0);
+    pnh.param("parent_frame_id", parent_frame_id, std::string("/map"));
+    pnh.param("mode_pointing_ini_pose_on_rviz", mode_pointing_ini_pose_on_rviz, true);
+    pnh.param("ENABLE_TF", ENABLE_TF, {false});
+    pnh.param("ENABLE_ODOM_TF", ENABLE_ODOM_TF, {false});
+    pnh.param("DIAGNOSTICS_PERIOD", DIAGNOSTICS_PERIOD, {1.0});
+    pnh.param("NDT_MAX_DELAY", NDT_MAX_DELAY, {0.5});
+    pnh.param("PREDICT_ON_INPUT", PREDICT_ON_INPUT, {true});
+    pnh.param("VIS_RATE", VIS_RATE, {0.0});
+}
+
+
+void
+EKFLocalizer::setup()
+{
+    printParam();
+
+    // a few results per step at most, nothing is allocated on the way
+    ndt_observations.reserve(16);
+
+    //初期化
+    poseInit(ekf_odom);
+    if(!mode_pointing_ini_pose_on_rviz){
+        x << init_x[0], init_x[1], init_x[2];
+        init_pose_flag = true;
+    }
+}
+
+
+void
+EKFLocalizer::InputOdomCov(nav_msgs::Odometry& odom)
+{
+    /*x*/
+    odom.pose.covariance[0] = Sigma(0, 0);  //x
+    odom.pose.covariance[1] = Sigma(0, 1);  //y
+    odom.pose.covariance[5] = Sigma(0, 2);  //yaw
+    /*y*/
+    odom.pose.covariance[6] = Sigma(1, 0);  //x
+    odom.pose.covariance[7] = Sigma(1, 1);  //y
+    odom.pose.covariance[11] = Sigma(1, 2); //yaw
+    /*yaw*/
+    odom.pose.covariance[30] = Sigma(2, 0); //x
+    odom.pose.covariance[31] = Sigma(2, 1); //y
+    odom.pose.covariance[35] = Sigma(2, 2); //yaw
+}
+
+void
+EKFLocalizer::predict(const Filter::Control& input, float dt){
+    /* input   : (v, w)の転置行列 v:並進速度, w:角速度
+     * x   : (x, y, θ)の転置行列
+     * dt      : 前ステップからの経過時間
+     * s_input : 動作モデルのノイズパラメータ
+     */
+    Filter::predict(DiffDriveModel(s_input, pitch), input, dt, x, Sigma);
+}
+
+void
+EKFLocalizer::NDTUpdate(const NdtObservation& observation){
+    /* x    : 状態(x, y, yaw)の転置行列
+     * observation.Q: 観測ノイズ
+     * sigma: 推定誤差
+     */
+    Filter::update(PoseObservation(), observation.z, observation.Q, x, Sigma);
+}
+
+
+void
+EKFLocalizer::push_history(double stamp, const Filter::Control& input, const NdtObservation* observation){
+    if(NDT_MAX_DELAY <= 0) return;
+
+    // one entry at or before the oldest stamp which is still accepted stays
+    size_t old = 0;
+    while(old + 1 < history.size() && history[old + 1].stamp < stamp - NDT_MAX_DELAY) old++;
+    history.erase(history.begin(), history.begin() + old);
+
+    HistoryEntry entry;
+    entry.stamp = stamp;
+    entry.u = input;
+    entry.observed = observation != nullptr;
+    if(observation) entry.observation = *observation;
+    entry.x = x;
+    entry.Sigma = Sigma;
+    history.push_back(entry);
+}
+
+
+void
+EKFLocalizer::fuse(const NdtObservation& observation, double now_time){
+    const double delay = now_time - observation.stamp;
+    if(observation.stamp > 0) ndt_delay_histogram.record(std::chrono::duration<double>(std::max(delay, 0.0)));
+
+    if(NDT_MAX_DELAY <= 0 || observation.stamp <= 0 || history.empty() || observation.stamp >= history.back().stamp){
+        // not behind the current step: fused now
+        NDTUpdate(observation);
+        if(history.empty()) return;
+        if(history.back().observed){
+            // a second one in the same step
+            push_history(history.back().stamp, Filter::Control::Zero(), &observation);
+            return;
+        }
+        history.back().observed = true;
+        history.back().observation = observation;
+        history.back().x = x;
+        history.back().Sigma = Sigma;
+        return;
+    }
+
+    if(delay > NDT_MAX_DELAY || observation.stamp < history.front().stamp){
+        dropped_ndt++;
+        return;
+    }
+    delayed_ndt++;
+
+    // the entry at the scan stamp splits the step it falls in, both parts take the input of that step
+    size_t i = 1;
+    while(i < history.size() && history[i].stamp <= observation.stamp) i++;
+    HistoryEntry entry;
+    entry.stamp = observation.stamp;
+    entry.u = history[i].u;
+    entry.observed = true;
+    entry.observation = observation;
+    history.insert(history.begin() + i, entry);
+
+    replay(i);
+}
+
+
+void
+EKFLocalizer::replay(size_t from){
+    x = history[from - 1].x;
+    Sigma = history[from - 1].Sigma;
+    for(size_t k = from; k < history.size(); k++){
+        HistoryEntry& entry = history[k];
+        const float dt = entry.stamp - history[k - 1].stamp;
+        if(dt > 0) predict(entry.u, dt);
+        if(entry.observed) NDTUpdate(entry.observation);
+        entry.x = x;
+        entry.Sigma = Sigma;
+    }
+}
+
+
+void
+EKFLocalizer::clear_history(){
+    history.clear();
+    ndt_observations.clear();
+}
+
+
+
+float
+EKFLocalizer::expand(float after){
+
+    float& before = yaw_before;
+    float& sum = yaw_sum;
+
+    if(init_imu){
+        before   = after;
+        sum      = before;
+        init_imu = false;
+    }
+
+    else{
+        if((before * after) < 0){
+
+            if(fabs(before) > M_PI/2){ //180度付近
+                if(before > 0){
+                    sum += (M_PI*2 - before + after);
+                }
+                else{
+                    sum -= (M_PI*2 + before - after);
+                }
+            }
+            else{
+                sum += (before - after);
+            }
+        }
+
+        else{
+            sum += (after - before);
+        }
+
+        before = after;
+    }
+
+    return sum;
+}
+
+
+
+void
+EKFLocalizer::odomCallback(const nav_msgs::OdometryConstPtr& msg){
+    // the last input holds until this message
+    if(PREDICT_ON_INPUT) propagate(input_stamp(msg->header.stamp));
+    u.coeffRef(0,0) = msg->twist.twist.linear.x;
+
+    if(!PREDICT_ON_INPUT) ekf_odom.header.stamp = msg->header.stamp; //
+    ekf_odom.twist.twist.linear.x = u.coeffRef(0,0);
+
+    /*input frame_id*/
+    if(msg->child_frame_id != ""){
+        ekf_odom.child_frame_id = msg->child_frame_id;
+    }
+    else{
+        ekf_odom.child_frame_id = "/base_link";
+        std::cout << "\033[33mchild_frame_id should be set. default '/base_link' is used\033[0m" << std::endl;
+    }
+
+    odom_frame_id = msg->header.frame_id;
+
+    if(ENABLE_ODOM_TF){
+        Eigen::Vector3d odom_pose;
+        double odom_yaw = tf::getYaw(msg->pose.pose.orientation);
+        odom_pose << msg->pose.pose.position.x, msg->pose.pose.position.y, msg->pose.pose.position.z;
+        if(first_odom_flag){
+            first_odom_pose = odom_pose;
+            first_odom_yaw = odom_yaw;
+            std::cout << "first odom pose: \n" << first_odom_pose << std::endl;
+            first_odom_flag = false;
+        }
+        odom_pose -= first_odom_pose;
+        Eigen::AngleAxis<double> first_odom_yaw_rotation(-first_odom_yaw, Eigen::Vector3d::UnitZ());
+        odom_pose = first_odom_yaw_rotation * odom_pose;
+        odom_yaw -= first_odom_yaw;
+        odom_yaw = atan2(sin(odom_yaw), cos(odom_yaw));
+        tf::Transform transform;
+        transform.setOrigin(tf::Vector3(odom_pose(0), odom_pose(1), odom_pose(2)));
+        tf::Quaternion q;
+        q.setRPY(0, 0, odom_yaw);
+        transform.setRotation(q);
+        tf::StampedTransform odom_tf(transform, msg->header.stamp, odom_frame_id, msg->child_frame_id);
+        if(broadcaster) broadcaster->sendTransform(odom_tf);
+    }
+    odom_flag = true;
+}
+
+
+void
+EKFLocalizer::imuCallback(const sensor_msgs::ImuConstPtr& msg){
+    const double stamp = input_stamp(msg->header.stamp);
+    const bool predicted = PREDICT_ON_INPUT && propagate(stamp);
+    u.coeffRef(1,0) = msg->angular_velocity.z;
+
+    ekf_odom.twist.twist.angular.z = u.coeffRef(1,0);
+
+    pitch = 0;
+    imu_flag = true;
+    // ekf_odom.header.stamp = msg->header.stamp; //
+
+    // the pose at the imu rate
+    if(predicted){
+        set_output();
+        publish();
+    }
+}
+
+
+void
+EKFLocalizer::ndtCallback(const nav_msgs::OdometryConstPtr& msg){
+    // ekf_odom.header.stamp = msg->header.stamp; //
+
+    // fused at the stamp of the scan at the next step
+    NdtObservation observation;
+    observation.stamp = msg->header.stamp.toSec();
+
+    float yaw_true = expand(tf::getYaw(msg->pose.pose.orientation));
+    observation.z << msg->pose.pose.position.x, msg->pose.pose.position.y, yaw_true;
+
+    // the matcher inflates the variance of an alignment cut short by its time budget
+    observation.Q.setZero();    //ndtのRt:共分散行列
+    observation.Q.coeffRef(0,0) = (float)std::max(s_ndt[0], msg->pose.covariance[0]);
+    observation.Q.coeffRef(1,1) = (float)std::max(s_ndt[1], msg->pose.covariance[7]);
+    observation.Q.coeffRef(2,2) = (float)std::max(s_ndt[2], msg->pose.covariance[35]);
+    ndt_observations.push_back(observation);
+
+    map_frame_id = msg->header.frame_id;
+}
+
+void
+EKFLocalizer::hanteiCallback(const std_msgs::BoolConstPtr& msg){
+
+    if(msg->data){
+        s_ndt[0] = 100;
+        s_ndt[1] = 100;
+        s_ndt[2] = 100;
+    }
+
+
+    else{
+        //徐々に減らしている。
+        s_ndt[0] = s_ndt[0] * 0.5;
+        s_ndt[1] = s_ndt[1] * 0.5;
+        s_ndt[2] = s_ndt[2] * 0.5;
+
+        if(s_ndt[0] < 0.001){
+            s_ndt[0] = 0.001;
+            s_ndt[1] = 0.001;
+            s_ndt[2] = 0.001;
+        }
+    }
+    printf("NDT sig : %.4f\n", s_ndt[0]);
+}
+
+
+void
+EKFLocalizer::initposeCallback(const geometry_msgs::PoseStampedConstPtr& msg){
+
+    if(init_pose_once && mode_pointing_ini_pose_on_rviz){
+
+        double qr,qp,qy;
+        tf::Quaternion quat(msg->pose.orientation.x, msg->pose.orientation.y, msg->pose.orientation.z, msg->pose.orientation.w);
+        tf::Matrix3x3(quat).getRPY(qr, qp, qy);
+
+
+        init_x[0] = msg->pose.position.x;
+        init_x[1] = msg->pose.position.y;
+        init_x[2] = qy;
+
+        x << init_x[0], init_x[1], init_x[2];
+        // states and observations before the new pose are not replayed
+        clear_history();
+
+        init_pose_once = false;
+
+    }
+
+    init_pose_flag = true;
+}
+
+
+void
+EKFLocalizer::relocalizeCallback(const geometry_msgs::PoseStampedConstPtr& msg){
+    // the yaw is unwrapped from the new pose on
+    init_imu = true;
+    const float yaw = expand(tf::getYaw(msg->pose.orientation));
+
+    x << msg->pose.position.x, msg->pose.position.y, yaw;
+    Sigma << init_sig[0], 0, 0,
+             0, init_sig[1], 0,
+             0, 0, init_sig[2];
+    // an observation of the old pose is not applied any more, nor replayed
+    clear_history();
+
+    std::cout << "\033[32mrelocalized: " << x(0, 0) << ", " << x(1, 0) << ", " << x(2, 0) << "\033[0m" << std::endl;
+    init_pose_flag = true;
+}
+
+
+
+
+void
+EKFLocalizer::poseInit(nav_msgs::Odometry &msg){
+    msg.header.frame_id = parent_frame_id;
+    /* msg.child_frame_id = "/matching_base_link"; */
+    msg.pose.pose.position.x = init_x[0];
+    msg.pose.pose.position.y = init_x[1];
+    msg.pose.pose.position.z = 0.0;
+    msg.pose.pose.orientation.x = 0.0;
+    msg.pose.pose.orientation.y = 0.0;
+    msg.pose.pose.orientation.z = init_x[2];
+    msg.pose.pose.orientation.w = 0.0;
+
+    x << init_x[0], init_x[1], init_x[2];
+    Sigma << init_sig[0], 0, 0,
+             0, init_sig[1], 0,
+             0, 0, init_sig[2];
+    u.setZero();
+    clear_history();
+}
+
+
+
+void
+EKFLocalizer::printParam(void){
+    printf("Dgauss_ekf.cpp Parameters:\n");
+    printf("Initial pose \n");
+    printf("    init_x      : %lf\n", init_x[0]);
+    printf("    init_y      : %lf\n", init_x[1]);
+    printf("    init_yaw    : %lf\n", init_x[2]);
+    printf("    init_sig_x  : %f\n", init_sig[0]);
+    printf("    init_sig_y  : %f\n", init_sig[1]);
+    printf("    init_sig_yaw    : %f\n", init_sig[2]);
+    printf("Prediction \n");
+    for(unsigned int i=0; i<sizeof(s_input)/sizeof(s_input[0]); i++){
+        printf("    a%d     : %lf\n", i+1, s_input[i]);
+    }
+    printf("NDT Measurement \n");
+    printf("    Sig_X       : %lf\n", s_ndt[0]);    ndt_sig[0] = s_ndt[0];
+    printf("    Sig_Y       : %lf\n", s_ndt[1]);    ndt_sig[1] = s_ndt[1];
+    printf("    Sig_Yaw     : %lf\n", s_ndt[2]);
+    std::cout << "mode_pointing_ini_pose_on_rviz = " << (bool)mode_pointing_ini_pose_on_rviz << std::endl;
+    std::cout << "ENABLE_TF = " << (bool)ENABLE_TF << std::endl;
+    std::cout << "ENABLE_ODOM_TF = " << (bool)ENABLE_ODOM_TF << std::endl;
+    std::cout << "DIAGNOSTICS_PERIOD = " << DIAGNOSTICS_PERIOD << std::endl;
+    std::cout << "NDT_MAX_DELAY = " << NDT_MAX_DELAY << std::endl;
+    std::cout << "PREDICT_ON_INPUT = " << (bool)PREDICT_ON_INPUT << std::endl;
+    std::cout << "VIS_RATE = " << VIS_RATE << std::endl;
+}
+
+
+void
+EKFLocalizer::step(double stamp, float dt){
+    {
+        ScopedTimer predict_timer(&predict_histogram);
+        predict(u, dt);
+    }
+    push_history(stamp, u, nullptr);
+
+    // a late result is fused at its scan stamp and the steps after it are replayed
+    for(const auto& observation : ndt_observations){
+        ScopedTimer update_timer(&update_histogram);
+        fuse(observation, stamp);
+    }
+    ndt_observations.clear();
+}
+
+
+double
+EKFLocalizer::input_stamp(const ros::Time& stamp){
+    // some drivers leave the stamp empty
+    return stamp.isZero() ? ros::Time::now().toSec() : stamp.toSec();
+}
+
+
+bool
+EKFLocalizer::propagate(double stamp){
+    // the input of both is needed, the first one only starts the clock
+    if(!init_pose_flag || !imu_flag || !odom_flag || last_input_stamp <= 0){
+        last_input_stamp = std::max(last_input_stamp, stamp);
+        return false;
+    }
+    // older than the other topic: nothing to predict, the input changes from now on
+    if(stamp <= last_input_stamp) return false;
+
+    ScopedTimer step_timer(&step_histogram);
+    step(stamp, stamp - last_input_stamp);
+    last_input_stamp = stamp;
+    ekf_odom.header.stamp = ros::Time(stamp);
+    return true;
+}
+
+
+void
+EKFLocalizer::set_output(){
+    /*input odom covariance*/
+    InputOdomCov(ekf_odom);
+
+    ekf_odom.pose.pose.position.x = x.coeffRef(0,0);
+    ekf_odom.pose.pose.position.y = x.coeffRef(1,0);
+    ekf_odom.pose.pose.orientation = tf::createQuaternionMsgFromYaw(x.coeffRef(2, 0));
+}
+
+
+bool
+EKFLocalizer::update(double now_time){
+    if(!init_pose_flag) return false;
+
+    // the inputs predict (PREDICT_ON_INPUT), the pose is up to date
+    if(imu_flag && odom_flag && !PREDICT_ON_INPUT){
+        ScopedTimer step_timer(&step_histogram);
+        float dt;
+        if(init_flag){
+            dt = 1.0 / HZ;
+            init_flag = false;
+        }else{
+            dt = now_time - last_time;
+        }
+        step(now_time, dt);
+
+        last_time = now_time;
+        imu_flag = odom_flag = false;
+    }
+
+    set_output();
+    return true;
+}
+
+
+void
+EKFLocalizer::timerCallback(const ros::TimerEvent& event){
+    if(!update(ros::Time::now().toSec())) return;
+    publish();
+}
+
+
+void
+EKFLocalizer::publish(){
+    if(!ekf_pub) return;
+
+    // published as a shared pointer, so that nodelets in the same manager receive it without a copy
+    nav_msgs::OdometryPtr ekf_msg(new nav_msgs::Odometry(ekf_odom));
+    ekf_pub.publish(ekf_msg);
+
+    if(ENABLE_TF){
+        try{
+            tf::Transform map_to_robot;
+            tf::poseMsgToTF(ekf_odom.pose.pose, map_to_robot);
+            // at the imu rate the odom tf of the stamp is often not there yet, the latest one is close enough
+            const ros::Time lookup_stamp = PREDICT_ON_INPUT ? ros::Time(0) : ekf_odom.header.stamp;
+            tf::Stamped<tf::Pose> robot_to_map(map_to_robot.inverse(), lookup_stamp, ekf_odom.child_frame_id);
+            tf::Stamped<tf::Pose> odom_to_map;
+            listener->transformPose(odom_frame_id, robot_to_map, odom_to_map);
+            broadcaster->sendTransform(tf::StampedTransform(odom_to_map.inverse(), ekf_odom.header.stamp, map_frame_id, odom_frame_id));
+            // broadcaster->sendTransform(tf::StampedTransform(map_to_robot, ekf_odom.header.stamp, map_frame_id, ekf_odom.child_frame_id));
+        }catch(tf::TransformException ex){
+            std::cout << ex.what() << std::endl;
+        }
+    }
+
+    // only for rviz: not at the imu rate when VIS_RATE is set, nothing without subscribers
+    if(vis_ekf_pub.getNumSubscribers() == 0) return;
+    const double stamp = ekf_odom.header.stamp.toSec();
+    if(VIS_RATE > 0 && stamp >= last_vis_stamp && stamp - last_vis_stamp < 1.0 / VIS_RATE) return;
+    last_vis_stamp = stamp;
+    vis_ekf_pub.publish(ekf_msg);
+}
+
+
+void
+EKFLocalizer::diagnosticsCallback(const ros::WallTimerEvent& event){
+    LatencyHistogram::Snapshot snapshot;
+    if(diag_pub.getNumSubscribers() == 0){
+        // nobody listens: only the windows are started again
+        step_histogram.snapshot(snapshot, true);
+        predict_histogram.snapshot(snapshot, true);
+        update_histogram.snapshot(snapshot, true);
+        ndt_delay_histogram.snapshot(snapshot, true);
+        return;
+    }
+
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = ros::this_node::getName() + ": timing";
+    status.hardware_id = "ndt_localizer";
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+
+    step_histogram.snapshot(snapshot, true);
+    status.message = std::to_string(snapshot.num) + " steps in the last " + std::to_string(DIAGNOSTICS_PERIOD) + " s";
+    status.values.push_back(histogram_key_value("step [ms]", snapshot, 1e-6));
+    predict_histogram.snapshot(snapshot, true);
+    status.values.push_back(histogram_key_value("predict [ms]", snapshot, 1e-6));
+    update_histogram.snapshot(snapshot, true);
+    status.values.push_back(histogram_key_value("ndt update [ms]", snapshot, 1e-6));
+    ndt_delay_histogram.snapshot(snapshot, true);
+    status.values.push_back(histogram_key_value("ndt delay [ms]", snapshot, 1e-6));
+    status.values.push_back(make_key_value("delayed ndt", delayed_ndt));
+    status.values.push_back(make_key_value("dropped ndt", dropped_ndt));
+
+    // the covariance which was printed on every step before
+    status.values.push_back(make_key_value("sigma x", Sigma(0, 0)));
+    status.values.push_back(make_key_value("sigma y", Sigma(1, 1)));
+    status.values.push_back(make_key_value("sigma yaw", Sigma(2, 2)));
+
+    diagnostic_msgs::DiagnosticArrayPtr array(new diagnostic_msgs::DiagnosticArray);
+    array->header.stamp = ros::Time::now();
+    array->status.push_back(status);
+    diag_pub.publish(array);
+}
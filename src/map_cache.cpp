@@ -0,0 +1,163 @@
+/* map_cache.cpp
+ *
+ * binary cache of the preprocessed map (mmap on load)
+ *
+*/
+
+#include<iostream>
+#include<cstdio>
+#include<cstring>
+#include<vector>
+
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+
+#include"map_cache.hpp"
+
+namespace{
+
+const char CACHE_MAGIC[8] = {'N', 'D', 'T', 'M', 'A', 'P', 'C', '\0'};
+const uint32_t CACHE_VERSION = 1;
+const uint32_t POINT_STEP = 4 * sizeof(float);
+
+void
+unpack(const float* data, uint64_t num, MapCache::Cloud& cloud)
+{
+    cloud.points.resize(num);
+    for(uint64_t i = 0; i < num; i++){
+        cloud.points[i].x = data[4 * i];
+        cloud.points[i].y = data[4 * i + 1];
+        cloud.points[i].z = data[4 * i + 2];
+        cloud.points[i].intensity = data[4 * i + 3];
+    }
+    cloud.width = num;
+    cloud.height = 1;
+    cloud.is_dense = true;
+}
+
+bool
+pack(FILE* fp, const MapCache::Cloud& cloud)
+{
+    std::vector<float> data(4 * cloud.points.size());
+    for(size_t i = 0; i < cloud.points.size(); i++){
+        data[4 * i] = cloud.points[i].x;
+        data[4 * i + 1] = cloud.points[i].y;
+        data[4 * i + 2] = cloud.points[i].z;
+        data[4 * i + 3] = cloud.points[i].intensity;
+    }
+    return std::fwrite(data.data(), sizeof(float), data.size(), fp) == data.size();
+}
+
+}
+
+
+MapCache::MapCache(const std::string& cache_file_, const std::string& source_file_,
+        double voxel_size_, const double offset_[6]) :
+    cache_file(cache_file_),
+    source_file(source_file_),
+    voxel_size(voxel_size_)
+{
+    for(int i = 0; i < 6; i++) offset[i] = offset_[i];
+}
+
+
+bool
+MapCache::make_header(Header& header) const
+{
+    struct stat st;
+    if(stat(source_file.c_str(), &st) != 0){
+        return false;
+    }
+
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.point_step = POINT_STEP;
+    header.source_size = st.st_size;
+    header.source_mtime_sec = st.st_mtim.tv_sec;
+    header.source_mtime_nsec = st.st_mtim.tv_nsec;
+    header.voxel_size = voxel_size;
+    for(int i = 0; i < 6; i++) header.offset[i] = offset[i];
+    return true;
+}
+
+
+bool
+MapCache::load(Cloud& map, Cloud& target) const
+{
+    Header expected;
+    if(!make_header(expected)){
+        std::cout << "map cache: cannot stat source " << source_file << std::endl;
+        return false;
+    }
+
+    int fd = open(cache_file.c_str(), O_RDONLY);
+    if(fd < 0){
+        std::cout << "map cache: " << cache_file << " does not exist" << std::endl;
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)){
+        close(fd);
+        return false;
+    }
+
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED){
+        std::cout << "map cache: mmap failed" << std::endl;
+        return false;
+    }
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+    Header header;
+    std::memcpy(&header, addr, sizeof(Header));
+
+    // everything except the point counts has to match, otherwise the cache is stale
+    expected.map_num = header.map_num;
+    expected.target_num = header.target_num;
+    const bool valid = std::memcmp(&header, &expected, sizeof(Header)) == 0
+        && static_cast<uint64_t>(st.st_size) == sizeof(Header) + (header.map_num + header.target_num) * POINT_STEP;
+
+    if(valid){
+        const float* data = reinterpret_cast<const float*>(static_cast<const char*>(addr) + sizeof(Header));
+        unpack(data, header.map_num, map);
+        unpack(data + 4 * header.map_num, header.target_num, target);
+    }else{
+        std::cout << "\033[33mmap cache: " << cache_file << " is stale\033[0m" << std::endl;
+    }
+
+    munmap(addr, st.st_size);
+    return valid;
+}
+
+
+bool
+MapCache::save(const Cloud& map, const Cloud& target) const
+{
+    Header header;
+    if(!make_header(header)) return false;
+    header.map_num = map.points.size();
+    header.target_num = target.points.size();
+
+    // written to a temporary file first so that a killed node never leaves a broken cache
+    const std::string tmp_file = cache_file + ".tmp";
+    FILE* fp = std::fopen(tmp_file.c_str(), "wb");
+    if(fp == NULL){
+        std::cout << "\033[33mmap cache: cannot write " << tmp_file << "\033[0m" << std::endl;
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(Header), 1, fp) == 1;
+    ok = ok && pack(fp, map);
+    ok = ok && pack(fp, target);
+    ok = (std::fclose(fp) == 0) && ok;
+
+    if(!ok || std::rename(tmp_file.c_str(), cache_file.c_str()) != 0){
+        std::remove(tmp_file.c_str());
+        std::cout << "\033[33mmap cache: failed to write " << cache_file << "\033[0m" << std::endl;
+        return false;
+    }
+    return true;
+}
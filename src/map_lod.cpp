@@ -0,0 +1,83 @@
+/* map_lod.cpp
+ *
+ * level-of-detail pyramid of the map for /vis/map
+ *
+*/
+
+#include<limits>
+#include<algorithm>
+
+#include<pcl/filters/voxel_grid.h>
+
+#include"map_lod.hpp"
+
+MapLod::MapLod() :
+    base(NULL),
+    resolution(0)
+{
+    std::fill(bounds, bounds + 4, 0.0);
+}
+
+
+void
+MapLod::build(const Cloud& map, const MapTileIndex& base_, double resolution_, int level_num)
+{
+    base = &base_;
+    resolution = resolution_;
+    levels.clear();
+
+    bounds[0] = bounds[2] = std::numeric_limits<double>::max();
+    bounds[1] = bounds[3] = -std::numeric_limits<double>::max();
+    for(const auto& p : map.points){
+        bounds[0] = std::min(bounds[0], static_cast<double>(p.x));
+        bounds[1] = std::max(bounds[1], static_cast<double>(p.x));
+        bounds[2] = std::min(bounds[2], static_cast<double>(p.y));
+        bounds[3] = std::max(bounds[3], static_cast<double>(p.y));
+    }
+
+    // every level from the one before (the map itself is not copied),
+    // a coarser level has larger tiles with about as many points per tile
+    Cloud::ConstPtr cloud(&map, [](const Cloud*){});
+    for(int i = 1; i < level_num; i++){
+        const float leaf = get_resolution(i);
+        pcl::VoxelGrid<pcl::PointXYZI> voxel;
+        voxel.setLeafSize(leaf, leaf, leaf);
+        voxel.setInputCloud(cloud);
+        Cloud::Ptr coarse(new Cloud);
+        voxel.filter(*coarse);
+
+        levels.emplace_back(new MapTileIndex(base->get_tile_size() * (1 << i), base->has_intensity()));
+        levels.back()->build(*coarse);
+        cloud = coarse;
+    }
+}
+
+
+int
+MapLod::query(double x_min, double x_max, double y_min, double y_max, size_t max_points, Cloud& output) const
+{
+    output.points.clear();
+    if(!is_built()) return -1;
+
+    // the tile counts are an upper bound, the coarsest level is taken anyway
+    int i = 0;
+    while(i + 1 < get_level_num() && level(i).count(x_min, x_max, y_min, y_max) > max_points) i++;
+    level(i).query(x_min, x_max, y_min, y_max, output);
+    return i;
+}
+
+
+int
+MapLod::query(size_t max_points, Cloud& output) const
+{
+    return query(bounds[0], bounds[1], bounds[2], bounds[3], max_points, output);
+}
+
+
+size_t
+MapLod::get_memory_bytes() const
+{
+    size_t bytes = 0;
+    for(const auto& level : levels) bytes += level->get_memory_bytes();
+    return bytes;
+}
@@ -6,22 +6,142 @@
  *
 */
 
+#include<cmath>
+#include<algorithm>
+#include<sstream>
+#include<limits>
+
 #include"map_match.hpp"
+#include"timing_diagnostics.hpp"
 
-Matcher::Matcher(ros::NodeHandle n,ros::NodeHandle private_nh_) :
-    local_lidar_cloud(new pcl::PointCloud<pcl::PointXYZI>),     //範囲狭めたレーザの点群
+namespace{
+
+const char* STAGE_NAMES[] = {
+    "preprocess", "read + crop", "deskew", "voxel filter", "local map", "align", "fitness", "publish", "scan -> pose"
+};
+
+// /EKF/result farther than this from the re-seed is from before it [m]
+const double RESEED_TOLERANCE = 1.0;
+// ... unless the ekf has not taken the re-seed over within this time [s]
+const double RESEED_TIMEOUT = 1.0;
+// a scan stamp this far before the last one is a bag loop or a sim time reset, not a duplicate [s]
+const double STAMP_JUMP_BACK = 1.0;
+
+Eigen::Vector3f
+centroid_of(const pcl::PointCloud<pcl::PointXYZI>& cloud){
+    Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+    for(const auto& p : cloud.points) sum += Eigen::Vector3f(p.x, p.y, p.z);
+    return cloud.points.empty() ? sum : Eigen::Vector3f(sum / cloud.points.size());
+}
+
+// the voxel grids of the ndt index their cells with 32 bits, a larger grid is left empty with a warning only
+bool
+fits_voxel_grid(const pcl::PointCloud<pcl::PointXYZI>& cloud, double leaf){
+    Eigen::Vector3f min_p = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+    Eigen::Vector3f max_p = -min_p;
+    for(const auto& p : cloud.points){
+        min_p = min_p.cwiseMin(Eigen::Vector3f(p.x, p.y, p.z));
+        max_p = max_p.cwiseMax(Eigen::Vector3f(p.x, p.y, p.z));
+    }
+    double cells = 1.0;
+    for(int i = 0; i < 3; i++) cells *= std::floor((max_p[i] - min_p[i]) / leaf) + 1;
+    return cells <= std::numeric_limits<int32_t>::max();
+}
+
+}
+
+
+Matcher::Matcher() :
     map_cloud(new pcl::PointCloud<pcl::PointXYZI>),     //mapの点群
     local_map_cloud(new pcl::PointCloud<pcl::PointXYZI>),//自分付近のmapの点群
-    ndt_cloud(new pcl::PointCloud<pcl::PointXYZI>),
+    last_level(NULL),
+    align_iterations(0),
+    align_truncated(false),
+    map_vis_ready(false),
+    has_target(false),
+    window_target(false),
+    is_aligning(false),
+    has_last_match(false),
+    last_match_z(0), last_match_roll(0), last_match_pitch(0),
+    relocalize_requested(false),
+    consecutive_failures(0),
+    reseed_pending(false),
+    reseed_deadline(0),
+    last_aligned_stamp(0),
+    has_accepted_pose(false),
+    accepted_x(0), accepted_y(0), accepted_yaw(0),
+    min_variance_xy(std::numeric_limits<double>::max()), min_variance_yaw(std::numeric_limits<double>::max()),
+    stationary_since(0),
+    has_reference_match(false),
+    reference_stamp(0),
+    reference_result(Eigen::Matrix4f::Identity()),
+    reference_score(0),
+    reference_point_num(0),
+    reference_centroid(Eigen::Vector3f::Zero()),
+    last_vis_ndt_stamp(0), last_vis_local_map_stamp(0),
+    local_map_dirty(false),
+    scan_seq(0),
+    processed_scans(0), skipped_scans(0), duplicate_scans(0), adaptive_skipped_scans(0),
+    truncated_alignments(0),
+    relocalizations(0),
+    reused_scans(0),
+    frames_in_flight(0),
+    free_frames(FRAME_NUM),
+    align_queue(FRAME_NUM),
+    publish_queue(FRAME_NUM),
+    running(false),
+    map_load_time(0), target_build_time(0),
+    map_memory(0), target_memory(0),
+    relocalizer_build_time(0), relocalize_time(0),
     is_start(false)
+{
+    for(int i = 0; i < FRAME_NUM; i++){
+        frames.emplace_back(new Frame);
+        frames.back()->cloud.reset(new pcl::PointCloud<pcl::PointXYZI>);         //範囲狭めたレーザの点群
+        frames.back()->aligned_cloud.reset(new pcl::PointCloud<pcl::PointXYZI>);
+        free_frames.push(frames.back().get());
+    }
+}
+
+
+Matcher::Matcher(ros::NodeHandle n,ros::NodeHandle private_nh_) :
+    Matcher()
 {
     pc_pub = n.advertise<sensor_msgs::PointCloud2>("/vis/ndt", 10);
-    map_pub = n.advertise<sensor_msgs::PointCloud2>("/vis/map", 1, true);
+    // not latched: the map is made for each new subscriber only, from the level of detail which fits
+    map_pub = n.advertise<sensor_msgs::PointCloud2>("/vis/map", 1,
+            [this](const ros::SingleSubscriberPublisher& pub){ map_connect_callback(pub); }, ros::SubscriberStatusCallback());
+    map_detail_pub = n.advertise<sensor_msgs::PointCloud2>("/vis/map_detail", 1);
+    local_map_pub = n.advertise<sensor_msgs::PointCloud2>("/vis/local_map", 1, true);
     odom_pub = n.advertise<nav_msgs::Odometry>("/NDT/result", 10);
+    relocalize_pub = n.advertise<geometry_msgs::PoseStamped>("/NDT/relocalized", 1);
+
+    load_params(private_nh_);
+
+    if(DIAGNOSTICS_PERIOD > 0){
+        diag_pub = n.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
+        diag_timer = n.createWallTimer(ros::WallDuration(DIAGNOSTICS_PERIOD), &Matcher::diagnostics_callback, this);
+    }
 
-    pc_sub = n.subscribe("/velodyne_points", 1, &Matcher::lidarcallback, this);
+    pc_sub = n.subscribe("/velodyne_points", scan_policy == SCAN_QUEUE ? SCAN_QUEUE_SIZE : 1, &Matcher::lidarcallback, this);
     odom_sub = n.subscribe("/EKF/result", 1, &Matcher::odomcallback, this);
+    map_request_sub = n.subscribe("/vis/map_request", 1, &Matcher::map_request_callback, this);
+
+    setup();
+}
+
 
+Matcher::Matcher(const ParamMap& param) :
+    Matcher()
+{
+    load_params(param);
+    setup();
+}
+
+
+template<class ParamT>
+void
+Matcher::load_params(const ParamT& private_nh_){
     private_nh_.param("PARENT_FRAME", PARENT_FRAME, {"/map"});
     /* n.param("CHILD_FRAME", CHILD_FRAME, {"/matching_base_link"}); */
     private_nh_.param("VOXEL_SIZE",VOXEL_SIZE ,{0.3});
@@ -34,6 +154,61 @@ Matcher::Matcher(ros::NodeHandle n,ros::NodeHandle private_nh_) :
     private_nh_.param("CLOUD_MAP_OFFSET_PITCH", CLOUD_MAP_OFFSET_PITCH, {0.0});
     private_nh_.param("CLOUD_MAP_OFFSET_YAW", CLOUD_MAP_OFFSET_YAW, {0.0});
     private_nh_.param("RESOLUTION", RESOLUTION, {0.5});
+    private_nh_.param("MULTI_RESOLUTION", MULTI_RESOLUTION, {""});
+    private_nh_.param("COARSE_MAX_ITERATIONS", COARSE_MAX_ITERATIONS, {10});
+    private_nh_.param("MAX_ITERATIONS", MAX_ITERATIONS, {35});
+    private_nh_.param("STEP_SIZE", STEP_SIZE, {0.1});
+    private_nh_.param("TRANSFORMATION_EPSILON", TRANSFORMATION_EPSILON, {0.001});
+    private_nh_.param("ALIGN_TIME_BUDGET", ALIGN_TIME_BUDGET, {0.0});
+    private_nh_.param("ALIGN_CHUNK_ITERATIONS", ALIGN_CHUNK_ITERATIONS, {5});
+    private_nh_.param("TRUNCATED_VARIANCE_XY", TRUNCATED_VARIANCE_XY, {0.1});
+    private_nh_.param("TRUNCATED_VARIANCE_YAW", TRUNCATED_VARIANCE_YAW, {0.01});
+    private_nh_.param("MAP_TILE_SIZE", MAP_TILE_SIZE, {10.0});
+    private_nh_.param("MAP_INTENSITY", MAP_INTENSITY, {true});
+    private_nh_.param("MAP_STREAMING", MAP_STREAMING, {false});
+    private_nh_.param("MAP_MAX_POINTS", MAP_MAX_POINTS, {20000000});
+    private_nh_.param("MAP_TILE_FILE", MAP_TILE_FILE, {""});
+    private_nh_.param("MAP_CACHE_TILES", MAP_CACHE_TILES, {256});
+    private_nh_.param("MAP_PREFETCH_DISTANCE", MAP_PREFETCH_DISTANCE, {30.0});
+    private_nh_.param("MAP_VIS_LEVELS", MAP_VIS_LEVELS, {5});
+    private_nh_.param("MAP_VIS_MAX_POINTS", MAP_VIS_MAX_POINTS, {500000});
+    private_nh_.param("MIN_HEIGHT", MIN_HEIGHT, {-100.0});
+    private_nh_.param("MAX_HEIGHT", MAX_HEIGHT, {100.0});
+    private_nh_.param("PREPROCESS_THREADS", PREPROCESS_THREADS, {1});
+    private_nh_.param("DESKEW", DESKEW, {false});
+    private_nh_.param("SCAN_PERIOD", SCAN_PERIOD, {0.1});
+    private_nh_.param("SCAN_STAMP_AT_END", SCAN_STAMP_AT_END, {true});
+    private_nh_.param("USE_MAP_CACHE", USE_MAP_CACHE, {true});
+    private_nh_.param("MAP_CACHE_FILE", MAP_CACHE_FILE, {""});
+    private_nh_.param("SCAN_POLICY", SCAN_POLICY, {"latest"});
+    private_nh_.param("SCAN_QUEUE_SIZE", SCAN_QUEUE_SIZE, {5});
+    private_nh_.param("DIAGNOSTICS_PERIOD", DIAGNOSTICS_PERIOD, {1.0});
+    private_nh_.param("VIS_RATE", VIS_RATE, {0.0});
+    private_nh_.param("INITIAL_GUESS", INITIAL_GUESS, {"predicted"});
+    private_nh_.param("POSE_HISTORY_SIZE", POSE_HISTORY_SIZE, {200});
+    private_nh_.param("GUESS_MAX_EXTRAPOLATION", GUESS_MAX_EXTRAPOLATION, {0.5});
+    private_nh_.param("RELOCALIZE_AFTER_FAILURES", RELOCALIZE_AFTER_FAILURES, {0});
+    private_nh_.param("RELOCALIZE_ON_START", RELOCALIZE_ON_START, {false});
+    private_nh_.param("RELOCALIZE_ROI", RELOCALIZE_ROI, {""});
+    private_nh_.param("RELOCALIZE_RESOLUTION", RELOCALIZE_RESOLUTION, {2.0});
+    private_nh_.param("RELOCALIZE_XY_STEP", RELOCALIZE_XY_STEP, {1.0});
+    private_nh_.param("RELOCALIZE_YAW_STEPS", RELOCALIZE_YAW_STEPS, {72});
+    private_nh_.param("RELOCALIZE_POINTS", RELOCALIZE_POINTS, {400});
+    private_nh_.param("RELOCALIZE_CANDIDATES", RELOCALIZE_CANDIDATES, {8});
+    private_nh_.param("RELOCALIZE_THREADS", RELOCALIZE_THREADS, {0});
+    private_nh_.param("ADAPTIVE_MATCHING", ADAPTIVE_MATCHING, {false});
+    private_nh_.param("ADAPTIVE_MIN_RATE", ADAPTIVE_MIN_RATE, {1.0});
+    private_nh_.param("ADAPTIVE_MAX_RATE", ADAPTIVE_MAX_RATE, {10.0});
+    private_nh_.param("ADAPTIVE_DISTANCE", ADAPTIVE_DISTANCE, {1.0});
+    private_nh_.param("ADAPTIVE_ANGLE", ADAPTIVE_ANGLE, {0.1});
+    private_nh_.param("ADAPTIVE_SIGMA_XY", ADAPTIVE_SIGMA_XY, {0.1});
+    private_nh_.param("ADAPTIVE_SIGMA_YAW", ADAPTIVE_SIGMA_YAW, {0.02});
+    private_nh_.param("STATIONARY_VELOCITY", STATIONARY_VELOCITY, {0.02});
+    private_nh_.param("STATIONARY_YAW_RATE", STATIONARY_YAW_RATE, {0.01});
+    private_nh_.param("STATIONARY_SKIP", STATIONARY_SKIP, {true});
+    private_nh_.param("STATIONARY_TIME", STATIONARY_TIME, {1.0});
+    private_nh_.param("STATIONARY_RECHECK_PERIOD", STATIONARY_RECHECK_PERIOD, {5.0});
+    private_nh_.param("STATIONARY_SCAN_TOLERANCE", STATIONARY_SCAN_TOLERANCE, {0.05});
 
     std::cout<<"PARENT_FRAME : "<<PARENT_FRAME<<std::endl;
     /* std::cout<<"CHILD_FRAME : "<<CHILD_FRAME<<std::endl; */
@@ -46,19 +221,360 @@ Matcher::Matcher(ros::NodeHandle n,ros::NodeHandle private_nh_) :
     std::cout<<"CLOUD_MAP_OFFSET_PITCH : "<< CLOUD_MAP_OFFSET_PITCH <<std::endl;
     std::cout<<"CLOUD_MAP_OFFSET_YAW : "<< CLOUD_MAP_OFFSET_YAW <<std::endl;
     std::cout<<"RESOLUTION : "<< RESOLUTION <<std::endl;
+    std::cout<<"MULTI_RESOLUTION : "<< MULTI_RESOLUTION <<std::endl;
+    std::cout<<"COARSE_MAX_ITERATIONS : "<< COARSE_MAX_ITERATIONS <<std::endl;
+    std::cout<<"MAX_ITERATIONS : "<< MAX_ITERATIONS <<std::endl;
+    std::cout<<"STEP_SIZE : "<< STEP_SIZE <<std::endl;
+    std::cout<<"TRANSFORMATION_EPSILON : "<< TRANSFORMATION_EPSILON <<std::endl;
+    std::cout<<"ALIGN_TIME_BUDGET : "<< ALIGN_TIME_BUDGET <<std::endl;
+    std::cout<<"ALIGN_CHUNK_ITERATIONS : "<< ALIGN_CHUNK_ITERATIONS <<std::endl;
+    std::cout<<"TRUNCATED_VARIANCE_XY : "<< TRUNCATED_VARIANCE_XY <<std::endl;
+    std::cout<<"TRUNCATED_VARIANCE_YAW : "<< TRUNCATED_VARIANCE_YAW <<std::endl;
+    std::cout<<"MAP_TILE_SIZE : "<< MAP_TILE_SIZE <<std::endl;
+    std::cout<<"MAP_INTENSITY : "<< MAP_INTENSITY <<std::endl;
+    std::cout<<"MAP_STREAMING : "<< MAP_STREAMING <<std::endl;
+    std::cout<<"MAP_MAX_POINTS : "<< MAP_MAX_POINTS <<std::endl;
+    std::cout<<"MAP_TILE_FILE : "<< MAP_TILE_FILE <<std::endl;
+    std::cout<<"MAP_CACHE_TILES : "<< MAP_CACHE_TILES <<std::endl;
+    std::cout<<"MAP_PREFETCH_DISTANCE : "<< MAP_PREFETCH_DISTANCE <<std::endl;
+    std::cout<<"MAP_VIS_LEVELS : "<< MAP_VIS_LEVELS <<std::endl;
+    std::cout<<"MAP_VIS_MAX_POINTS : "<< MAP_VIS_MAX_POINTS <<std::endl;
+    std::cout<<"MIN_HEIGHT : "<< MIN_HEIGHT <<std::endl;
+    std::cout<<"MAX_HEIGHT : "<< MAX_HEIGHT <<std::endl;
+    std::cout<<"PREPROCESS_THREADS : "<< PREPROCESS_THREADS <<std::endl;
+    std::cout<<"DESKEW : "<< DESKEW <<std::endl;
+    std::cout<<"SCAN_PERIOD : "<< SCAN_PERIOD <<std::endl;
+    std::cout<<"SCAN_STAMP_AT_END : "<< SCAN_STAMP_AT_END <<std::endl;
+    std::cout<<"USE_MAP_CACHE : "<< USE_MAP_CACHE <<std::endl;
+    std::cout<<"MAP_CACHE_FILE : "<< MAP_CACHE_FILE <<std::endl;
+    std::cout<<"SCAN_POLICY : "<< SCAN_POLICY <<std::endl;
+    std::cout<<"SCAN_QUEUE_SIZE : "<< SCAN_QUEUE_SIZE <<std::endl;
+    std::cout<<"DIAGNOSTICS_PERIOD : "<< DIAGNOSTICS_PERIOD <<std::endl;
+    std::cout<<"VIS_RATE : "<< VIS_RATE <<std::endl;
+    std::cout<<"INITIAL_GUESS : "<< INITIAL_GUESS <<std::endl;
+    std::cout<<"POSE_HISTORY_SIZE : "<< POSE_HISTORY_SIZE <<std::endl;
+    std::cout<<"GUESS_MAX_EXTRAPOLATION : "<< GUESS_MAX_EXTRAPOLATION <<std::endl;
+    std::cout<<"RELOCALIZE_AFTER_FAILURES : "<< RELOCALIZE_AFTER_FAILURES <<std::endl;
+    std::cout<<"RELOCALIZE_ON_START : "<< RELOCALIZE_ON_START <<std::endl;
+    std::cout<<"RELOCALIZE_ROI : "<< RELOCALIZE_ROI <<std::endl;
+    std::cout<<"RELOCALIZE_RESOLUTION : "<< RELOCALIZE_RESOLUTION <<std::endl;
+    std::cout<<"RELOCALIZE_XY_STEP : "<< RELOCALIZE_XY_STEP <<std::endl;
+    std::cout<<"RELOCALIZE_YAW_STEPS : "<< RELOCALIZE_YAW_STEPS <<std::endl;
+    std::cout<<"RELOCALIZE_POINTS : "<< RELOCALIZE_POINTS <<std::endl;
+    std::cout<<"RELOCALIZE_CANDIDATES : "<< RELOCALIZE_CANDIDATES <<std::endl;
+    std::cout<<"RELOCALIZE_THREADS : "<< RELOCALIZE_THREADS <<std::endl;
+    std::cout<<"ADAPTIVE_MATCHING : "<< ADAPTIVE_MATCHING <<std::endl;
+    std::cout<<"ADAPTIVE_MIN_RATE : "<< ADAPTIVE_MIN_RATE <<std::endl;
+    std::cout<<"ADAPTIVE_MAX_RATE : "<< ADAPTIVE_MAX_RATE <<std::endl;
+    std::cout<<"ADAPTIVE_DISTANCE : "<< ADAPTIVE_DISTANCE <<std::endl;
+    std::cout<<"ADAPTIVE_ANGLE : "<< ADAPTIVE_ANGLE <<std::endl;
+    std::cout<<"ADAPTIVE_SIGMA_XY : "<< ADAPTIVE_SIGMA_XY <<std::endl;
+    std::cout<<"ADAPTIVE_SIGMA_YAW : "<< ADAPTIVE_SIGMA_YAW <<std::endl;
+    std::cout<<"STATIONARY_VELOCITY : "<< STATIONARY_VELOCITY <<std::endl;
+    std::cout<<"STATIONARY_YAW_RATE : "<< STATIONARY_YAW_RATE <<std::endl;
+    std::cout<<"STATIONARY_SKIP : "<< STATIONARY_SKIP <<std::endl;
+    std::cout<<"STATIONARY_TIME : "<< STATIONARY_TIME <<std::endl;
+    std::cout<<"STATIONARY_RECHECK_PERIOD : "<< STATIONARY_RECHECK_PERIOD <<std::endl;
+    std::cout<<"STATIONARY_SCAN_TOLERANCE : "<< STATIONARY_SCAN_TOLERANCE <<std::endl;
+
+    if(SCAN_POLICY == "drop"){
+        scan_policy = SCAN_DROP;
+    }else if(SCAN_POLICY == "queue"){
+        scan_policy = SCAN_QUEUE;
+    }else{
+        if(SCAN_POLICY != "latest"){
+            std::cout << "\033[33munknown SCAN_POLICY: " << SCAN_POLICY << ", 'latest' is used\033[0m" << std::endl;
+        }
+        scan_policy = SCAN_LATEST;
+    }
+    if(SCAN_QUEUE_SIZE < 1) SCAN_QUEUE_SIZE = 1;
+    if(MAX_ITERATIONS < 1) MAX_ITERATIONS = 1;
+    if(ALIGN_CHUNK_ITERATIONS < 1) ALIGN_CHUNK_ITERATIONS = 1;
+
+    // e.g. "2.0 1.0" (or "2.0,1.0"): levels coarser than RESOLUTION, aligned before it
+    coarse_resolutions.clear();
+    std::string resolutions = MULTI_RESOLUTION;
+    std::replace(resolutions.begin(), resolutions.end(), ',', ' ');
+    std::istringstream resolution_stream(resolutions);
+    double resolution;
+    while(resolution_stream >> resolution){
+        if(resolution > RESOLUTION){
+            coarse_resolutions.push_back(resolution);
+        }else{
+            std::cout << "\033[33mMULTI_RESOLUTION: " << resolution << " is not coarser than RESOLUTION, ignored\033[0m" << std::endl;
+        }
+    }
+    std::sort(coarse_resolutions.begin(), coarse_resolutions.end(), std::greater<double>());
+    coarse_resolutions.erase(std::unique(coarse_resolutions.begin(), coarse_resolutions.end()), coarse_resolutions.end());
+
+    if(INITIAL_GUESS == "latest"){
+        guess_mode = GUESS_LATEST;
+    }else{
+        if(INITIAL_GUESS != "predicted"){
+            std::cout << "\033[33munknown INITIAL_GUESS: " << INITIAL_GUESS << ", 'predicted' is used\033[0m" << std::endl;
+        }
+        guess_mode = GUESS_PREDICTED;
+    }
+
+    // "x_min x_max y_min y_max" (or comma separated), empty: whole map
+    std::fill(relocalize_roi, relocalize_roi + 4, 0.0);
+    if(!RELOCALIZE_ROI.empty()){
+        std::string roi = RELOCALIZE_ROI;
+        std::replace(roi.begin(), roi.end(), ',', ' ');
+        std::istringstream roi_stream(roi);
+        double values[4];
+        if(roi_stream >> values[0] >> values[1] >> values[2] >> values[3] && values[0] < values[1] && values[2] < values[3]){
+            std::copy(values, values + 4, relocalize_roi);
+        }else{
+            std::cout << "\033[33mRELOCALIZE_ROI: '" << RELOCALIZE_ROI << "' is not x_min x_max y_min y_max, the whole map is used\033[0m" << std::endl;
+        }
+    }
+}
+
+
+void
+Matcher::setup(){
+    map_index = MapTileIndex(MAP_TILE_SIZE, MAP_INTENSITY);
+    scan_preprocessor.set_range(LIMIT_RANGE);
+    scan_preprocessor.set_height_band(MIN_HEIGHT, MAX_HEIGHT);
+    scan_preprocessor.set_voxel_size(VOXEL_SIZE);
+    scan_preprocessor.set_num_threads(PREPROCESS_THREADS);
+    scan_preprocessor.set_histograms(&stage_histograms[STAGE_READ_CROP], &stage_histograms[STAGE_VOXEL]);
+    scan_preprocessor.set_deskew(DESKEW, SCAN_PERIOD, SCAN_STAMP_AT_END);
+    scan_preprocessor.set_deskew_histogram(&stage_histograms[STAGE_DESKEW]);
+    pose_history.set_capacity(POSE_HISTORY_SIZE);
+    pose_history.set_max_extrapolation(GUESS_MAX_EXTRAPOLATION);
+    relocalizer.set_resolution(RELOCALIZE_RESOLUTION);
+    relocalizer.set_xy_step(RELOCALIZE_XY_STEP);
+    relocalizer.set_yaw_steps(RELOCALIZE_YAW_STEPS);
+    relocalizer.set_sample_num(RELOCALIZE_POINTS);
+    relocalizer.set_candidate_num(RELOCALIZE_CANDIDATES);
+    relocalizer.set_num_threads(RELOCALIZE_THREADS);
 
     // buffer_odom.header.frame_id = PARENT_FRAME;
     // buffer_odom.child_frame_id = CHILD_FRAME;
 
-    ndt.setTransformationEpsilon(0.001);
-    ndt.setStepSize(0.1);
+    ndt.setTransformationEpsilon(TRANSFORMATION_EPSILON);
+    ndt.setStepSize(STEP_SIZE);
     ndt.setResolution(RESOLUTION);//1.0 change 05/09
-    ndt.setMaximumIterations(35);
+    ndt.setMaximumIterations(MAX_ITERATIONS);
+
+    coarse_ndt.clear();
+    for(double resolution : coarse_resolutions){
+        coarse_ndt.emplace_back(new NDT);
+        NDT& level = *coarse_ndt.back();
+        // the coarse levels only have to bring the pose into the basin of the finer one
+        level.setTransformationEpsilon(10 * TRANSFORMATION_EPSILON);
+        level.setStepSize(STEP_SIZE * resolution / RESOLUTION);
+        level.setResolution(resolution);
+        level.setMaximumIterations(COARSE_MAX_ITERATIONS);
+    }
+}
+
+
+Matcher::~Matcher(){
+    stop();
 }
 
 
 void
 Matcher::map_read(std::string filename){
+    if(MAP_STREAMING){
+        if(open_map_tiles(filename)) return;
+        std::cout << "\033[31mmap tiles cannot be opened, the whole map is loaded\033[0m" << std::endl;
+    }
+
+    pcl::PointCloud<pcl::PointXYZI>::Ptr map_target_cloud (new pcl::PointCloud<pcl::PointXYZI>);
+
+    const double offset[6] = {CLOUD_MAP_OFFSET_X, CLOUD_MAP_OFFSET_Y, CLOUD_MAP_OFFSET_Z,
+                              CLOUD_MAP_OFFSET_ROLL, CLOUD_MAP_OFFSET_PITCH, CLOUD_MAP_OFFSET_YAW};
+    MapCache map_cache(MAP_CACHE_FILE.empty() ? filename + ".cache" : MAP_CACHE_FILE, filename, VOXEL_SIZE, offset);
+    ScopedTimer load_timer(NULL);
+
+    if(USE_MAP_CACHE && map_cache.load(*map_cloud, *map_target_cloud)){
+        std::cout<< "\x1b[32m" << "map has been loaded from cache : "<< map_cache.get_file() << "\x1b[m\r" <<std::endl;
+        std::cout << "downsampled map points: " << map_cloud->points.size() << std::endl;
+    }else{
+        preprocess_map(filename, map_target_cloud);
+        if(USE_MAP_CACHE && map_cache.save(*map_cloud, *map_target_cloud)){
+            std::cout << "map cache has been saved to : " << map_cache.get_file() << std::endl;
+        }
+    }
+    map_cloud->header.frame_id = PARENT_FRAME;
+    map_load_time = load_timer.elapsed();
+    std::cout << "map has been prepared in " << map_load_time << "[s]" << std::endl;
+
+    // the compact tiles do not shrink the whole-map structures below, a large map is streamed instead
+    if(MAP_MAX_POINTS > 0 && map_target_cloud->points.size() > static_cast<size_t>(MAP_MAX_POINTS)){
+        std::cout << "\033[31m" << map_target_cloud->points.size() << " ndt target points are more than MAP_MAX_POINTS, "
+                  << "the map is streamed from tiles\033[0m" << std::endl;
+        map_cloud.reset(new pcl::PointCloud<pcl::PointXYZI>);
+        if(open_map_tiles(filename, map_target_cloud)) return;
+        std::cout << "\033[31mmap tiles cannot be written, the whole map is loaded\033[0m" << std::endl;
+        preprocess_map(filename, map_target_cloud);
+    }
+
+    map_index.build(*map_cloud);
+    map_memory = map_index.get_memory_bytes();
+    std::cout << "map tiles: " << map_index.get_tile_num() << std::endl;
+
+    /*------ visualization ------*/
+    // no message of the whole map is kept, /vis/map is made on demand from the levels of detail
+    map_lod.build(*map_cloud, map_index, VOXEL_SIZE, std::max(MAP_VIS_LEVELS, 1));
+    map_memory += map_lod.get_memory_bytes();
+    map_vis_ready = true;
+    std::cout << "map levels of detail: " << map_lod.get_level_num() << " (" << map_lod.get_memory_bytes() / 1e6 << "[MB] above the map)" << std::endl;
+    if(map_pub && map_pub.getNumSubscribers() > 0){
+        // subscribed before the map was there
+        pcl::PointCloud<pcl::PointXYZI> overview;
+        map_lod.query(MAP_VIS_MAX_POINTS, overview);
+        sensor_msgs::PointCloud2 vis_map;
+        make_vis_map(overview, vis_map);
+        map_pub.publish(vis_map);
+    }
+
+    /*------ NDT target ------*/
+    // the voxel grid (mean / covariance per cell) of the whole map is built only once here.
+    // ndt_matching() only sets the source cloud, so no per-scan rebuild of the target happens.
+    std::cout << "ndt target points: " << map_target_cloud->points.size() << std::endl;
+
+    ScopedTimer target_timer(NULL);
+    // one voxel grid per level, also built once
+    if(set_target(map_target_cloud)){
+        target_build_time = target_timer.elapsed();
+        std::cout << "ndt target has been built in " << target_build_time << "[s]" << std::endl;
+    }else if(!map_target_cloud->points.empty()){
+        // as with MAP_STREAMING, from the compact tiles whenever the window changes
+        window_target = true;
+        map_target_cloud.reset(new pcl::PointCloud<pcl::PointXYZI>);
+        std::cout << "\033[31mthe map is too large for one ndt voxel grid of " << RESOLUTION
+                  << "[m], the ndt target is the window around the robot\033[0m" << std::endl;
+    }
+
+    /*------ relocalization ------*/
+    if(window_target && (RELOCALIZE_AFTER_FAILURES > 0 || RELOCALIZE_ON_START)){
+        std::cout << "\033[33mno global relocalization with the window target, it needs the whole map\033[0m" << std::endl;
+    }else if(RELOCALIZE_AFTER_FAILURES > 0 || RELOCALIZE_ON_START){
+        ScopedTimer relocalizer_timer(NULL);
+        if(relocalizer.build(*map_cloud, relocalize_roi[0], relocalize_roi[1], relocalize_roi[2], relocalize_roi[3], LIMIT_RANGE)){
+            relocalizer_build_time = relocalizer_timer.elapsed();
+            std::cout << "relocalizer has been built in " << relocalizer_build_time << "[s]" << std::endl;
+            // without /EKF/result (no initial pose yet) the first scan is relocalized
+            if(RELOCALIZE_ON_START) request_relocalization();
+        }else{
+            std::cout << "\033[31mrelocalizer cannot be built, no relocalization\033[0m" << std::endl;
+        }
+    }
+
+    /*------ memory ------*/
+    // the local map is decoded from the compact tiles from now on, the full cloud is not kept
+    const size_t cloud_memory = map_cloud->points.capacity() * sizeof(pcl::PointXYZI);
+    map_cloud.reset(new pcl::PointCloud<pcl::PointXYZI>);
+    target_memory = map_target_cloud->points.capacity() * sizeof(pcl::PointXYZI);
+    std::cout << "map memory: compact tiles " << map_memory / 1e6 << "[MB] (" << map_index.get_point_num() << " points, "
+              << cloud_memory / 1e6 << "[MB] as a cloud, released), ndt target cloud " << target_memory / 1e6
+              << "[MB] (" << map_target_cloud->points.size() << " points, plus its voxel grids)" << std::endl;
+}
+
+
+void
+Matcher::make_vis_map(const pcl::PointCloud<pcl::PointXYZI>& cloud, sensor_msgs::PointCloud2& msg){
+    pcl::toROSMsg(cloud, msg);
+    msg.header.stamp = ros::Time(0); //laserのframe_id
+    msg.header.frame_id = PARENT_FRAME;
+}
+
+
+void
+Matcher::map_connect_callback(const ros::SingleSubscriberPublisher& pub){
+    if(!map_vis_ready) return;
+    pcl::PointCloud<pcl::PointXYZI> overview;
+    const int level = map_lod.query(MAP_VIS_MAX_POINTS, overview);
+    sensor_msgs::PointCloud2 vis_map;
+    make_vis_map(overview, vis_map);
+    pub.publish(vis_map);
+    std::cout << "/vis/map: " << overview.points.size() << " points (" << map_lod.get_resolution(level) << "[m]) to "
+              << pub.getSubscriberName() << std::endl;
+}
+
+
+void
+Matcher::map_request_callback(const geometry_msgs::PolygonStampedConstPtr& msg){
+    if(!map_vis_ready || map_detail_pub.getNumSubscribers() == 0 || msg->polygon.points.empty()) return;
+
+    double x_min = std::numeric_limits<double>::max(), x_max = -std::numeric_limits<double>::max();
+    double y_min = x_min, y_max = x_max;
+    for(const auto& p : msg->polygon.points){
+        x_min = std::min(x_min, static_cast<double>(p.x));
+        x_max = std::max(x_max, static_cast<double>(p.x));
+        y_min = std::min(y_min, static_cast<double>(p.y));
+        y_max = std::max(y_max, static_cast<double>(p.y));
+    }
+    pcl::PointCloud<pcl::PointXYZI> detail;
+    map_lod.query(x_min, x_max, y_min, y_max, MAP_VIS_MAX_POINTS, detail);
+    sensor_msgs::PointCloud2 vis_map;
+    make_vis_map(detail, vis_map);
+    map_detail_pub.publish(vis_map);
+}
+
+
+bool
+Matcher::open_map_tiles(const std::string& filename, pcl::PointCloud<pcl::PointXYZI>::Ptr map_target_cloud){
+    const std::string tile_file = MAP_TILE_FILE.empty() ? filename + ".tiles" : MAP_TILE_FILE;
+    const double offset[6] = {CLOUD_MAP_OFFSET_X, CLOUD_MAP_OFFSET_Y, CLOUD_MAP_OFFSET_Z,
+                              CLOUD_MAP_OFFSET_ROLL, CLOUD_MAP_OFFSET_PITCH, CLOUD_MAP_OFFSET_YAW};
+    map_store.set_source(filename, VOXEL_SIZE, offset, MAP_TILE_SIZE, MAP_INTENSITY);
+    ScopedTimer load_timer(NULL);
+    if(!map_store.open(tile_file, MAP_CACHE_TILES)){
+        // made once from the PCD, which has to fit into memory this time (e.g. on a bigger machine)
+        if(!map_target_cloud){
+            map_target_cloud.reset(new pcl::PointCloud<pcl::PointXYZI>);
+            preprocess_map(filename, map_target_cloud);
+            map_cloud.reset(new pcl::PointCloud<pcl::PointXYZI>);
+        }
+        MapTileIndex index(MAP_TILE_SIZE, MAP_INTENSITY);
+        index.build(*map_target_cloud);
+        map_target_cloud.reset();
+        if(!map_store.save(tile_file, index) || !map_store.open(tile_file, MAP_CACHE_TILES)) return false;
+        std::cout << "map tiles have been saved to : " << tile_file << std::endl;
+    }
+    map_load_time = load_timer.elapsed();
+    map_memory = map_store.get_memory_bytes();
+    window_target = true;
+
+    // the ndt target is the window around the robot, set by the align thread whenever it changes
+    std::cout << "map tiles: " << tile_file << ", " << map_store.get_tile_num() << " tiles of " << map_store.get_tile_size()
+              << "[m], " << map_store.get_point_num() << " points, read on demand (cache of " << MAP_CACHE_TILES << " tiles), opened in "
+              << map_load_time << "[s]" << std::endl;
+    if(RELOCALIZE_AFTER_FAILURES > 0 || RELOCALIZE_ON_START){
+        std::cout << "\033[33mno global relocalization with MAP_STREAMING, it needs the whole map\033[0m" << std::endl;
+    }
+    return true;
+}
+
+
+bool
+Matcher::set_target(const pcl::PointCloud<pcl::PointXYZI>::Ptr& target){
+    // an empty target (outside the map) is not aligned against
+    has_target = !target->points.empty();
+    if(!has_target) return false;
+    // the coarse levels have fewer cells than RESOLUTION
+    if(!fits_voxel_grid(*target, RESOLUTION)){
+        has_target = false;
+        std::cout << "\033[31mndt target too large for a voxel grid of " << RESOLUTION << "[m], not aligned\033[0m" << std::endl;
+        return false;
+    }
+    ndt.setInputTarget(target);
+    for(size_t i = 0; i < coarse_ndt.size(); i++){
+        coarse_ndt[i]->setInputTarget(target);
+        if(!window_target) std::cout << "ndt target level " << coarse_resolutions[i] << "[m] has been built" << std::endl;
+    }
+    return true;
+}
+
+
+void
+Matcher::preprocess_map(std::string filename, pcl::PointCloud<pcl::PointXYZI>::Ptr& map_target_cloud){
 
     pcl::PointCloud<pcl::PointXYZI>::Ptr low_map_cloud (new pcl::PointCloud<pcl::PointXYZI>);
 
@@ -90,89 +606,212 @@ Matcher::map_read(std::string filename){
     pcl::transformPointCloud(*map_cloud, *map_cloud, cloud_map_offset);
     std::cout << "cloud origin in " << map_cloud->header.frame_id << ": \n" << cloud_map_offset.matrix() << std::endl;
 
-    sensor_msgs::PointCloud2 vis_map;
-    pcl::toROSMsg(*map_cloud , vis_map);
-
-    vis_map.header.stamp = ros::Time(0); //laserのframe_id
-    // vis_map.header.stamp = ros::Time(0); //laserのframe_id
-    vis_map.header.frame_id = PARENT_FRAME;
-
-    map_pub.publish(vis_map);
-    // sleep(1.0);
+    pcl::VoxelGrid<pcl::PointXYZI> vg;
+    vg.setLeafSize(VOXEL_SIZE, VOXEL_SIZE, VOXEL_SIZE);
+    vg.setInputCloud(map_cloud);
+    vg.filter(*map_target_cloud);
 }
 
 
 void
-Matcher::lidarcallback(const sensor_msgs::PointCloud2::Ptr msg){
+Matcher::lidarcallback(const sensor_msgs::PointCloud2ConstPtr& msg){
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+
+    // the same scan delivered twice (or an older one) is never aligned again,
+    // a stamp far before the last one (bag loop, sim time reset) starts again
+    if(scan_seq > 0 && msg->header.stamp <= last_scan_stamp){
+        if((last_scan_stamp - msg->header.stamp).toSec() <= STAMP_JUMP_BACK){
+            duplicate_scans++;
+            return;
+        }
+        std::cout << "\033[33mscan stamp jumped back by " << (last_scan_stamp - msg->header.stamp).toSec() << " s, restarting\033[0m" << std::endl;
+        last_aligned_stamp = 0;
+    }
+    last_scan_stamp = msg->header.stamp;
+
+    // dropped before the preprocess, it costs nothing
+    if(!needs_alignment(msg->header.stamp)){
+        adaptive_skipped_scans++;
+        return;
+    }
 
-    buffer_time  = msg->header.stamp;
-    buffer_pc  = *msg;
+    Scan scan;
+    scan.seq = ++scan_seq;
+    scan.receive_time = ros::WallTime::now().toSec();
+    scan.msg = msg;
 
+    switch(scan_policy){
+        case SCAN_DROP:
+            if(is_aligning || !scan_queue.empty()){
+                skipped_scans++;
+                return;
+            }
+            break;
+        case SCAN_QUEUE:
+            if(static_cast<int>(scan_queue.size()) >= SCAN_QUEUE_SIZE){
+                scan_queue.pop_front();
+                skipped_scans++;
+            }
+            break;
+        case SCAN_LATEST:
+        default:
+            skipped_scans += scan_queue.size();
+            scan_queue.clear();
+            break;
+    }
+    scan_queue.push_back(scan);
+    // a scan dropped by the policy above does not hold the next ones back
+    last_aligned_stamp = msg->header.stamp.toSec();
+    scan_cv.notify_one();
 }
 
 void
 Matcher::odomcallback(const nav_msgs::OdometryConstPtr& msg){
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    // until the ekf has taken the re-seed over, /EKF/result from before it is ignored
+    if(reseed_pending){
+        const double distance = std::hypot(msg->pose.pose.position.x - buffer_odom.pose.pose.position.x,
+                                           msg->pose.pose.position.y - buffer_odom.pose.pose.position.y);
+        if(distance > RESEED_TOLERANCE && ros::WallTime::now().toSec() < reseed_deadline) return;
+        reseed_pending = false;
+    }
     is_start = true;
     buffer_odom = *msg;
+    pose_history.add(*msg);
+    min_variance_xy = std::min(min_variance_xy, std::max(msg->pose.covariance[0], msg->pose.covariance[7]));
+    min_variance_yaw = std::min(min_variance_yaw, msg->pose.covariance[35]);
+    if(std::fabs(msg->twist.twist.linear.x) >= STATIONARY_VELOCITY || std::fabs(msg->twist.twist.angular.z) >= STATIONARY_YAW_RATE){
+        stationary_since = 0;
+    }else if(stationary_since <= 0){
+        stationary_since = msg->header.stamp.toSec();
+    }
+    scan_cv.notify_one();
+}
+
+bool
+Matcher::wait_for_scan(double timeout){
+    std::unique_lock<std::mutex> lock(buffer_mutex);
+    return scan_cv.wait_for(lock, std::chrono::duration<double>(timeout),
+            [this]{ return (is_start || relocalize_requested) && !scan_queue.empty(); });
+}
+
+bool
+Matcher::needs_alignment(const ros::Time& stamp) const{
+    if(!ADAPTIVE_MATCHING) return true;
+
+    const double now = stamp.toSec();
+    bool align;
+    if(!is_start || !has_accepted_pose || relocalize_requested || last_aligned_stamp <= 0){
+        align = true;
+    }else if(ADAPTIVE_MAX_RATE > 0 && now - last_aligned_stamp < 1.0 / ADAPTIVE_MAX_RATE){
+        align = false;
+    }else if(ADAPTIVE_MIN_RATE > 0 && now - last_aligned_stamp >= 1.0 / ADAPTIVE_MIN_RATE){
+        align = true;
+    }else{
+        const nav_msgs::Odometry& odo = buffer_odom;
+        const double sigma_xy = std::sqrt(std::max(std::max(odo.pose.covariance[0], odo.pose.covariance[7]), 0.0));
+        const double sigma_yaw = std::sqrt(std::max(odo.pose.covariance[35], 0.0));
+        const double distance = std::hypot(odo.pose.pose.position.x - accepted_x, odo.pose.pose.position.y - accepted_y);
+        const double yaw = tf::getYaw(odo.pose.pose.orientation) - accepted_yaw;
+        const double angle = std::fabs(std::atan2(std::sin(yaw), std::cos(yaw)));
+        const bool stationary = std::fabs(odo.twist.twist.linear.x) < STATIONARY_VELOCITY
+                             && std::fabs(odo.twist.twist.angular.z) < STATIONARY_YAW_RATE;
+
+        // standing still, the odometry does not drift: only the minimum rate
+        align = !stationary
+             && (sigma_xy - std::sqrt(std::max(min_variance_xy, 0.0)) > ADAPTIVE_SIGMA_XY
+                 || sigma_yaw - std::sqrt(std::max(min_variance_yaw, 0.0)) > ADAPTIVE_SIGMA_YAW
+                 || distance > ADAPTIVE_DISTANCE || angle > ADAPTIVE_ANGLE);
+    }
+    return align;
+}
+
+Eigen::Matrix4f
+Matcher::initial_guess(const ros::Time& stamp, double& gap){
+    Eigen::Affine3d pose;
+    if(guess_mode == GUESS_LATEST || !pose_history.predict(stamp.toSec(), pose, gap)){
+        const nav_msgs::Odometry& odo = buffer_odom;
+        Eigen::AngleAxisf init_rotation (tf::getYaw(odo.pose.pose.orientation) , Eigen::Vector3f::UnitZ ());
+        Eigen::Translation3f init_translation (odo.pose.pose.position.x, odo.pose.pose.position.y, odo.pose.pose.position.z);
+        gap = (stamp - odo.header.stamp).toSec();
+        return (init_translation * init_rotation).matrix ();
+    }
+
+    // the ekf only estimates x, y and yaw, z / roll / pitch are taken over from the last accepted match
+    if(has_last_match){
+        const double yaw = std::atan2(pose.linear()(1, 0), pose.linear()(0, 0));
+        pose.linear() = (Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ())
+                       * Eigen::AngleAxisd(last_match_pitch, Eigen::Vector3d::UnitY())
+                       * Eigen::AngleAxisd(last_match_roll, Eigen::Vector3d::UnitX())).toRotationMatrix();
+        pose.translation()(2) = last_match_z;
+    }
+    return pose.matrix().cast<float>();
 }
 
 Eigen::Matrix4f
 Matcher::ndt_matching(
-        pcl::PointCloud<pcl::PointXYZI>::Ptr cloud_tgt,
         pcl::PointCloud<pcl::PointXYZI>::Ptr cloud_src,
-        pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud, nav_msgs::Odometry odo){
-
-    std::cout << "--- ndt start ---" << std::endl;
-    double start_time = ros::Time::now().toSec();
-    std::cout << "source cloud: " << cloud_src->points.size() << std::endl;
-    std::cout << "target cloud: " << cloud_tgt->points.size() << std::endl;
-    /*------ Voxel Grid ------*/
-    pcl::PointCloud<pcl::PointXYZI>::Ptr filtered_cloud_src (new pcl::PointCloud<pcl::PointXYZI>);
-    pcl::PointCloud<pcl::PointXYZI>::Ptr filtered_cloud_tgt (new pcl::PointCloud<pcl::PointXYZI>);
-    pcl::VoxelGrid<pcl::PointXYZI> vg;
-    vg.setLeafSize(VOXEL_SIZE, VOXEL_SIZE, VOXEL_SIZE);
-    vg.setInputCloud(cloud_src);
-    vg.filter(*filtered_cloud_src);
-    vg.setInputCloud(cloud_tgt);
-    vg.filter(*filtered_cloud_tgt);
-    std::cout << "downsampled source cloud: " << filtered_cloud_src->points.size() << std::endl;
-    std::cout << "downsampled target cloud: " << filtered_cloud_tgt->points.size() << std::endl;
-
-    Eigen::AngleAxisf init_rotation (tf::getYaw(odo.pose.pose.orientation) , Eigen::Vector3f::UnitZ ());
-    Eigen::Translation3f init_translation (odo.pose.pose.position.x, odo.pose.pose.position.y, odo.pose.pose.position.z);
+        pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud, const Eigen::Matrix4f& init_guess, double time_budget){
 
-    Eigen::Matrix4f init_guess = (init_translation * init_rotation).matrix ();
+    // cloud_src has already been cropped and voxelized by ScanPreprocessor
+    const ScopedTimer::Clock::time_point deadline = ScopedTimer::Clock::now()
+        + std::chrono::duration_cast<ScopedTimer::Clock::duration>(std::chrono::duration<double>(time_budget));
+    const ScopedTimer::Clock::time_point* deadline_ptr = time_budget > 0 ? &deadline : NULL;
 
-    ndt.setInputTarget(filtered_cloud_tgt);
-    ndt.setInputSource(filtered_cloud_src);
-    ndt.align (*cloud, init_guess);
+    // coarse to fine: every level starts from the result of the coarser one
+    Eigen::Matrix4f pose = init_guess;
+    align_iterations = 0;
+    align_truncated = false;
+    for(auto& level : coarse_ndt){
+        last_level = level.get();
+        if(!align_level(*level, cloud_src, cloud, COARSE_MAX_ITERATIONS, deadline_ptr, pose)){
+            align_truncated = true;
+            return pose;
+        }
+    }
 
-    std::cout << "ndt has converged: " << ndt.hasConverged() << std::endl;
-    std::cout << "ndt score: " << ndt.getFitnessScore() << std::endl;
-    Eigen::Matrix4f result = ndt.getFinalTransformation();
-    std::cout << "ndt result: \n" << result << std::endl;
-    std::cout << "ndt time: " << ros::Time::now().toSec() - start_time << "[s]" << std::endl;
-    return result;
+    last_level = &ndt;
+    align_truncated = !align_level(ndt, cloud_src, cloud, MAX_ITERATIONS, deadline_ptr, pose);
+    return pose;
 }
 
-void
-Matcher::local_pc(
-        pcl::PointCloud<pcl::PointXYZI>::Ptr input_cloud,
-        pcl::PointCloud<pcl::PointXYZI>::Ptr &output_cloud,
-        double x_now,double y_now)
-{
-    output_cloud->points.clear();
+bool
+Matcher::align_level(NDT& level, pcl::PointCloud<pcl::PointXYZI>::Ptr cloud_src,
+        pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud, int max_iterations,
+        const ScopedTimer::Clock::time_point* deadline, Eigen::Matrix4f& pose){
 
-    for(const auto& temp_point : input_cloud->points){
+    level.setInputSource(cloud_src);
+    if(deadline == NULL){
+        level.setMaximumIterations(max_iterations);
+        level.align(*cloud, pose);
+        pose = level.getFinalTransformation();
+        align_iterations += level.getFinalNumIteration();
+        return true;
+    }
 
-        if((LIMIT_RANGE * (-1) + x_now <= temp_point.x && temp_point.x  <= LIMIT_RANGE+ x_now) && (LIMIT_RANGE *(-1) + y_now <= temp_point.y && temp_point.y <= LIMIT_RANGE + y_now) ){
+    // a chunk stops early when converged, otherwise the next one continues from its pose.
+    // the next chunk is only started when it is expected to end before the deadline.
+    // cut short, the pose of the last chunk is taken: getFitnessScore() and the covariance are of that one
+    int remaining = max_iterations;
+    while(remaining > 0){
+        const int chunk = std::min(ALIGN_CHUNK_ITERATIONS, remaining);
+        const ScopedTimer::Clock::time_point chunk_start = ScopedTimer::Clock::now();
+        level.setMaximumIterations(chunk);
+        level.align(*cloud, pose);
+        pose = level.getFinalTransformation();
+        const int iterations = std::max(1, level.getFinalNumIteration());
+        align_iterations += iterations;
+        remaining -= iterations;
 
-            output_cloud->points.push_back(temp_point);
-        }
+        // hasConverged() is also set at the iteration limit, which the ndt counts as chunk + 1
+        if(iterations <= chunk) return true;
+
+        const ScopedTimer::Clock::time_point now = ScopedTimer::Clock::now();
+        if(remaining > 0 && now + (now - chunk_start) > *deadline) return false;
     }
+    return true;
 }
 
-
 void
 Matcher::calc_rpy(Eigen::Matrix4f ans, double &yaw){
     double roll, pitch;
@@ -184,39 +823,508 @@ Matcher::calc_rpy(Eigen::Matrix4f ans, double &yaw){
     mat_l.getRPY(roll, pitch, yaw, 1);
 }
 
+void
+Matcher::calc_rpy(Eigen::Matrix4f ans, double &roll, double &pitch, double &yaw){
+    tf::Matrix3x3 mat_l;
+    mat_l.setValue(static_cast<double>(ans(0, 0)), static_cast<double>(ans(0, 1)), static_cast<double>(ans(0, 2)),
+            static_cast<double>(ans(1, 0)), static_cast<double>(ans(1, 1)), static_cast<double>(ans(1, 2)),
+            static_cast<double>(ans(2, 0)), static_cast<double>(ans(2, 1)), static_cast<double>(ans(2, 2)));
+
+    mat_l.getRPY(roll, pitch, yaw, 1);
+}
+
 
 void
-Matcher::process(){
-    pcl::PointCloud<pcl::PointXYZI>::Ptr lidar_cloud (new pcl::PointCloud<pcl::PointXYZI>);
-    pcl::fromROSMsg(buffer_pc,*lidar_cloud);
+Matcher::start(){
+    if(running) return;
+    running = true;
+    preprocess_thread = std::thread(&Matcher::preprocess_loop, this);
+    align_thread = std::thread(&Matcher::align_loop, this);
+    publish_thread = std::thread(&Matcher::publish_loop, this);
+}
 
-    local_pc(lidar_cloud, local_lidar_cloud, 0.0, 0.0);
 
-    local_pc(map_cloud, local_map_cloud, buffer_odom.pose.pose.position.x, buffer_odom.pose.pose.position.y);
+void
+Matcher::stop(){
+    running = false;
+    scan_cv.notify_all();
+    if(preprocess_thread.joinable()) preprocess_thread.join();
+    if(align_thread.joinable()) align_thread.join();
+    if(publish_thread.joinable()) publish_thread.join();
+}
 
-    Eigen::Matrix4f answer = ndt_matching(local_map_cloud,local_lidar_cloud, ndt_cloud,buffer_odom);
 
-    if(ndt.getFitnessScore() < MATCHING_SCORE_THRESHOLD){
-        double ans_yaw;
+void
+Matcher::preprocess_loop(){
+    Frame* frame = NULL;
+    while(running){
+        if(frame == NULL && !free_frames.wait_pop(frame, running)) break;
+        // the scan is taken as late as possible, so the newest one is used under the 'latest' policy
+        if(!wait_for_scan(0.1)) continue;
 
-        calc_rpy(answer,ans_yaw);
+        Scan scan;
+        {
+            std::lock_guard<std::mutex> lock(buffer_mutex);
+            scan = scan_queue.front();
+            scan_queue.pop_front();
+            frame->odom = buffer_odom;
+            frame->guess = initial_guess(scan.msg->header.stamp, frame->guess_gap);
+            frames_in_flight++;
+        }
 
-        buffer_odom.pose.pose.position.x =  answer(0, 3);
-        buffer_odom.pose.pose.position.y =  answer(1, 3);
-        buffer_odom.pose.pose.orientation = tf::createQuaternionMsgFromYaw(ans_yaw);
+        if(!preprocess_frame(frame, scan)) continue;
 
-        odom_pub.publish(buffer_odom);
+        // never fails, there are only FRAME_NUM frames
+        align_queue.push(frame);
+        frame = NULL;
+    }
+}
 
 
-        sensor_msgs::PointCloud2 vis_pc;
-        pcl::toROSMsg(*ndt_cloud , vis_pc);
+void
+Matcher::align_loop(){
+    Frame* frame;
+    while(align_queue.wait_pop(frame, running)){
+        align_frame(frame);
+        publish_queue.push(frame);
+    }
+}
 
-        vis_pc.header.stamp = buffer_time;
-        vis_pc.header.frame_id = PARENT_FRAME;
 
-        pc_pub.publish(vis_pc);
+void
+Matcher::publish_loop(){
+    Frame* frame;
+    while(publish_queue.wait_pop(frame, running)){
+        publish_frame(frame);
+        free_frames.push(frame);
+    }
+}
+
+
+bool
+Matcher::preprocess_frame(Frame* frame, const Scan& scan){
+    ScopedTimer timer(&stage_histograms[STAGE_PREPROCESS]);
+    frame->seq = scan.seq;
+    frame->stamp = scan.msg->header.stamp;
+    frame->receive_time = scan.receive_time;
+
+    // motion during the sweep from /EKF/result (odometry velocity, imu yaw rate),
+    // the lidar is assumed to be aligned with the base and close to its rotation center
+    const geometry_msgs::Twist& twist = frame->odom.twist.twist;
+    scan_preprocessor.set_motion(twist.linear.x, twist.linear.y, twist.angular.z);
+
+    // the message is shared with the subscriber queue, it is read in place (no deep copy),
+    // cropped and voxelized in the same pass
+    if(!scan_preprocessor.convert(*scan.msg, *frame->cloud)){
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        skipped_scans++;
+        frames_in_flight--;
+        return false;
+    }
+
+    // only the tiles which entered / left the window are copied
+    {
+        ScopedTimer local_map_timer(&stage_histograms[STAGE_LOCAL_MAP]);
+        const double x = frame->guess(0, 3), y = frame->guess(1, 3);
+        bool changed;
+        frame->target.reset();
+        if(map_store.is_open()){
+            // ahead along the heading of the guess (behind when reversing), nothing ahead when standing
+            const double yaw = std::atan2(frame->guess(1, 0), frame->guess(0, 0));
+            const double direction = std::fabs(twist.linear.x) < STATIONARY_VELOCITY ? 0.0 : (twist.linear.x < 0 ? -1.0 : 1.0);
+            map_store.prefetch(x, y, direction * std::cos(yaw), direction * std::sin(yaw), LIMIT_RANGE, MAP_PREFETCH_DISTANCE);
+            // the first window is waited for, there is nothing to align against before it
+            changed = map_store.update_window(x, y, LIMIT_RANGE, *local_map_cloud, !has_target);
+            if(changed) frame->target.reset(new pcl::PointCloud<pcl::PointXYZI>(*local_map_cloud));
+        }else if(window_target || (local_map_pub && local_map_pub.getNumSubscribers() > 0)){
+            // with the whole map as the target only /vis/local_map needs the window
+            changed = map_index.update_window(x, y, LIMIT_RANGE, *local_map_cloud);
+            if(changed && window_target) frame->target.reset(new pcl::PointCloud<pcl::PointXYZI>(*local_map_cloud));
+        }else{
+            changed = false;
+        }
+        // latched: a window which changed without subscribers is published when the next one comes
+        local_map_dirty = local_map_dirty || changed;
+        if(local_map_dirty && local_map_pub && vis_due(local_map_pub, frame->stamp, last_vis_local_map_stamp)){
+            local_map_dirty = false;
+            sensor_msgs::PointCloud2 vis_local_map;
+            pcl::toROSMsg(*local_map_cloud, vis_local_map);
+            vis_local_map.header.stamp = frame->stamp;
+            vis_local_map.header.frame_id = PARENT_FRAME;
+            local_map_pub.publish(vis_local_map);
+        }
+    }
+    frame->preprocess_time = timer.elapsed();
+    return true;
+}
+
+
+void
+Matcher::align_frame(Frame* frame){
+    is_aligning = true;
+    frame->relocalized = false;
+    frame->reused = false;
+    if(frame->target){
+        // the window of the tile file has changed, its tiles are in memory already
+        ScopedTimer timer(NULL);
+        set_target(frame->target);
+        frame->target.reset();
+        target_build_time = timer.elapsed();
+    }
+    if(!has_target){
+        frame->result = frame->guess;
+        frame->score = std::numeric_limits<double>::max();
+        frame->iterations = 0;
+        frame->truncated = false;
+        frame->align_time = 0;
+    }else if(relocalize_requested){
+        // takes seconds, kept out of the align histogram
+        ScopedTimer timer(NULL);
+        frame->relocalized = relocalize(frame);
+        frame->align_time = timer.elapsed();
+        frame->truncated = false;
+        if(frame->relocalized) relocalize_requested = false;
+    }else if(reuse_reference(frame)){
+        // the pose has not changed
+        frame->score = reference_score;
+        frame->iterations = 0;
+        frame->truncated = false;
+        frame->align_time = 0;
+        frame->reused = true;
     }else{
+        {
+            ScopedTimer timer(&stage_histograms[STAGE_ALIGN]);
+            frame->result = ndt_matching(frame->cloud, frame->aligned_cloud, frame->guess, ALIGN_TIME_BUDGET);
+            frame->align_time = timer.elapsed();
+        }
+        {
+            ScopedTimer timer(&stage_histograms[STAGE_FITNESS]);
+            // the target cloud is the same at all levels
+            frame->score = last_level->getFitnessScore();
+            frame->align_time += timer.elapsed();
+        }
+        frame->iterations = align_iterations;
+        frame->truncated = align_truncated;
+        if(frame->truncated) truncated_alignments++;
+        iteration_histogram.record(static_cast<uint64_t>(frame->iterations));
+        guess_gap_histogram.record(std::chrono::duration<double>(std::fabs(frame->guess_gap)));
+    }
+
+    if(frame->score < MATCHING_SCORE_THRESHOLD){
+        if(!frame->reused){
+            has_reference_match = true;
+            reference_stamp = frame->stamp.toSec();
+            reference_result = frame->result;
+            reference_score = frame->score;
+            reference_point_num = frame->cloud->points.size();
+            reference_centroid = centroid_of(*frame->cloud);
+        }
+        double roll, pitch, yaw;
+        calc_rpy(frame->result, roll, pitch, yaw);
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        has_last_match = true;
+        last_match_z = frame->result(2, 3);
+        last_match_roll = roll;
+        last_match_pitch = pitch;
+    }
+    is_aligning = false;
+}
+
+
+bool
+Matcher::reuse_reference(Frame* frame){
+    if(!STATIONARY_SKIP || !has_reference_match) return false;
+
+    const double stamp = frame->stamp.toSec();
+    {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        // the reference has to be from the standstill, a match while moving may be off since
+        if(stationary_since <= 0 || stamp - stationary_since < STATIONARY_TIME || reference_stamp < stationary_since){
+            return false;
+        }
+    }
+    if(stamp - reference_stamp >= STATIONARY_RECHECK_PERIOD) return false;
+
+    // cheap check of the scan: e.g. a door or a person moved in front of the sensor
+    const size_t point_num = frame->cloud->points.size();
+    if(point_num == 0 || std::fabs(static_cast<double>(point_num) - reference_point_num) > 0.05 * reference_point_num){
+        return false;
+    }
+    const Eigen::Vector3f centroid = centroid_of(*frame->cloud);
+    if((centroid - reference_centroid).norm() > STATIONARY_SCAN_TOLERANCE) return false;
+
+    frame->result = reference_result;
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    reused_scans++;
+    return true;
+}
+
+
+bool
+Matcher::relocalize(Frame* frame){
+    ScopedTimer timer(NULL);
+    frame->score = std::numeric_limits<double>::max();
+    frame->iterations = 0;
+    std::vector<Relocalizer::Candidate> candidates;
+    if(!relocalizer.search(*frame->cloud, candidates)) return false;
+    const double search_time = timer.elapsed();
+
+    // every candidate is refined to convergence (no time budget), the best fitness is taken
+    for(const Relocalizer::Candidate& candidate : candidates){
+        Eigen::AngleAxisf rotation(candidate.yaw, Eigen::Vector3f::UnitZ());
+        Eigen::Translation3f translation(candidate.x, candidate.y, candidate.z);
+        const Eigen::Matrix4f pose = ndt_matching(frame->cloud, frame->aligned_cloud, (translation * rotation).matrix(), 0.0);
+        const double score = last_level->getFitnessScore();
+        frame->iterations += align_iterations;
+        if(score < frame->score){
+            frame->score = score;
+            frame->result = pose;
+        }
+    }
+
+    relocalize_time = timer.elapsed();
+    const bool found = frame->score < MATCHING_SCORE_THRESHOLD;
+    double yaw;
+    calc_rpy(frame->result, yaw);
+    std::cout << (found ? "\033[32m" : "\033[31m") << "relocalization: " << candidates.size() << " candidates of "
+              << relocalizer.get_position_num() << " positions, best (" << frame->result(0, 3) << ", " << frame->result(1, 3)
+              << ", " << yaw << ") fitness " << frame->score << ", search " << search_time << "[s], total "
+              << relocalize_time << "[s]\033[0m" << std::endl;
+    return found;
+}
+
+
+void
+Matcher::request_relocalization(){
+    if(!relocalizer.is_built()) return;
+    relocalize_requested = true;
+    scan_cv.notify_one();
+}
+
+
+void
+Matcher::publish_frame(Frame* frame){
+    ScopedTimer timer(&stage_histograms[STAGE_PUBLISH]);
+    nav_msgs::Odometry& odom = frame->odom;
+    const bool accepted = frame->score < MATCHING_SCORE_THRESHOLD;
+
+    if(frame->relocalized){
+        double ans_yaw;
+        calc_rpy(frame->result, ans_yaw);
+
+        geometry_msgs::PoseStamped pose;
+        pose.header.stamp = frame->stamp;
+        pose.header.frame_id = PARENT_FRAME;
+        pose.pose.position.x = frame->result(0, 3);
+        pose.pose.position.y = frame->result(1, 3);
+        pose.pose.position.z = frame->result(2, 3);
+        pose.pose.orientation = tf::createQuaternionMsgFromYaw(ans_yaw);
+        if(relocalize_pub) relocalize_pub.publish(pose);
+        odom.pose.pose = pose.pose;
+
+        // the next guesses start from the new pose, the history of the old one is dropped
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        buffer_odom.header.stamp = frame->stamp;
+        buffer_odom.pose.pose = pose.pose;
+        buffer_odom.twist = nav_msgs::Odometry().twist;
+        pose_history.clear();
+        reseed_pending = true;
+        reseed_deadline = ros::WallTime::now().toSec() + RESEED_TIMEOUT;
+        consecutive_failures = 0;
+        relocalizations++;
+    }else if(accepted){
+        double ans_yaw;
+
+        calc_rpy(frame->result,ans_yaw);
+
+        odom.pose.pose.position.x =  frame->result(0, 3);
+        odom.pose.pose.position.y =  frame->result(1, 3);
+        odom.pose.pose.orientation = tf::createQuaternionMsgFromYaw(ans_yaw);
+        // the pose is the one at the scan, the ekf fuses it there
+        odom.header.stamp = frame->stamp;
+
+        // zero: the ekf uses its NDT_sig, a truncated alignment is given a larger variance
+        for(auto& c : odom.pose.covariance) c = 0.0;
+        if(frame->truncated){
+            odom.pose.covariance[0] = TRUNCATED_VARIANCE_XY;
+            odom.pose.covariance[7] = TRUNCATED_VARIANCE_XY;
+            odom.pose.covariance[35] = TRUNCATED_VARIANCE_YAW;
+        }
+
+        if(odom_pub){
+            // published as a shared pointer, so that the ekf nodelet in the same manager receives it without a copy
+            odom_pub.publish(nav_msgs::OdometryPtr(new nav_msgs::Odometry(odom)));
+        }
+
+        if(pc_pub && vis_due(pc_pub, frame->stamp, last_vis_ndt_stamp)){
+            // the ndt output does not follow a truncated or reused result, the scan is moved here
+            pcl::transformPointCloud(*frame->cloud, *frame->aligned_cloud, frame->result);
+            sensor_msgs::PointCloud2 vis_pc;
+            pcl::toROSMsg(*frame->aligned_cloud , vis_pc);
+
+            vis_pc.header.stamp = frame->stamp;
+            vis_pc.header.frame_id = PARENT_FRAME;
+
+            pc_pub.publish(vis_pc);
+        }
+    }
+
+    if(!accepted){
         std::cout << "\033[31mmathcing result is not used due to high sum of squared distance between clouds\033[0m" << std::endl;
     }
+
+    const double latency = ros::WallTime::now().toSec() - frame->receive_time;
+    stage_histograms[STAGE_LATENCY].record(std::chrono::duration<double>(latency));
+
+    if(result_callback){
+        Result result;
+        result.seq = frame->seq;
+        result.stamp = frame->stamp;
+        result.odom = odom;
+        result.score = frame->score;
+        result.accepted = accepted;
+        result.truncated = frame->truncated;
+        result.relocalized = frame->relocalized;
+        result.reused = frame->reused;
+        result.iterations = frame->iterations;
+        result.guess_gap = frame->guess_gap;
+        result.preprocess_time = frame->preprocess_time;
+        result.align_time = frame->align_time;
+        result.publish_time = timer.elapsed();
+        result.latency = latency;
+        result_callback(result);
+    }
+
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    processed_scans++;
+    frames_in_flight--;
+
+    // the reference of the adaptive matching, the variance is taken after the ekf has fused it
+    if(accepted || frame->relocalized){
+        has_accepted_pose = true;
+        accepted_x = frame->result(0, 3);
+        accepted_y = frame->result(1, 3);
+        calc_rpy(frame->result, accepted_yaw);
+        min_variance_xy = min_variance_yaw = std::numeric_limits<double>::max();
+    }
+
+    // lost: the next scan is searched on the whole map (or RELOCALIZE_ROI)
+    if(accepted){
+        consecutive_failures = 0;
+    }else if(RELOCALIZE_AFTER_FAILURES > 0 && !relocalize_requested
+            && ++consecutive_failures >= RELOCALIZE_AFTER_FAILURES && relocalizer.is_built()){
+        std::cout << "\033[33m" << consecutive_failures << " matching failures in a row, relocalizing\033[0m" << std::endl;
+        consecutive_failures = 0;
+        relocalize_requested = true;
+    }
+}
+
+
+bool
+Matcher::vis_due(const ros::Publisher& pub, const ros::Time& stamp, double& last_stamp) const{
+    if(pub.getNumSubscribers() == 0) return false;
+    // a stamp before the last one (bag loop, sim time reset) starts again
+    const double t = stamp.toSec();
+    if(VIS_RATE > 0 && t >= last_stamp && t - last_stamp < 1.0 / VIS_RATE) return false;
+    last_stamp = t;
+    return true;
+}
+
+
+void
+Matcher::diagnostics_callback(const ros::WallTimerEvent& event){
+    LatencyHistogram::Snapshot snapshot;
+    if(diag_pub.getNumSubscribers() == 0){
+        // nobody listens: only the windows are started again
+        for(int i = 0; i < STAGE_NUM; i++) stage_histograms[i].snapshot(snapshot, true);
+        iteration_histogram.snapshot(snapshot, true);
+        guess_gap_histogram.snapshot(snapshot, true);
+        return;
+    }
+
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = ros::this_node::getName() + ": timing";
+    status.hardware_id = "ndt_localizer";
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+
+    uint64_t window_scans = 0;
+    for(int i = 0; i < STAGE_NUM; i++){
+        stage_histograms[i].snapshot(snapshot, true);
+        status.values.push_back(histogram_key_value(std::string(STAGE_NAMES[i]) + " [ms]", snapshot, 1e-6));
+        if(i == STAGE_LATENCY) window_scans = snapshot.num;
+    }
+    iteration_histogram.snapshot(snapshot, true);
+    status.values.push_back(histogram_key_value("ndt iterations", snapshot, 1.0));
+    guess_gap_histogram.snapshot(snapshot, true);
+    status.values.push_back(histogram_key_value("initial guess gap [ms]", snapshot, 1e-6));
+    status.values.push_back(make_key_value("map load [s]", map_load_time));
+    status.values.push_back(make_key_value("ndt target build [s]", target_build_time.load()));
+    status.values.push_back(make_key_value("relocalizer build [s]", relocalizer_build_time));
+    status.values.push_back(make_key_value("map tiles [MB]", map_memory / 1e6));
+    status.values.push_back(make_key_value("ndt target cloud [MB]", target_memory / 1e6));
+    if(map_store.is_open()){
+        MapTileStore::Stats tile_stats;
+        map_store.get_stats(tile_stats);
+        status.values.push_back(make_key_value("map tiles in memory [MB]", map_store.get_memory_bytes() / 1e6));
+        status.values.push_back(make_key_value("map tile hits", tile_stats.hits));
+        status.values.push_back(make_key_value("map tile misses", tile_stats.misses));
+        status.values.push_back(make_key_value("map tiles read (waited)", tile_stats.loads));
+        status.values.push_back(make_key_value("map tiles prefetched", tile_stats.prefetched));
+        status.values.push_back(make_key_value("map tiles evicted", tile_stats.evictions));
+    }
+    {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        status.values.push_back(make_key_value("processed scans", processed_scans));
+        status.values.push_back(make_key_value("skipped scans", skipped_scans));
+        status.values.push_back(make_key_value("duplicate scans", duplicate_scans));
+        status.values.push_back(make_key_value("adaptive skipped scans", adaptive_skipped_scans));
+        status.values.push_back(make_key_value("reused scans (stationary)", reused_scans));
+        status.values.push_back(make_key_value("truncated alignments", truncated_alignments.load()));
+        status.values.push_back(make_key_value("relocalizations", relocalizations));
+        status.values.push_back(make_key_value("last relocalization [s]", relocalize_time.load()));
+    }
+    status.message = std::to_string(window_scans) + " scans in the last " + std::to_string(DIAGNOSTICS_PERIOD) + " s";
+
+    diagnostic_msgs::DiagnosticArrayPtr array(new diagnostic_msgs::DiagnosticArray);
+    array->header.stamp = ros::Time::now();
+    array->status.push_back(status);
+    diag_pub.publish(array);
+}
+
+
+bool
+Matcher::process(const sensor_msgs::PointCloud2ConstPtr& msg){
+    if(running) return false;
+
+    Frame* frame = frames.front().get();
+    Scan scan;
+    scan.receive_time = ros::WallTime::now().toSec();
+    scan.msg = msg;
+    {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        if(!needs_alignment(scan.msg->header.stamp)){
+            adaptive_skipped_scans++;
+            return false;
+        }
+        scan.seq = ++scan_seq;
+        frame->odom = buffer_odom;
+        frame->guess = initial_guess(scan.msg->header.stamp, frame->guess_gap);
+        frames_in_flight++;
+    }
+
+    if(!preprocess_frame(frame, scan)) return false;
+    {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        last_aligned_stamp = scan.msg->header.stamp.toSec();
+    }
+    align_frame(frame);
+    publish_frame(frame);
+    return true;
 }
 
+
+bool
+Matcher::is_idle(){
+    std::lock_guard<std::mutex> lock(buffer_mutex);
+    return scan_queue.empty() && frames_in_flight == 0;
+}
@@ -13,7 +13,6 @@ int main(int argc, char* argv[])
     ros::init(argc, argv, "map_match");
     ros::NodeHandle n;
     ros::NodeHandle priv_nh("~");
-    ros::Rate loop(5);
 
     ROS_INFO("\033[1;32m---->\033[0m map_match Started.");
 
@@ -24,13 +23,16 @@ int main(int argc, char* argv[])
     priv_nh.param("MAP_FILE", map_file, std::string("$(find localizer)/example_data/d_kan_indoor.pcd"));
     matcher.map_read(map_file);
 
-    std::cout << "waiting for data ..." << std::endl;
-    while(ros::ok()){
+    // preprocess / align / publish run on their own threads,
+    // callbacks run on the spinner thread and are never blocked by an alignment
+    matcher.start();
+    ros::AsyncSpinner spinner(1);
+    spinner.start();
 
-        if(matcher.is_start) matcher.process();
-        loop.sleep();
-        ros::spinOnce();
-    }
+    std::cout << "waiting for data ..." << std::endl;
+    ros::waitForShutdown();
+    spinner.stop();
+    matcher.stop();
 
     return 0;
 }
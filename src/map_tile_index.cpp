@@ -0,0 +1,291 @@
+/* map_tile_index.cpp
+ *
+ * 2D tile index of the map cloud for the local map extraction
+ *
+*/
+
+#include<cmath>
+#include<limits>
+#include<algorithm>
+
+#include"map_tile_index.hpp"
+
+namespace{
+
+const float STEP_MAX = 65535.0f;
+
+uint16_t
+quantize(float v, float scale)
+{
+    if(scale <= 0) return 0;
+    const float q = std::round(v / scale);
+    return static_cast<uint16_t>(std::min(std::max(q, 0.0f), STEP_MAX));
+}
+
+}
+
+
+MapTileIndex::MapTileIndex(double tile_size_, bool keep_intensity_) :
+    tile_size(tile_size_),
+    keep_intensity(keep_intensity_),
+    xy_scale(tile_size_ / STEP_MAX),
+    intensity_scale(0),
+    has_window(false),
+    win_min_ix(0), win_max_ix(0), win_min_iy(0), win_max_iy(0)
+{
+}
+
+
+int
+MapTileIndex::to_index(double v) const
+{
+    return static_cast<int>(std::floor(v / tile_size));
+}
+
+uint64_t
+MapTileIndex::to_key(int ix, int iy)
+{
+    return (static_cast<uint64_t>(static_cast<uint32_t>(ix)) << 32) | static_cast<uint32_t>(iy);
+}
+
+void
+MapTileIndex::from_key(uint64_t key, int &ix, int &iy)
+{
+    ix = static_cast<int>(static_cast<uint32_t>(key >> 32));
+    iy = static_cast<int>(static_cast<uint32_t>(key & 0xffffffff));
+}
+
+
+void
+MapTileIndex::build(const Cloud& cloud)
+{
+    tiles.clear();
+    reset_window();
+
+    /*------ count the points of each tile ------*/
+    std::vector<uint64_t> keys(cloud.points.size());
+    std::unordered_map<uint64_t, size_t> counts;
+    for(size_t i = 0; i < cloud.points.size(); i++){
+        keys[i] = to_key(to_index(cloud.points[i].x), to_index(cloud.points[i].y));
+        counts[keys[i]]++;
+    }
+
+    /*------ one contiguous range per tile ------*/
+    size_t offset = 0;
+    tiles.reserve(counts.size());
+    for(const auto& count : counts){
+        int ix, iy;
+        from_key(count.first, ix, iy);
+        Tile tile;
+        tile.begin = offset;
+        tile.end = offset + count.second;
+        tile.origin[0] = ix * tile_size;
+        tile.origin[1] = iy * tile_size;
+        tile.origin[2] = std::numeric_limits<float>::max();
+        tile.z_scale = -std::numeric_limits<float>::max();  // highest z until the scale is set
+        tiles[count.first] = tile;
+        offset = tile.end;
+    }
+
+    /*------ height range of each tile, intensity range ------*/
+    float intensity_max = 0;
+    for(size_t i = 0; i < cloud.points.size(); i++){
+        Tile& tile = tiles[keys[i]];
+        tile.origin[2] = std::min(tile.origin[2], cloud.points[i].z);
+        tile.z_scale = std::max(tile.z_scale, cloud.points[i].z);
+        intensity_max = std::max(intensity_max, cloud.points[i].intensity);
+    }
+    for(auto& tile : tiles) tile.second.z_scale = (tile.second.z_scale - tile.second.origin[2]) / STEP_MAX;
+    intensity_scale = intensity_max / STEP_MAX;
+
+    /*------ quantized points ------*/
+    std::unordered_map<uint64_t, size_t> cursor;
+    cursor.reserve(tiles.size());
+    for(const auto& tile : tiles) cursor[tile.first] = tile.second.begin;
+
+    coords.assign(3 * cloud.points.size(), 0);
+    coords.shrink_to_fit();
+    intensities.assign(keep_intensity ? cloud.points.size() : 0, 0);
+    intensities.shrink_to_fit();
+    for(size_t i = 0; i < cloud.points.size(); i++){
+        const Tile& tile = tiles[keys[i]];
+        const pcl::PointXYZI& p = cloud.points[i];
+        const size_t j = cursor[keys[i]]++;
+        coords[3 * j] = quantize(p.x - tile.origin[0], xy_scale);
+        coords[3 * j + 1] = quantize(p.y - tile.origin[1], xy_scale);
+        coords[3 * j + 2] = quantize(p.z - tile.origin[2], tile.z_scale);
+        if(keep_intensity) intensities[j] = quantize(p.intensity, intensity_scale);
+    }
+}
+
+
+size_t
+MapTileIndex::get_memory_bytes() const
+{
+    // a node of the hash map: key, value and the next pointer, one bucket pointer
+    const size_t tile_bytes = sizeof(uint64_t) + sizeof(Tile) + 2 * sizeof(void*);
+    return coords.capacity() * sizeof(uint16_t) + intensities.capacity() * sizeof(uint16_t) + tiles.size() * tile_bytes;
+}
+
+
+void
+MapTileIndex::get_tiles(std::vector<TileView>& views) const
+{
+    views.clear();
+    views.reserve(tiles.size());
+    for(const auto& tile : tiles){
+        TileView view;
+        from_key(tile.first, view.ix, view.iy);
+        std::copy(tile.second.origin, tile.second.origin + 3, view.origin);
+        view.z_scale = tile.second.z_scale;
+        view.num = tile.second.end - tile.second.begin;
+        view.coords = coords.data() + 3 * tile.second.begin;
+        view.intensities = keep_intensity ? intensities.data() + tile.second.begin : NULL;
+        views.push_back(view);
+    }
+}
+
+
+void
+MapTileIndex::decode(const Tile& tile, size_t i, pcl::PointXYZI& p) const
+{
+    p.x = tile.origin[0] + coords[3 * i] * xy_scale;
+    p.y = tile.origin[1] + coords[3 * i + 1] * xy_scale;
+    p.z = tile.origin[2] + coords[3 * i + 2] * tile.z_scale;
+    p.intensity = keep_intensity ? intensities[i] * intensity_scale : 0.0f;
+}
+
+
+void
+MapTileIndex::append(const Tile& tile, Cloud& output) const
+{
+    size_t write = output.points.size();
+    output.points.resize(write + tile.end - tile.begin);
+    for(size_t i = tile.begin; i < tile.end; i++) decode(tile, i, output.points[write++]);
+}
+
+
+void
+MapTileIndex::query(double x_min, double x_max, double y_min, double y_max, Cloud& output) const
+{
+    output.points.clear();
+
+    const int min_ix = to_index(x_min), max_ix = to_index(x_max);
+    const int min_iy = to_index(y_min), max_iy = to_index(y_max);
+
+    for(int ix = min_ix; ix <= max_ix; ix++){
+        for(int iy = min_iy; iy <= max_iy; iy++){
+            auto tile = tiles.find(to_key(ix, iy));
+            if(tile == tiles.end()) continue;
+
+            const bool inside = (x_min <= ix * tile_size && (ix + 1) * tile_size <= x_max
+                              && y_min <= iy * tile_size && (iy + 1) * tile_size <= y_max);
+            if(inside){
+                append(tile->second, output);
+                continue;
+            }
+            pcl::PointXYZI p;
+            for(size_t i = tile->second.begin; i < tile->second.end; i++){
+                decode(tile->second, i, p);
+                if(x_min <= p.x && p.x <= x_max && y_min <= p.y && p.y <= y_max){
+                    output.points.push_back(p);
+                }
+            }
+        }
+    }
+    output.width = output.points.size();
+    output.height = 1;
+}
+
+
+size_t
+MapTileIndex::count(double x_min, double x_max, double y_min, double y_max) const
+{
+    const int min_ix = to_index(x_min), max_ix = to_index(x_max);
+    const int min_iy = to_index(y_min), max_iy = to_index(y_max);
+
+    // a huge area has fewer tiles than cells
+    size_t num = 0;
+    if(static_cast<double>(max_ix - min_ix + 1) * (max_iy - min_iy + 1) > tiles.size()){
+        for(const auto& tile : tiles){
+            int ix, iy;
+            from_key(tile.first, ix, iy);
+            if(min_ix <= ix && ix <= max_ix && min_iy <= iy && iy <= max_iy) num += tile.second.end - tile.second.begin;
+        }
+        return num;
+    }
+    for(int ix = min_ix; ix <= max_ix; ix++){
+        for(int iy = min_iy; iy <= max_iy; iy++){
+            auto tile = tiles.find(to_key(ix, iy));
+            if(tile != tiles.end()) num += tile->second.end - tile->second.begin;
+        }
+    }
+    return num;
+}
+
+
+void
+MapTileIndex::reset_window()
+{
+    has_window = false;
+    window_segments.clear();
+}
+
+
+bool
+MapTileIndex::update_window(double x_now, double y_now, double range, Cloud& output)
+{
+    const int min_ix = to_index(x_now - range), max_ix = to_index(x_now + range);
+    const int min_iy = to_index(y_now - range), max_iy = to_index(y_now + range);
+
+    if(has_window && min_ix == win_min_ix && max_ix == win_max_ix && min_iy == win_min_iy && max_iy == win_max_iy){
+        return false;
+    }
+    if(!has_window) output.points.clear();
+
+    /*------ drop the tiles which left the window ------*/
+    std::vector<Segment> segments;
+    segments.reserve(window_segments.size());
+    size_t write = 0;
+    for(const auto& segment : window_segments){
+        int ix, iy;
+        from_key(segment.key, ix, iy);
+        if(ix < min_ix || max_ix < ix || iy < min_iy || max_iy < iy) continue;
+
+        if(write != segment.begin){
+            std::copy(output.points.begin() + segment.begin, output.points.begin() + segment.begin + segment.size, output.points.begin() + write);
+        }
+        Segment kept = segment;
+        kept.begin = write;
+        segments.push_back(kept);
+        write += segment.size;
+    }
+    output.points.resize(write);
+
+    /*------ append the tiles which entered the window ------*/
+    for(int ix = min_ix; ix <= max_ix; ix++){
+        for(int iy = min_iy; iy <= max_iy; iy++){
+            if(has_window && win_min_ix <= ix && ix <= win_max_ix && win_min_iy <= iy && iy <= win_max_iy) continue;
+
+            const uint64_t key = to_key(ix, iy);
+            auto tile = tiles.find(key);
+            if(tile == tiles.end()) continue;
+
+            Segment added;
+            added.key = key;
+            added.begin = output.points.size();
+            added.size = tile->second.end - tile->second.begin;
+            append(tile->second, output);
+            segments.push_back(added);
+        }
+    }
+
+    window_segments.swap(segments);
+    win_min_ix = min_ix; win_max_ix = max_ix;
+    win_min_iy = min_iy; win_max_iy = max_iy;
+    has_window = true;
+
+    output.width = output.points.size();
+    output.height = 1;
+    return true;
+}
@@ -0,0 +1,537 @@
+/* map_tile_store.cpp
+ *
+ * out-of-core map: tile file, LRU tile cache and the prefetch thread
+ *
+*/
+
+#include<iostream>
+#include<cstdio>
+#include<cstring>
+#include<cmath>
+#include<algorithm>
+
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/stat.h>
+
+#include"map_tile_store.hpp"
+
+namespace{
+
+const char TILE_MAGIC[8] = {'N', 'D', 'T', 'T', 'I', 'L', 'E', '\0'};
+const uint32_t TILE_VERSION = 2;
+
+uint64_t
+to_key(int ix, int iy)
+{
+    return (static_cast<uint64_t>(static_cast<uint32_t>(ix)) << 32) | static_cast<uint32_t>(iy);
+}
+
+void
+from_key(uint64_t key, int& ix, int& iy)
+{
+    ix = static_cast<int32_t>(static_cast<uint32_t>(key >> 32));
+    iy = static_cast<int32_t>(static_cast<uint32_t>(key));
+}
+
+// the whole range, pread() may return less than asked
+bool
+read_all(int fd, void* buffer, size_t size, uint64_t offset)
+{
+    char* ptr = static_cast<char*>(buffer);
+    while(size > 0){
+        const ssize_t n = pread(fd, ptr, size, offset);
+        if(n <= 0) return false;
+        ptr += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+}
+
+
+MapTileStore::MapTileStore() :
+    source_voxel_size(0),
+    source_tile_size(10.0),
+    source_keep_intensity(true),
+    fd(-1),
+    tile_size(10.0),
+    point_num(0),
+    cache_size(0),
+    cached_bytes(0),
+    has_window(false), window_complete(false),
+    win_min_ix(0), win_max_ix(0), win_min_iy(0), win_max_iy(0),
+    has_request(false),
+    running(false),
+    hits(0), misses(0), loads(0), prefetched(0), evictions(0)
+{
+    std::fill(source_offset, source_offset + 6, 0.0);
+    std::memset(&header, 0, sizeof(header));
+    std::memset(&request, 0, sizeof(request));
+}
+
+
+MapTileStore::~MapTileStore()
+{
+    close();
+}
+
+
+void
+MapTileStore::set_source(const std::string& source_file_, double voxel_size, const double offset[6],
+        double tile_size_, bool keep_intensity)
+{
+    source_file = source_file_;
+    source_voxel_size = voxel_size;
+    std::copy(offset, offset + 6, source_offset);
+    source_tile_size = tile_size_;
+    source_keep_intensity = keep_intensity;
+}
+
+
+bool
+MapTileStore::make_header(Header& header) const
+{
+    struct stat st;
+    if(stat(source_file.c_str(), &st) != 0){
+        return false;
+    }
+
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, TILE_MAGIC, sizeof(TILE_MAGIC));
+    header.version = TILE_VERSION;
+    header.keep_intensity = source_keep_intensity ? 1 : 0;
+    header.source_size = st.st_size;
+    header.source_mtime_sec = st.st_mtim.tv_sec;
+    header.source_mtime_nsec = st.st_mtim.tv_nsec;
+    header.voxel_size = source_voxel_size;
+    std::copy(source_offset, source_offset + 6, header.offset);
+    header.tile_size = source_tile_size;
+    return true;
+}
+
+
+bool
+MapTileStore::matches_source(const Header& header, const Header& expected) const
+{
+    return std::memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0
+        && header.version == expected.version
+        && header.keep_intensity == expected.keep_intensity
+        && header.source_size == expected.source_size
+        && header.source_mtime_sec == expected.source_mtime_sec
+        && header.source_mtime_nsec == expected.source_mtime_nsec
+        && header.voxel_size == expected.voxel_size
+        && std::equal(header.offset, header.offset + 6, expected.offset)
+        && header.tile_size == expected.tile_size;
+}
+
+
+bool
+MapTileStore::save(const std::string& file, const MapTileIndex& index) const
+{
+    std::vector<MapTileIndex::TileView> views;
+    index.get_tiles(views);
+
+    Header header;
+    if(!make_header(header)){
+        std::cout << "\033[33mmap tiles: cannot stat source " << source_file << "\033[0m" << std::endl;
+        return false;
+    }
+    if(index.get_tile_size() != source_tile_size || index.has_intensity() != source_keep_intensity){
+        std::cout << "\033[33mmap tiles: the tiles are not made with the parameters of the source\033[0m" << std::endl;
+        return false;
+    }
+    header.xy_scale = index.get_xy_scale();
+    header.intensity_scale = index.get_intensity_scale();
+    header.tile_num = views.size();
+
+    // the points follow the table, tile by tile
+    const size_t point_step = (header.keep_intensity ? 4 : 3) * sizeof(uint16_t);
+    std::vector<TileEntry> entries(views.size());
+    uint64_t offset = sizeof(Header) + views.size() * sizeof(TileEntry);
+    for(size_t i = 0; i < views.size(); i++){
+        std::memset(&entries[i], 0, sizeof(TileEntry));
+        entries[i].ix = views[i].ix;
+        entries[i].iy = views[i].iy;
+        std::copy(views[i].origin, views[i].origin + 3, entries[i].origin);
+        entries[i].z_scale = views[i].z_scale;
+        entries[i].offset = offset;
+        entries[i].num = views[i].num;
+        offset += views[i].num * point_step;
+    }
+
+    // written to a temporary file first so that a killed node never leaves a broken tile file
+    const std::string tmp_file = file + ".tmp";
+    FILE* fp = std::fopen(tmp_file.c_str(), "wb");
+    if(fp == NULL){
+        std::cout << "\033[33mmap tiles: cannot write " << tmp_file << "\033[0m" << std::endl;
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(Header), 1, fp) == 1;
+    ok = ok && std::fwrite(entries.data(), sizeof(TileEntry), entries.size(), fp) == entries.size();
+    for(size_t i = 0; ok && i < views.size(); i++){
+        ok = std::fwrite(views[i].coords, sizeof(uint16_t), 3 * views[i].num, fp) == 3 * views[i].num;
+        if(ok && views[i].intensities){
+            ok = std::fwrite(views[i].intensities, sizeof(uint16_t), views[i].num, fp) == views[i].num;
+        }
+    }
+    ok = (std::fclose(fp) == 0) && ok;
+
+    if(!ok || std::rename(tmp_file.c_str(), file.c_str()) != 0){
+        std::remove(tmp_file.c_str());
+        std::cout << "\033[33mmap tiles: failed to write " << file << "\033[0m" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+bool
+MapTileStore::open(const std::string& file, size_t cache_size_)
+{
+    close();
+
+    Header expected;
+    if(!make_header(expected)){
+        std::cout << "map tiles: cannot stat source " << source_file << std::endl;
+        return false;
+    }
+
+    fd = ::open(file.c_str(), O_RDONLY);
+    if(fd < 0){
+        std::cout << "map tiles: " << file << " does not exist" << std::endl;
+        return false;
+    }
+
+    // a file of another source or other parameters is stale, one cut short is broken
+    struct stat st;
+    std::vector<TileEntry> entries;
+    bool stale = false;
+    bool valid = fstat(fd, &st) == 0 && read_all(fd, &header, sizeof(Header), 0);
+    if(valid && !matches_source(header, expected)){
+        stale = true;
+        valid = false;
+    }
+    if(valid){
+        const uint64_t point_step = (header.keep_intensity ? 4 : 3) * sizeof(uint16_t);
+        uint64_t end = sizeof(Header) + header.tile_num * sizeof(TileEntry);
+        valid = header.tile_size > 0 && end <= static_cast<uint64_t>(st.st_size);
+        if(valid){
+            entries.resize(header.tile_num);
+            valid = read_all(fd, entries.data(), entries.size() * sizeof(TileEntry), sizeof(Header));
+        }
+        for(size_t i = 0; valid && i < entries.size(); i++){
+            valid = entries[i].offset == end;
+            end += entries[i].num * point_step;
+        }
+        valid = valid && end == static_cast<uint64_t>(st.st_size);
+    }
+    if(!valid){
+        std::cout << "\033[33mmap tiles: " << file << (stale ? " is stale" : " is broken") << "\033[0m" << std::endl;
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    tile_size = header.tile_size;
+    point_num = 0;
+    table.reserve(entries.size());
+    for(const auto& entry : entries){
+        table[to_key(entry.ix, entry.iy)] = entry;
+        point_num += entry.num;
+    }
+    cache_size = std::max<size_t>(cache_size_, 1);
+
+    running = true;
+    prefetch_thread = std::thread(&MapTileStore::prefetch_loop, this);
+    return true;
+}
+
+
+void
+MapTileStore::close()
+{
+    running = false;
+    request_cv.notify_all();
+    if(prefetch_thread.joinable()) prefetch_thread.join();
+
+    if(fd >= 0) ::close(fd);
+    fd = -1;
+    table.clear();
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        cache.clear();
+        lru.clear();
+        cached_bytes = 0;
+    }
+    has_window = window_complete = false;
+    window_segments.clear();
+    has_request = false;
+}
+
+
+int
+MapTileStore::to_index(double v) const
+{
+    return static_cast<int>(std::floor(v / tile_size));
+}
+
+
+std::shared_ptr<const MapTileStore::TileData>
+MapTileStore::load(const TileEntry& entry) const
+{
+    std::shared_ptr<TileData> data(new TileData);
+    data->coords.resize(3 * entry.num);
+    bool ok = read_all(fd, data->coords.data(), data->coords.size() * sizeof(uint16_t), entry.offset);
+    if(ok && header.keep_intensity){
+        data->intensities.resize(entry.num);
+        ok = read_all(fd, data->intensities.data(), data->intensities.size() * sizeof(uint16_t),
+                entry.offset + data->coords.size() * sizeof(uint16_t));
+    }
+    if(!ok){
+        std::cout << "\033[31mmap tiles: cannot read tile " << entry.ix << ", " << entry.iy << "\033[0m" << std::endl;
+        return std::shared_ptr<const TileData>();
+    }
+    return data;
+}
+
+
+std::shared_ptr<const MapTileStore::TileData>
+MapTileStore::find(uint64_t key)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = cache.find(key);
+    if(it == cache.end()) return std::shared_ptr<const TileData>();
+    lru.splice(lru.begin(), lru, it->second.lru);
+    return it->second.data;
+}
+
+
+void
+MapTileStore::insert(uint64_t key, const std::shared_ptr<const TileData>& data)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if(cache.count(key)) return;
+
+    lru.push_front(key);
+    CacheEntry& entry = cache[key];
+    entry.data = data;
+    entry.lru = lru.begin();
+    cached_bytes += (data->coords.capacity() + data->intensities.capacity()) * sizeof(uint16_t);
+
+    // a tile still held by a window decoding it stays alive until then
+    while(cache.size() > cache_size){
+        auto oldest = cache.find(lru.back());
+        cached_bytes -= (oldest->second.data->coords.capacity() + oldest->second.data->intensities.capacity()) * sizeof(uint16_t);
+        cache.erase(oldest);
+        lru.pop_back();
+        evictions++;
+    }
+}
+
+
+void
+MapTileStore::collect(double x, double y, double range, std::vector<uint64_t>& keys, std::unordered_map<uint64_t, bool>& seen) const
+{
+    const int min_ix = to_index(x - range), max_ix = to_index(x + range);
+    const int min_iy = to_index(y - range), max_iy = to_index(y + range);
+    for(int ix = min_ix; ix <= max_ix; ix++){
+        for(int iy = min_iy; iy <= max_iy; iy++){
+            const uint64_t key = to_key(ix, iy);
+            if(!table.count(key) || seen[key]) continue;
+            seen[key] = true;
+            keys.push_back(key);
+        }
+    }
+}
+
+
+void
+MapTileStore::decode(const TileEntry& entry, const TileData& data, Cloud& output) const
+{
+    size_t write = output.points.size();
+    output.points.resize(write + entry.num);
+    for(size_t i = 0; i < entry.num; i++){
+        pcl::PointXYZI& p = output.points[write++];
+        p.x = entry.origin[0] + data.coords[3 * i] * header.xy_scale;
+        p.y = entry.origin[1] + data.coords[3 * i + 1] * header.xy_scale;
+        p.z = entry.origin[2] + data.coords[3 * i + 2] * entry.z_scale;
+        p.intensity = data.intensities.empty() ? 0.0f : data.intensities[i] * header.intensity_scale;
+    }
+}
+
+
+void
+MapTileStore::prefetch(double x, double y, double dx, double dy, double range, double distance)
+{
+    if(!is_open()) return;
+    {
+        std::lock_guard<std::mutex> lock(request_mutex);
+        request.x = x;
+        request.y = y;
+        request.dx = dx;
+        request.dy = dy;
+        request.range = range;
+        request.distance = distance;
+        has_request = true;
+    }
+    request_cv.notify_one();
+}
+
+
+void
+MapTileStore::prefetch_loop()
+{
+    std::unique_lock<std::mutex> lock(request_mutex);
+    while(running){
+        request_cv.wait(lock, [this]{ return !running || has_request; });
+        if(!running) break;
+        const Request r = request;
+        has_request = false;
+        lock.unlock();
+        size_t max_keys;
+        {
+            // update_window() grows it
+            std::lock_guard<std::mutex> cache_lock(cache_mutex);
+            max_keys = std::max<size_t>(cache_size / 2, 1);
+        }
+
+        // around the robot first, then every tile ahead, nearest first
+        std::vector<uint64_t> keys;
+        std::unordered_map<uint64_t, bool> seen;
+        collect(r.x, r.y, r.range, keys, seen);
+        if(r.distance > 0 && (r.dx != 0 || r.dy != 0)){
+            for(double d = 0.5 * tile_size; d <= r.distance; d += 0.5 * tile_size){
+                collect(r.x + d * r.dx, r.y + d * r.dy, r.range, keys, seen);
+            }
+        }
+        // never more than half the cache, the window in use is not pushed out
+        if(keys.size() > max_keys) keys.resize(max_keys);
+
+        for(uint64_t key : keys){
+            if(!running) break;
+            if(find(key)) continue;
+            std::shared_ptr<const TileData> data = load(table.at(key));
+            if(!data) continue;
+            insert(key, data);
+            prefetched++;
+        }
+        lock.lock();
+    }
+}
+
+
+bool
+MapTileStore::update_window(double x_now, double y_now, double range, Cloud& output, bool wait)
+{
+    if(!is_open()) return false;
+
+    const int min_ix = to_index(x_now - range), max_ix = to_index(x_now + range);
+    const int min_iy = to_index(y_now - range), max_iy = to_index(y_now + range);
+    const bool same = has_window && min_ix == win_min_ix && max_ix == win_max_ix && min_iy == win_min_iy && max_iy == win_max_iy;
+    if(same && window_complete) return false;
+    if(!has_window){
+        output.points.clear();
+        window_segments.clear();
+    }
+
+    /*------ drop the tiles which left the window ------*/
+    std::vector<Segment> segments;
+    segments.reserve(window_segments.size());
+    std::unordered_map<uint64_t, bool> decoded;
+    size_t write = 0;
+    for(const auto& segment : window_segments){
+        int ix, iy;
+        from_key(segment.key, ix, iy);
+        if(ix < min_ix || max_ix < ix || iy < min_iy || max_iy < iy) continue;
+
+        if(write != segment.begin){
+            std::copy(output.points.begin() + segment.begin, output.points.begin() + segment.begin + segment.size, output.points.begin() + write);
+        }
+        Segment kept = segment;
+        kept.begin = write;
+        segments.push_back(kept);
+        decoded[segment.key] = true;
+        write += segment.size;
+    }
+    bool changed = segments.size() != window_segments.size();
+    output.points.resize(write);
+
+    /*------ decode the tiles which entered the window (or were missing) ------*/
+    bool complete = true;
+    size_t tile_num = 0;
+    for(int ix = min_ix; ix <= max_ix; ix++){
+        for(int iy = min_iy; iy <= max_iy; iy++){
+            const uint64_t key = to_key(ix, iy);
+            auto entry = table.find(key);
+            if(entry == table.end()) continue;
+            tile_num++;
+            if(decoded.count(key)) continue;
+
+            std::shared_ptr<const TileData> data = find(key);
+            if(data){
+                hits++;
+            }else{
+                misses++;
+                if(!wait){
+                    complete = false;
+                    continue;
+                }
+                data = load(entry->second);
+                if(!data) continue;
+                insert(key, data);
+                loads++;
+            }
+            Segment added;
+            added.key = key;
+            added.begin = output.points.size();
+            added.size = entry->second.num;
+            decode(entry->second, *data, output);
+            segments.push_back(added);
+            changed = true;
+        }
+    }
+    window_segments.swap(segments);
+    output.width = output.points.size();
+    output.height = 1;
+
+    // the window and what is prefetched around it have to fit
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if(cache_size < 2 * tile_num){
+            cache_size = 2 * tile_num;
+            std::cout << "map tiles: cache grown to " << cache_size << " tiles (twice the window)" << std::endl;
+        }
+    }
+    if(!complete) prefetch(x_now, y_now, 0, 0, range, 0);
+
+    win_min_ix = min_ix; win_max_ix = max_ix;
+    win_min_iy = min_iy; win_max_iy = max_iy;
+    has_window = true;
+    window_complete = complete;
+
+    return changed;
+}
+
+
+size_t
+MapTileStore::get_memory_bytes() const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    // a node of the hash map: key, value and the next pointer, one bucket pointer
+    const size_t table_bytes = table.size() * (sizeof(uint64_t) + sizeof(TileEntry) + 2 * sizeof(void*));
+    return table_bytes + cached_bytes;
+}
+
+
+void
+MapTileStore::get_stats(Stats& stats) const
+{
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.loads = loads;
+    stats.prefetched = prefetched;
+    stats.evictions = evictions;
+}
@@ -0,0 +1,467 @@
+/* microbench.cpp
+ *
+ * microbenchmarks of the hot kernels on synthetic maps and scans (google-benchmark)
+ *
+ *   ~$ rosrun ndt_localizer ndt_microbench
+ *   ~$ rosrun ndt_localizer ndt_microbench --benchmark_filter=Ndt --benchmark_out=ndt.json --benchmark_out_format=json
+ *
+ * All inputs are generated with fixed seeds (synthetic_data.hpp), so the numbers of
+ * two builds or two machines are comparable. The maps, targets and scans are built
+ * once per argument set outside of the timed loops.
+*/
+
+#include<map>
+#include<vector>
+#include<tuple>
+#include<memory>
+#include<cmath>
+#include<limits>
+#include<algorithm>
+
+#include<benchmark/benchmark.h>
+#include<omp.h>
+
+#include<pcl/filters/voxel_grid.h>
+#include<pcl/filters/approximate_voxel_grid.h>
+#include<pcl/registration/ndt.h>
+#ifdef USE_NDT_OMP
+#include<pclomp/ndt_omp.h>
+#endif
+
+#include"map_tile_index.hpp"
+#include"scan_preprocess.hpp"
+#include"relocalizer.hpp"
+#include"ndt_localizer/EKF.h"
+#include"synthetic_data.hpp"
+
+using synthetic::Cloud;
+using synthetic::MapType;
+
+namespace{
+
+const uint32_t SEED = 1;
+const double MAP_DENSITY = 20.0;    // [points/m^2]
+const double LIMIT_RANGE = 20.0;    // map_match default
+const double VOXEL_SIZE = 0.3;
+const double RESOLUTION = 1.0;
+
+// the robot is not at the map origin, so that crops and windows cut tiles
+const double POSE_X = 3.3, POSE_Y = -1.7, POSE_YAW = 0.4;
+
+const Cloud&
+get_map(MapType type, int size)
+{
+    static std::map<std::pair<int, int>, std::unique_ptr<Cloud> > maps;
+    std::unique_ptr<Cloud>& map = maps[std::make_pair(static_cast<int>(type), size)];
+    if(!map){
+        map.reset(new Cloud);
+        synthetic::make_map(type, size, MAP_DENSITY, SEED, *map);
+    }
+    return *map;
+}
+
+const sensor_msgs::PointCloud2&
+get_scan_msg(MapType type, int rings)
+{
+    static std::map<std::pair<int, int>, sensor_msgs::PointCloud2> msgs;
+    sensor_msgs::PointCloud2& msg = msgs[std::make_pair(static_cast<int>(type), rings)];
+    if(msg.data.empty()){
+        synthetic::make_velodyne_scan(type, rings, 1800, POSE_X, POSE_Y, POSE_YAW, SEED, msg);
+    }
+    return msg;
+}
+
+// voxelized local map (the NDT target) and voxelized scan taken from it
+struct NdtInput{
+    Cloud::Ptr target;
+    Cloud::Ptr source;
+    Eigen::Matrix4f guess;
+};
+
+const NdtInput&
+get_ndt_input(MapType type)
+{
+    static std::map<int, NdtInput> inputs;
+    NdtInput& input = inputs[static_cast<int>(type)];
+    if(!input.target){
+        const Cloud& map = get_map(type, 100);
+        MapTileIndex index;
+        index.build(map);
+        Cloud local;
+        index.query(POSE_X - LIMIT_RANGE, POSE_X + LIMIT_RANGE, POSE_Y - LIMIT_RANGE, POSE_Y + LIMIT_RANGE, local);
+
+        Cloud::Ptr local_ptr(new Cloud(local));
+        input.target.reset(new Cloud);
+        pcl::VoxelGrid<pcl::PointXYZI> voxel;
+        voxel.setLeafSize(VOXEL_SIZE, VOXEL_SIZE, VOXEL_SIZE);
+        voxel.setInputCloud(local_ptr);
+        voxel.filter(*input.target);
+
+        Cloud::Ptr scan(new Cloud);
+        synthetic::make_scan_from_map(map, POSE_X, POSE_Y, POSE_YAW, LIMIT_RANGE, 0.02, SEED, *scan);
+        input.source.reset(new Cloud);
+        voxel.setInputCloud(scan);
+        voxel.filter(*input.source);
+
+        // initial guess off by 0.3 m and 2 deg as after an odometry prediction
+        const double yaw = POSE_YAW + 2.0 * M_PI / 180.0;
+        input.guess = Eigen::Matrix4f::Identity();
+        input.guess(0, 0) = std::cos(yaw); input.guess(0, 1) = -std::sin(yaw);
+        input.guess(1, 0) = std::sin(yaw); input.guess(1, 1) = std::cos(yaw);
+        input.guess(0, 3) = POSE_X + 0.3;
+        input.guess(1, 3) = POSE_Y - 0.2;
+    }
+    return input;
+}
+
+MapType
+map_type_arg(const benchmark::State& state, int index)
+{
+    return state.range(index) == 0 ? synthetic::MAP_INDOOR : synthetic::MAP_OUTDOOR;
+}
+
+void
+map_args(benchmark::internal::Benchmark* b)
+{
+    for(int type = 0; type < 2; type++){
+        for(int size : {50, 100, 200}) b->Args({type, size});
+    }
+}
+
+void
+thread_args(benchmark::internal::Benchmark* b)
+{
+    for(int type = 0; type < 2; type++){
+        for(int threads = 1; threads <= omp_get_max_threads(); threads *= 2) b->Args({type, threads});
+    }
+}
+
+}
+
+
+/*------ scan preprocess (read + crop + voxel) ------*/
+static void
+BM_ScanPreprocess(benchmark::State& state)
+{
+    const sensor_msgs::PointCloud2& msg = get_scan_msg(map_type_arg(state, 0), state.range(1));
+    ScanPreprocessor preprocessor;
+    preprocessor.set_range(LIMIT_RANGE);
+    preprocessor.set_voxel_size(VOXEL_SIZE);
+    preprocessor.set_num_threads(state.range(2));
+    Cloud output;
+    for(auto _ : state){
+        preprocessor.convert(msg, output);
+        benchmark::DoNotOptimize(output.points.data());
+    }
+    state.SetItemsProcessed(state.iterations() * msg.width * msg.height);
+    state.counters["output_points"] = output.points.size();
+}
+BENCHMARK(BM_ScanPreprocess)
+    ->ArgNames({"outdoor", "rings", "threads"})
+    ->Apply([](benchmark::internal::Benchmark* b){
+        for(int type = 0; type < 2; type++){
+            for(int rings : {16, 32, 64}){
+                for(int threads = 1; threads <= omp_get_max_threads(); threads *= 2) b->Args({type, rings, threads});
+            }
+        }
+    })
+    ->Unit(benchmark::kMicrosecond);
+
+
+/*------ voxel grid filters of pcl ------*/
+static void
+BM_VoxelGrid(benchmark::State& state)
+{
+    Cloud::Ptr map(new Cloud(get_map(map_type_arg(state, 0), state.range(1))));
+    pcl::VoxelGrid<pcl::PointXYZI> voxel;
+    voxel.setLeafSize(VOXEL_SIZE, VOXEL_SIZE, VOXEL_SIZE);
+    voxel.setInputCloud(map);
+    Cloud output;
+    for(auto _ : state){
+        voxel.filter(output);
+        benchmark::DoNotOptimize(output.points.data());
+    }
+    state.SetItemsProcessed(state.iterations() * map->points.size());
+    state.counters["output_points"] = output.points.size();
+}
+BENCHMARK(BM_VoxelGrid)->ArgNames({"outdoor", "size"})->Apply(map_args)->Unit(benchmark::kMillisecond);
+
+static void
+BM_ApproximateVoxelGrid(benchmark::State& state)
+{
+    Cloud::Ptr map(new Cloud(get_map(map_type_arg(state, 0), state.range(1))));
+    pcl::ApproximateVoxelGrid<pcl::PointXYZI> voxel;
+    voxel.setLeafSize(VOXEL_SIZE, VOXEL_SIZE, VOXEL_SIZE);
+    voxel.setInputCloud(map);
+    Cloud output;
+    for(auto _ : state){
+        voxel.filter(output);
+        benchmark::DoNotOptimize(output.points.data());
+    }
+    state.SetItemsProcessed(state.iterations() * map->points.size());
+    state.counters["output_points"] = output.points.size();
+}
+BENCHMARK(BM_ApproximateVoxelGrid)->ArgNames({"outdoor", "size"})->Apply(map_args)->Unit(benchmark::kMillisecond);
+
+
+/*------ local map ------*/
+// the former Matcher::local_pc: linear scan over the whole map
+static void
+BM_LocalMapLinearCrop(benchmark::State& state)
+{
+    const Cloud& map = get_map(map_type_arg(state, 0), state.range(1));
+    Cloud output;
+    for(auto _ : state){
+        output.points.clear();
+        for(const auto& p : map.points){
+            if(POSE_X - LIMIT_RANGE <= p.x && p.x <= POSE_X + LIMIT_RANGE && POSE_Y - LIMIT_RANGE <= p.y && p.y <= POSE_Y + LIMIT_RANGE){
+                output.points.push_back(p);
+            }
+        }
+        benchmark::DoNotOptimize(output.points.data());
+    }
+    state.SetItemsProcessed(state.iterations() * map.points.size());
+    state.counters["output_points"] = output.points.size();
+}
+BENCHMARK(BM_LocalMapLinearCrop)->ArgNames({"outdoor", "size"})->Apply(map_args)->Unit(benchmark::kMicrosecond);
+
+static void
+BM_MapTileIndexQuery(benchmark::State& state)
+{
+    const Cloud& map = get_map(map_type_arg(state, 0), state.range(1));
+    MapTileIndex index;
+    index.build(map);
+    Cloud output;
+    for(auto _ : state){
+        index.query(POSE_X - LIMIT_RANGE, POSE_X + LIMIT_RANGE, POSE_Y - LIMIT_RANGE, POSE_Y + LIMIT_RANGE, output);
+        benchmark::DoNotOptimize(output.points.data());
+    }
+    state.SetItemsProcessed(state.iterations() * map.points.size());
+    state.counters["output_points"] = output.points.size();
+    state.counters["map_bytes_per_point"] = static_cast<double>(index.get_memory_bytes()) / map.points.size();
+}
+BENCHMARK(BM_MapTileIndexQuery)->ArgNames({"outdoor", "size"})->Apply(map_args)->Unit(benchmark::kMicrosecond);
+
+// robot driving along x at 0.5 m per scan, the window changes every 20 scans (10 m tiles)
+static void
+BM_MapTileIndexUpdateWindow(benchmark::State& state)
+{
+    const int size = state.range(1);
+    const Cloud& map = get_map(map_type_arg(state, 0), size);
+    MapTileIndex index;
+    index.build(map);
+    Cloud output;
+    const double x_begin = -0.5 * size + LIMIT_RANGE, x_end = 0.5 * size - LIMIT_RANGE;
+    double x = x_begin;
+    int64_t changes = 0;
+    for(auto _ : state){
+        if(index.update_window(x, POSE_Y, LIMIT_RANGE, output)) changes++;
+        benchmark::DoNotOptimize(output.points.data());
+        x += 0.5;
+        if(x > x_end){
+            x = x_begin;
+            state.PauseTiming();
+            index.reset_window();
+            state.ResumeTiming();
+        }
+    }
+    state.counters["window_changes"] = benchmark::Counter(changes, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_MapTileIndexUpdateWindow)->ArgNames({"outdoor", "size"})->Apply(map_args)->Unit(benchmark::kMicrosecond);
+
+
+/*------ NDT ------*/
+template<class NDT>
+void
+run_ndt_align(benchmark::State& state, NDT& ndt)
+{
+    const NdtInput& input = get_ndt_input(map_type_arg(state, 0));
+    ndt.setTransformationEpsilon(0.001);
+    ndt.setStepSize(0.1);
+    ndt.setResolution(RESOLUTION);
+    ndt.setMaximumIterations(35);
+    ndt.setInputTarget(input.target);
+    ndt.setInputSource(input.source);
+
+    Cloud output;
+    int64_t iterations = 0;
+    for(auto _ : state){
+        ndt.align(output, input.guess);
+        iterations += ndt.getFinalNumIteration();
+    }
+    state.SetItemsProcessed(state.iterations() * input.source->points.size());
+    state.counters["ndt_iterations"] = benchmark::Counter(iterations, benchmark::Counter::kAvgIterations);
+    state.counters["target_points"] = input.target->points.size();
+    state.counters["source_points"] = input.source->points.size();
+}
+
+// pcl::NormalDistributionsTransform is single threaded, the second arg is only for the comparison
+static void
+BM_NdtAlign_Pcl(benchmark::State& state)
+{
+    pcl::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI> ndt;
+    run_ndt_align(state, ndt);
+}
+BENCHMARK(BM_NdtAlign_Pcl)->ArgNames({"outdoor", "threads"})->Args({0, 1})->Args({1, 1})->Unit(benchmark::kMillisecond);
+
+// Matcher with MULTI_RESOLUTION: coarser levels first, each starting from the previous result
+static void
+BM_NdtAlignCoarseToFine_Pcl(benchmark::State& state)
+{
+    typedef pcl::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI> NDT;
+    const NdtInput& input = get_ndt_input(map_type_arg(state, 0));
+    const double resolutions[] = {4.0 * RESOLUTION, 2.0 * RESOLUTION, RESOLUTION};
+    std::vector<std::unique_ptr<NDT> > levels;
+    for(int i = 0; i < 3; i++){
+        levels.emplace_back(new NDT);
+        NDT& ndt = *levels.back();
+        const bool finest = (i == 2);
+        ndt.setTransformationEpsilon(finest ? 0.001 : 0.01);
+        ndt.setStepSize(0.1 * resolutions[i] / RESOLUTION);
+        ndt.setResolution(resolutions[i]);
+        ndt.setMaximumIterations(finest ? 35 : 10);
+        ndt.setInputTarget(input.target);
+        ndt.setInputSource(input.source);
+    }
+
+    Cloud output;
+    int64_t iterations = 0;
+    for(auto _ : state){
+        Eigen::Matrix4f guess = input.guess;
+        for(auto& ndt : levels){
+            ndt->align(output, guess);
+            guess = ndt->getFinalTransformation();
+            iterations += ndt->getFinalNumIteration();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * input.source->points.size());
+    state.counters["ndt_iterations"] = benchmark::Counter(iterations, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_NdtAlignCoarseToFine_Pcl)->ArgNames({"outdoor"})->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+#ifdef USE_NDT_OMP
+static void
+BM_NdtAlign_Omp(benchmark::State& state)
+{
+    pclomp::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI> ndt;
+    ndt.setNumThreads(state.range(1));
+    ndt.setNeighborhoodSearchMethod(pclomp::DIRECT7);
+    run_ndt_align(state, ndt);
+}
+BENCHMARK(BM_NdtAlign_Omp)->ArgNames({"outdoor", "threads"})->Apply(thread_args)->Unit(benchmark::kMillisecond)->UseRealTime();
+#endif
+
+// score of the aligned scan against the target (kd-tree nearest neighbour of every source point)
+static void
+BM_FitnessScore(benchmark::State& state)
+{
+    const NdtInput& input = get_ndt_input(map_type_arg(state, 0));
+    pcl::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI> ndt;
+    ndt.setResolution(RESOLUTION);
+    ndt.setInputTarget(input.target);
+    ndt.setInputSource(input.source);
+    Cloud output;
+    ndt.align(output, input.guess);
+    double score = 0.0;
+    for(auto _ : state){
+        score = ndt.getFitnessScore();
+        benchmark::DoNotOptimize(score);
+    }
+    state.SetItemsProcessed(state.iterations() * input.source->points.size());
+    state.counters["score"] = score;
+}
+BENCHMARK(BM_FitnessScore)->ArgNames({"outdoor"})->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+
+
+/*------ global relocalization ------*/
+// whole search of a 200 x 200 m map (Matcher defaults), the ndt refinement of the candidates is not included
+static void
+BM_RelocalizeSearch(benchmark::State& state)
+{
+    const MapType type = map_type_arg(state, 0);
+    const Cloud& map = get_map(type, 200);
+    Relocalizer relocalizer;
+    relocalizer.set_num_threads(state.range(1));
+    relocalizer.build(map, 0, 0, 0, 0, LIMIT_RANGE);
+    const NdtInput& input = get_ndt_input(type);
+
+    std::vector<Relocalizer::Candidate> candidates;
+    for(auto _ : state){
+        relocalizer.search(*input.source, candidates);
+    }
+    state.counters["positions"] = relocalizer.get_position_num();
+    // distance of the nearest candidate to the true pose
+    double error = std::numeric_limits<double>::max();
+    for(const auto& candidate : candidates) error = std::min(error, std::hypot(candidate.x - POSE_X, candidate.y - POSE_Y));
+    state.counters["nearest_candidate"] = error;
+}
+BENCHMARK(BM_RelocalizeSearch)->ArgNames({"outdoor", "threads"})->Apply(thread_args)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+
+/*------ EKF ------*/
+// same computation as EKFLocalizer::predict
+static void
+BM_EkfPredict(benchmark::State& state)
+{
+    typedef EKF<3, 2> Filter;
+    double s_input[4] = {1.0e-3, 1.0e-5, 1.0e-5, 1.0e-3};
+    const DiffDriveModel model(s_input, 0.0f);
+    Filter::State x = Filter::State::Zero();
+    Filter::StateMatrix Sigma = Filter::StateMatrix::Identity() * 0.1f;
+    Filter::Control u(1.0f, 0.1f);
+    const float dt = 0.01f;
+    for(auto _ : state){
+        Filter::predict(model, u, dt, x, Sigma);
+        benchmark::DoNotOptimize(Sigma.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EkfPredict);
+
+// imu samples of one 20 Hz step at 200 Hz in one call
+static void
+BM_EkfPredictBatch(benchmark::State& state)
+{
+    typedef EKF<3, 2> Filter;
+    const int n = 10;
+    double s_input[4] = {1.0e-3, 1.0e-5, 1.0e-5, 1.0e-3};
+    const DiffDriveModel model(s_input, 0.0f);
+    Filter::State x = Filter::State::Zero();
+    Filter::StateMatrix Sigma = Filter::StateMatrix::Identity() * 0.1f;
+    Filter::Control u[n];
+    float dt[n];
+    for(int i = 0; i < n; i++){
+        u[i] << 1.0f, 0.1f * std::sin(0.3f * i);
+        dt[i] = 0.005f;
+    }
+    for(auto _ : state){
+        Filter::predict(model, u, dt, n, x, Sigma);
+        benchmark::DoNotOptimize(Sigma.data());
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_EkfPredictBatch);
+
+// same computation as EKFLocalizer::NDTUpdate
+static void
+BM_EkfUpdate(benchmark::State& state)
+{
+    typedef EKF<3, 2> Filter;
+    Filter::State x = Filter::State::Zero();
+    Filter::StateMatrix Sigma = Filter::StateMatrix::Identity() * 0.1f;
+    Matrix3f Q = Matrix3f::Zero();
+    Q(0, 0) = Q(1, 1) = 0.1f;
+    Q(2, 2) = 0.05f;
+    const Vector3f obs_ndt(0.1f, -0.1f, 0.01f);
+    for(auto _ : state){
+        Filter::update(PoseObservation(), obs_ndt, Q, x, Sigma);
+        benchmark::DoNotOptimize(Sigma.data());
+        // keep Sigma from collapsing to zero over millions of updates
+        Sigma += Filter::StateMatrix::Identity() * 1.0e-3f;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EkfUpdate);
+
+
+BENCHMARK_MAIN();
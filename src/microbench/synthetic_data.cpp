@@ -0,0 +1,385 @@
+/* synthetic_data.cpp
+ *
+ * deterministic synthetic maps and scans for the microbenchmarks
+ *
+*/
+
+#include<cmath>
+#include<cstring>
+#include<random>
+#include<limits>
+#include<vector>
+
+#include"synthetic_data.hpp"
+
+namespace synthetic{
+
+namespace{
+
+const double ROOM_SIZE = 8.0;
+const double ROOM_HEIGHT = 3.0;
+const double DOOR_WIDTH = 1.0;
+const double DOOR_HEIGHT = 2.0;
+const double BLOCK_SIZE = 40.0;
+const double POLE_CELL = 15.0;
+const double POLE_RADIUS = 0.15;
+const double POLE_HEIGHT = 4.0;
+const double SENSOR_HEIGHT = 1.0;
+const double MAX_RANGE = 100.0;
+
+struct Box{
+    double x_min, x_max, y_min, y_max, height;
+};
+
+uint64_t
+mix(uint64_t v)
+{
+    v += 0x9E3779B97F4A7C15ull;
+    v = (v ^ (v >> 30)) * 0xBF58476D1CE4E5B9ull;
+    v = (v ^ (v >> 27)) * 0x94D049BB133111EBull;
+    return v ^ (v >> 31);
+}
+
+// uniform [0, 1) from the cell coordinates, independent of the map size
+double
+cell_random(int ix, int iy, uint64_t salt)
+{
+    const uint64_t h = mix(mix(static_cast<uint64_t>(static_cast<uint32_t>(ix)) << 32 | static_cast<uint32_t>(iy)) ^ salt);
+    return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// one building per block, in the middle part of the block
+Box
+block_building(int bx, int by)
+{
+    Box box;
+    const double w = 6.0 + 14.0 * cell_random(bx, by, 1);
+    const double d = 6.0 + 14.0 * cell_random(bx, by, 2);
+    const double cx = (bx + 0.5) * BLOCK_SIZE + (cell_random(bx, by, 3) - 0.5) * (BLOCK_SIZE - w - 8.0);
+    const double cy = (by + 0.5) * BLOCK_SIZE + (cell_random(bx, by, 4) - 0.5) * (BLOCK_SIZE - d - 8.0);
+    box.x_min = cx - w / 2;
+    box.x_max = cx + w / 2;
+    box.y_min = cy - d / 2;
+    box.y_max = cy + d / 2;
+    box.height = 5.0 + 10.0 * cell_random(bx, by, 5);
+    return box;
+}
+
+void
+pole_position(int px, int py, double& x, double& y)
+{
+    x = (px + 0.2 + 0.6 * cell_random(px, py, 6)) * POLE_CELL;
+    y = (py + 0.2 + 0.6 * cell_random(px, py, 7)) * POLE_CELL;
+}
+
+bool
+pole_inside_building(double x, double y)
+{
+    const Box box = block_building(static_cast<int>(std::floor(x / BLOCK_SIZE)), static_cast<int>(std::floor(y / BLOCK_SIZE)));
+    return box.x_min - 1.0 < x && x < box.x_max + 1.0 && box.y_min - 1.0 < y && y < box.y_max + 1.0;
+}
+
+double
+ground_height(double x, double y)
+{
+    return 0.3 * std::sin(x / 7.0) * std::cos(y / 11.0);
+}
+
+// door gap in the middle of every wall segment
+bool
+in_door(double along, double z)
+{
+    const double c = std::fmod(along, ROOM_SIZE);
+    const double offset = (c < 0 ? c + ROOM_SIZE : c) - ROOM_SIZE / 2;
+    return std::fabs(offset) < DOOR_WIDTH / 2 && z < DOOR_HEIGHT;
+}
+
+void
+add_point(Cloud& cloud, double x, double y, double z, float intensity)
+{
+    pcl::PointXYZI p;
+    p.x = x;
+    p.y = y;
+    p.z = z;
+    p.intensity = intensity;
+    cloud.points.push_back(p);
+}
+
+void
+make_indoor(double size, double step, std::mt19937& rng, Cloud& map)
+{
+    std::normal_distribution<double> noise(0.0, 0.01);
+    const double half = size / 2;
+
+    // floor and ceiling
+    for(double x = -half; x < half; x += step){
+        for(double y = -half; y < half; y += step){
+            add_point(map, x + noise(rng), y + noise(rng), noise(rng), 10.0f);
+            add_point(map, x + noise(rng), y + noise(rng), ROOM_HEIGHT + noise(rng), 20.0f);
+        }
+    }
+    // walls on x = k * ROOM_SIZE and y = k * ROOM_SIZE
+    const int k_min = static_cast<int>(std::ceil(-half / ROOM_SIZE));
+    const int k_max = static_cast<int>(std::floor(half / ROOM_SIZE));
+    for(int k = k_min; k <= k_max; k++){
+        const double w = k * ROOM_SIZE;
+        for(double a = -half; a < half; a += step){
+            for(double z = 0; z < ROOM_HEIGHT; z += step){
+                if(in_door(a, z)) continue;
+                add_point(map, w + noise(rng), a, z, 50.0f);
+                add_point(map, a, w + noise(rng), z, 50.0f);
+            }
+        }
+    }
+}
+
+void
+make_outdoor(double size, double step, std::mt19937& rng, Cloud& map)
+{
+    std::normal_distribution<double> noise(0.0, 0.02);
+    const double half = size / 2;
+
+    for(double x = -half; x < half; x += step){
+        for(double y = -half; y < half; y += step){
+            add_point(map, x, y, ground_height(x, y) + noise(rng), 5.0f);
+        }
+    }
+
+    const int b_min = static_cast<int>(std::floor(-half / BLOCK_SIZE));
+    const int b_max = static_cast<int>(std::floor(half / BLOCK_SIZE));
+    for(int bx = b_min; bx <= b_max; bx++){
+        for(int by = b_min; by <= b_max; by++){
+            const Box box = block_building(bx, by);
+            for(double z = 0; z < box.height; z += step){
+                for(double x = box.x_min; x < box.x_max; x += step){
+                    if(std::fabs(x) > half) continue;
+                    if(std::fabs(box.y_min) < half) add_point(map, x, box.y_min + noise(rng), z, 80.0f);
+                    if(std::fabs(box.y_max) < half) add_point(map, x, box.y_max + noise(rng), z, 80.0f);
+                }
+                for(double y = box.y_min; y < box.y_max; y += step){
+                    if(std::fabs(y) > half) continue;
+                    if(std::fabs(box.x_min) < half) add_point(map, box.x_min + noise(rng), y, z, 80.0f);
+                    if(std::fabs(box.x_max) < half) add_point(map, box.x_max + noise(rng), y, z, 80.0f);
+                }
+            }
+        }
+    }
+
+    const int p_min = static_cast<int>(std::floor(-half / POLE_CELL));
+    const int p_max = static_cast<int>(std::floor(half / POLE_CELL));
+    const double angle_step = step / POLE_RADIUS;
+    for(int px = p_min; px <= p_max; px++){
+        for(int py = p_min; py <= p_max; py++){
+            double cx, cy;
+            pole_position(px, py, cx, cy);
+            if(std::fabs(cx) > half || std::fabs(cy) > half || pole_inside_building(cx, cy)) continue;
+            for(double z = 0; z < POLE_HEIGHT; z += step){
+                for(double a = 0; a < 2 * M_PI; a += angle_step){
+                    add_point(map, cx + POLE_RADIUS * std::cos(a), cy + POLE_RADIUS * std::sin(a), z, 120.0f);
+                }
+            }
+        }
+    }
+}
+
+// distance along the ray (origin o, direction d) to the first surface, MAX_RANGE when nothing is hit
+double
+cast_indoor(const double o[3], const double d[3])
+{
+    double t_hit = MAX_RANGE;
+    if(d[2] < 0) t_hit = std::min(t_hit, -o[2] / d[2]);
+    if(d[2] > 0) t_hit = std::min(t_hit, (ROOM_HEIGHT - o[2]) / d[2]);
+
+    for(int axis = 0; axis < 2; axis++){
+        if(std::fabs(d[axis]) < 1e-9) continue;
+        const int other = 1 - axis;
+        double w = (d[axis] > 0) ? std::floor(o[axis] / ROOM_SIZE + 1) * ROOM_SIZE
+                                 : std::ceil(o[axis] / ROOM_SIZE - 1) * ROOM_SIZE;
+        while(true){
+            const double t = (w - o[axis]) / d[axis];
+            if(t >= t_hit) break;
+            const double a = o[other] + t * d[other];
+            const double z = o[2] + t * d[2];
+            if(!in_door(a, z)){
+                t_hit = t;
+                break;
+            }
+            w += (d[axis] > 0) ? ROOM_SIZE : -ROOM_SIZE;
+        }
+    }
+    return t_hit;
+}
+
+double
+cast_outdoor(const double o[3], const double d[3])
+{
+    double t_hit = MAX_RANGE;
+    // the ground is cast as the plane z = 0 and the point is put on the uneven surface afterwards
+    if(d[2] < 0) t_hit = std::min(t_hit, -o[2] / d[2]);
+
+    const int b_min_x = static_cast<int>(std::floor((o[0] - MAX_RANGE) / BLOCK_SIZE));
+    const int b_max_x = static_cast<int>(std::floor((o[0] + MAX_RANGE) / BLOCK_SIZE));
+    const int b_min_y = static_cast<int>(std::floor((o[1] - MAX_RANGE) / BLOCK_SIZE));
+    const int b_max_y = static_cast<int>(std::floor((o[1] + MAX_RANGE) / BLOCK_SIZE));
+    for(int bx = b_min_x; bx <= b_max_x; bx++){
+        for(int by = b_min_y; by <= b_max_y; by++){
+            const Box box = block_building(bx, by);
+            // slab test in x / y, the roof is not needed from the sensor height
+            double t0 = 0, t1 = t_hit;
+            const double lo[2] = {box.x_min, box.y_min};
+            const double hi[2] = {box.x_max, box.y_max};
+            bool hit = true;
+            for(int axis = 0; axis < 2 && hit; axis++){
+                if(std::fabs(d[axis]) < 1e-12){
+                    hit = lo[axis] <= o[axis] && o[axis] <= hi[axis];
+                    continue;
+                }
+                double ta = (lo[axis] - o[axis]) / d[axis];
+                double tb = (hi[axis] - o[axis]) / d[axis];
+                if(ta > tb) std::swap(ta, tb);
+                t0 = std::max(t0, ta);
+                t1 = std::min(t1, tb);
+                hit = t0 <= t1;
+            }
+            if(hit && t0 > 0 && o[2] + t0 * d[2] < box.height) t_hit = t0;
+        }
+    }
+
+    const double dxy = std::sqrt(d[0] * d[0] + d[1] * d[1]);
+    if(dxy > 1e-9){
+        const int p_min_x = static_cast<int>(std::floor((o[0] - MAX_RANGE) / POLE_CELL));
+        const int p_max_x = static_cast<int>(std::floor((o[0] + MAX_RANGE) / POLE_CELL));
+        const int p_min_y = static_cast<int>(std::floor((o[1] - MAX_RANGE) / POLE_CELL));
+        const int p_max_y = static_cast<int>(std::floor((o[1] + MAX_RANGE) / POLE_CELL));
+        for(int px = p_min_x; px <= p_max_x; px++){
+            for(int py = p_min_y; py <= p_max_y; py++){
+                double cx, cy;
+                pole_position(px, py, cx, cy);
+                if(pole_inside_building(cx, cy)) continue;
+                // 2D ray / circle
+                const double fx = o[0] - cx, fy = o[1] - cy;
+                const double a = d[0] * d[0] + d[1] * d[1];
+                const double b = 2 * (fx * d[0] + fy * d[1]);
+                const double c = fx * fx + fy * fy - POLE_RADIUS * POLE_RADIUS;
+                const double disc = b * b - 4 * a * c;
+                if(disc < 0) continue;
+                const double t = (-b - std::sqrt(disc)) / (2 * a);
+                if(t > 0 && t < t_hit && o[2] + t * d[2] < POLE_HEIGHT) t_hit = t;
+            }
+        }
+    }
+    return t_hit;
+}
+
+}
+
+
+void
+make_map(MapType type, double size, double density, uint32_t seed, Cloud& map)
+{
+    std::mt19937 rng(seed);
+    const double step = 1.0 / std::sqrt(density);
+    map.points.clear();
+    if(type == MAP_INDOOR) make_indoor(size, step, rng, map);
+    else make_outdoor(size, step, rng, map);
+    map.width = map.points.size();
+    map.height = 1;
+    map.is_dense = true;
+    map.header.frame_id = "map";
+}
+
+
+void
+make_velodyne_scan(MapType type, int rings, int columns, double x, double y, double yaw,
+        uint32_t seed, sensor_msgs::PointCloud2& msg)
+{
+    // x, y, z, intensity (float32) + ring (uint16), padded to 32 bytes like velodyne_pointcloud
+    const char* names[] = {"x", "y", "z", "intensity"};
+    msg.fields.clear();
+    for(int i = 0; i < 4; i++){
+        sensor_msgs::PointField field;
+        field.name = names[i];
+        field.offset = 4 * i;
+        field.datatype = sensor_msgs::PointField::FLOAT32;
+        field.count = 1;
+        msg.fields.push_back(field);
+    }
+    sensor_msgs::PointField ring_field;
+    ring_field.name = "ring";
+    ring_field.offset = 16;
+    ring_field.datatype = sensor_msgs::PointField::UINT16;
+    ring_field.count = 1;
+    msg.fields.push_back(ring_field);
+
+    msg.header.frame_id = "velodyne";
+    msg.height = rings;
+    msg.width = columns;
+    msg.point_step = 32;
+    msg.row_step = msg.point_step * columns;
+    msg.is_bigendian = false;
+    msg.is_dense = false;
+    msg.data.assign(static_cast<size_t>(msg.row_step) * rings, 0);
+
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> noise(0.0, 0.02);
+    // elevation of the HDL-32E (-30.67 .. +10.67 deg) scaled to the ring number
+    const double el_min = -30.67 * M_PI / 180.0, el_max = 10.67 * M_PI / 180.0;
+    const double o[3] = {x, y, SENSOR_HEIGHT};
+
+    for(int r = 0; r < rings; r++){
+        const double el = (rings == 1) ? 0.0 : el_min + (el_max - el_min) * r / (rings - 1);
+        for(int c = 0; c < columns; c++){
+            const double az = 2 * M_PI * c / columns;
+            const double d[3] = {std::cos(el) * std::cos(az + yaw), std::cos(el) * std::sin(az + yaw), std::sin(el)};
+            const double t = (type == MAP_INDOOR) ? cast_indoor(o, d) : cast_outdoor(o, d);
+
+            float p[4];
+            if(t >= MAX_RANGE){
+                p[0] = p[1] = p[2] = std::numeric_limits<float>::quiet_NaN();
+                p[3] = 0.0f;
+            }else{
+                const bool ground = d[2] < 0 && t == -o[2] / d[2];
+                const double range = t + noise(rng);
+                // sensor frame
+                p[0] = range * std::cos(el) * std::cos(az);
+                p[1] = range * std::cos(el) * std::sin(az);
+                p[2] = range * d[2];
+                if(type == MAP_OUTDOOR && ground){
+                    p[2] += ground_height(x + t * d[0], y + t * d[1]);
+                }
+                p[3] = static_cast<float>(std::min(255.0, 1000.0 / (1.0 + range)));
+            }
+            uint8_t* ptr = msg.data.data() + static_cast<size_t>(r) * msg.row_step + static_cast<size_t>(c) * msg.point_step;
+            std::memcpy(ptr, p, sizeof(p));
+            const uint16_t ring = r;
+            std::memcpy(ptr + 16, &ring, sizeof(ring));
+        }
+    }
+}
+
+
+void
+make_scan_from_map(const Cloud& map, double x, double y, double yaw, double range,
+        double noise, uint32_t seed, Cloud& scan)
+{
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> dist(0.0, noise);
+    const double c = std::cos(yaw), s = std::sin(yaw);
+    scan.points.clear();
+    for(const auto& p : map.points){
+        const double dx = p.x - x, dy = p.y - y;
+        if(std::fabs(dx) > range || std::fabs(dy) > range) continue;
+        pcl::PointXYZI q;
+        q.x = c * dx + s * dy + dist(rng);
+        q.y = -s * dx + c * dy + dist(rng);
+        q.z = p.z + dist(rng);
+        q.intensity = p.intensity;
+        scan.points.push_back(q);
+    }
+    scan.width = scan.points.size();
+    scan.height = 1;
+    scan.is_dense = true;
+    scan.header.frame_id = "velodyne";
+}
+
+}
@@ -0,0 +1,38 @@
+#ifndef _SYNTHETIC_DATA_HPP_
+#define _SYNTHETIC_DATA_HPP_
+
+#include<cstdint>
+
+#include<sensor_msgs/PointCloud2.h>
+
+#include<pcl/point_cloud.h>
+#include<pcl/point_types.h>
+
+
+/* Deterministic synthetic maps and scans for the microbenchmarks.
+ * The same arguments (and seed) always give the same points.
+ */
+namespace synthetic{
+
+typedef pcl::PointCloud<pcl::PointXYZI> Cloud;
+
+enum MapType{
+    MAP_INDOOR,     // rooms of 8 x 8 m with walls, doors, floor and ceiling
+    MAP_OUTDOOR,    // uneven ground, buildings and poles
+};
+
+// square map of size x size [m] centered at the origin, about density points / m^2 of surface
+void make_map(MapType type, double size, double density, uint32_t seed, Cloud& map);
+
+// Velodyne-like organized scan (x, y, z, intensity, ring) with rings x columns points,
+// ray-cast against the map type geometry seen from (x, y, yaw)
+void make_velodyne_scan(MapType type, int rings, int columns, double x, double y, double yaw,
+        uint32_t seed, sensor_msgs::PointCloud2& msg);
+
+// map points within range of (x, y) in the sensor frame at (x, y, yaw), with noise [m]
+void make_scan_from_map(const Cloud& map, double x, double y, double yaw, double range,
+        double noise, uint32_t seed, Cloud& scan);
+
+}
+
+#endif
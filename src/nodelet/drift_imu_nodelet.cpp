@@ -0,0 +1,31 @@
+/* drift_imu_nodelet.cpp
+ *
+ * nodelet version of the drift_imu node
+ *
+*/
+
+#include <memory>
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "ndt_localizer/drift_imu.hpp"
+
+namespace ndt_localizer
+{
+
+class DriftImuNodelet : public nodelet::Nodelet
+{
+    private:
+        std::unique_ptr<DriftImu> drift_imu;
+
+        virtual void onInit()
+        {
+            NODELET_INFO("\033[1;32m---->\033[0m drift_imu nodelet Started.");
+            drift_imu.reset(new DriftImu(getNodeHandle(), getPrivateNodeHandle()));
+        }
+};
+
+}
+
+PLUGINLIB_EXPORT_CLASS(ndt_localizer::DriftImuNodelet, nodelet::Nodelet)
@@ -0,0 +1,31 @@
+/* ekf_nodelet.cpp
+ *
+ * nodelet version of the ekf node
+ *
+*/
+
+#include <memory>
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "ndt_localizer/ekf_localizer.hpp"
+
+namespace ndt_localizer
+{
+
+class EKFNodelet : public nodelet::Nodelet
+{
+    private:
+        std::unique_ptr<EKFLocalizer> ekf_localizer;
+
+        virtual void onInit()
+        {
+            NODELET_INFO("\033[1;32m---->\033[0m EKF nodelet Started.");
+            ekf_localizer.reset(new EKFLocalizer(getNodeHandle(), getPrivateNodeHandle()));
+        }
+};
+
+}
+
+PLUGINLIB_EXPORT_CLASS(ndt_localizer::EKFNodelet, nodelet::Nodelet)
@@ -0,0 +1,41 @@
+/* map_match_omp_nodelet.cpp
+ *
+ * nodelet version of the map_match_omp node
+ *
+*/
+
+#include <memory>
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "map_match_omp.hpp"
+
+namespace ndt_localizer
+{
+
+class MapMatchOmpNodelet : public nodelet::Nodelet
+{
+    private:
+        std::unique_ptr<Matcher> matcher;
+
+        virtual void onInit()
+        {
+            NODELET_INFO("\033[1;32m---->\033[0m map_match nodelet Started.");
+
+            // the scans are handed over as shared pointers by the manager (no serialization),
+            // callbacks are cheap and the heavy work runs on the matcher's own threads
+            ros::NodeHandle n = getMTNodeHandle();
+            ros::NodeHandle priv_nh = getMTPrivateNodeHandle();
+            matcher.reset(new Matcher(n, priv_nh));
+
+            std::string map_file;
+            priv_nh.param("MAP_FILE", map_file, std::string("$(find localizer)/example_data/d_kan_indoor.pcd"));
+            matcher->map_read(map_file);
+            matcher->start();
+        }
+};
+
+}
+
+PLUGINLIB_EXPORT_CLASS(ndt_localizer::MapMatchOmpNodelet, nodelet::Nodelet)
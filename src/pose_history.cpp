@@ -0,0 +1,100 @@
+/* pose_history.cpp
+ *
+ * interpolation / extrapolation of the stamped poses to a scan stamp
+ *
+*/
+
+#include<algorithm>
+#include<cmath>
+
+#include"pose_history.hpp"
+
+
+PoseHistory::PoseHistory(size_t capacity_, double max_extrapolation_) :
+    capacity(capacity_ < 2 ? 2 : capacity_),
+    max_extrapolation(max_extrapolation_)
+{
+}
+
+
+void
+PoseHistory::add(const nav_msgs::Odometry& odom)
+{
+    Sample sample;
+    sample.stamp = odom.header.stamp.toSec();
+    sample.position = Eigen::Vector3d(odom.pose.pose.position.x, odom.pose.pose.position.y, odom.pose.pose.position.z);
+    sample.orientation = Eigen::Quaterniond(odom.pose.pose.orientation.w, odom.pose.pose.orientation.x,
+                                            odom.pose.pose.orientation.y, odom.pose.pose.orientation.z);
+    if(sample.orientation.squaredNorm() < 1e-12) sample.orientation = Eigen::Quaterniond::Identity();
+    sample.orientation.normalize();
+    sample.linear = Eigen::Vector3d(odom.twist.twist.linear.x, odom.twist.twist.linear.y, odom.twist.twist.linear.z);
+    sample.angular = Eigen::Vector3d(odom.twist.twist.angular.x, odom.twist.twist.angular.y, odom.twist.twist.angular.z);
+
+    if(!samples.empty()){
+        if(sample.stamp < samples.back().stamp) return;
+        // the ekf publishes at its own rate with the stamp of the last input
+        if(sample.stamp == samples.back().stamp) samples.pop_back();
+    }
+    samples.push_back(sample);
+    while(samples.size() > capacity) samples.pop_front();
+}
+
+
+void
+PoseHistory::extrapolate(const Sample& sample, double dt, Eigen::Affine3d& pose)
+{
+    // exp of the body twist over dt: R' = R exp(w dt), p' = p + R J(w dt) v dt
+    const Eigen::Vector3d phi = sample.angular * dt;
+    const Eigen::Vector3d rho = sample.linear * dt;
+    const double theta = phi.norm();
+
+    Eigen::Matrix3d delta_rotation = Eigen::Matrix3d::Identity();
+    Eigen::Matrix3d jacobian = Eigen::Matrix3d::Identity();
+    if(theta > 1e-9){
+        Eigen::Matrix3d skew;
+        skew <<       0, -phi(2),  phi(1),
+                 phi(2),       0, -phi(0),
+                -phi(1),  phi(0),       0;
+        delta_rotation = Eigen::AngleAxisd(theta, phi / theta).toRotationMatrix();
+        jacobian += (1.0 - std::cos(theta)) / (theta * theta) * skew
+                  + (theta - std::sin(theta)) / (theta * theta * theta) * skew * skew;
+    }
+
+    const Eigen::Matrix3d rotation = sample.orientation.toRotationMatrix();
+    pose = Eigen::Affine3d::Identity();
+    pose.linear() = rotation * delta_rotation;
+    pose.translation() = sample.position + rotation * (jacobian * rho);
+}
+
+
+bool
+PoseHistory::predict(double stamp, Eigen::Affine3d& pose, double& gap) const
+{
+    if(samples.empty()) return false;
+
+    const Sample* nearest = NULL;
+    if(stamp >= samples.back().stamp){
+        nearest = &samples.back();
+    }else if(stamp <= samples.front().stamp){
+        nearest = &samples.front();
+    }
+
+    if(nearest){
+        gap = stamp - nearest->stamp;
+        const double dt = std::max(-max_extrapolation, std::min(max_extrapolation, gap));
+        extrapolate(*nearest, dt, pose);
+        return true;
+    }
+
+    // samples.front().stamp < stamp < samples.back().stamp
+    auto after = std::upper_bound(samples.begin(), samples.end(), stamp,
+            [](double t, const Sample& sample){ return t < sample.stamp; });
+    auto before = after - 1;
+    const double t = (stamp - before->stamp) / (after->stamp - before->stamp);
+
+    pose = Eigen::Affine3d::Identity();
+    pose.linear() = before->orientation.slerp(t, after->orientation).toRotationMatrix();
+    pose.translation() = (1.0 - t) * before->position + t * after->position;
+    gap = 0.0;
+    return true;
+}
@@ -0,0 +1,334 @@
+/* relocalizer.cpp
+ *
+ * candidate generation and coarse NDT scoring of the global relocalization
+ *
+*/
+
+#include<iostream>
+#include<cmath>
+#include<limits>
+#include<algorithm>
+#include<unordered_map>
+
+#ifdef _OPENMP
+#include<omp.h>
+#endif
+
+#include<Eigen/Core>
+#include<Eigen/Eigenvalues>
+
+#include"relocalizer.hpp"
+
+namespace{
+
+const int MIN_CELL_POINTS = 5;
+// smallest / largest eigenvalue of a cell covariance, as in pcl::NormalDistributionsTransform
+const double MIN_EIGEN_RATIO = 0.01;
+const size_t MAX_GRID_CELLS = 64 * 1024 * 1024;
+// radius around the sensor [m] in which the ground of the scan is looked for
+const float GROUND_RADIUS = 10.0f;
+// points lower than this above the ground [m] are not scored
+const float GROUND_CLEARANCE = 0.5f;
+
+struct Accumulator{
+    double sum[3];
+    double outer[6];
+    int count;
+
+    Accumulator() : count(0)
+    {
+        std::fill(sum, sum + 3, 0.0);
+        std::fill(outer, outer + 6, 0.0);
+    }
+};
+
+bool
+better(const Relocalizer::Candidate& a, const Relocalizer::Candidate& b)
+{
+    return a.score > b.score;
+}
+
+}
+
+
+Relocalizer::Relocalizer() :
+    resolution(2.0),
+    xy_step(1.0),
+    yaw_steps(72),
+    sample_num(400),
+    candidate_num(8),
+    num_threads(0)
+{
+    std::fill(origin, origin + 3, 0.0);
+    std::fill(size, size + 3, 0);
+}
+
+
+bool
+Relocalizer::build(const Cloud& map, double x_min, double x_max, double y_min, double y_max, double range)
+{
+    grid.clear();
+    cells.clear();
+    positions.clear();
+    if(map.points.empty()) return false;
+
+    double lower[3] = {std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max()};
+    double upper[3] = {-std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(), -std::numeric_limits<double>::max()};
+    for(const auto& p : map.points){
+        const double v[3] = {p.x, p.y, p.z};
+        for(int i = 0; i < 3; i++){
+            lower[i] = std::min(lower[i], v[i]);
+            upper[i] = std::max(upper[i], v[i]);
+        }
+    }
+    if(x_min >= x_max || y_min >= y_max){
+        x_min = lower[0];
+        x_max = upper[0];
+        y_min = lower[1];
+        y_max = upper[1];
+    }
+    // the grid only has to cover what the scans of the region can see
+    lower[0] = std::max(lower[0], x_min - range);
+    upper[0] = std::min(upper[0], x_max + range);
+    lower[1] = std::max(lower[1], y_min - range);
+    upper[1] = std::min(upper[1], y_max + range);
+    if(lower[0] > upper[0] || lower[1] > upper[1]){
+        std::cout << "\033[31mrelocalization region has no map points\033[0m" << std::endl;
+        return false;
+    }
+
+    // half a cell below the lowest point, the ground is usually there and would be cut by the grid border
+    lower[2] -= 0.5 * resolution;
+
+    size_t grid_num = 1;
+    for(int i = 0; i < 3; i++){
+        origin[i] = lower[i];
+        size[i] = static_cast<int>(std::floor((upper[i] - lower[i]) / resolution)) + 1;
+        grid_num *= size[i];
+    }
+    if(grid_num > MAX_GRID_CELLS){
+        std::cout << "\033[31mrelocalization grid is too large (" << grid_num << " cells), "
+                  << "give a smaller region or a coarser resolution\033[0m" << std::endl;
+        return false;
+    }
+
+    /*------ NDT cells ------*/
+    std::unordered_map<size_t, Accumulator> accumulators;
+    std::unordered_map<uint64_t, float> ground;     // lowest point of the mapped columns
+    for(const auto& p : map.points){
+        const int ix = static_cast<int>(std::floor((p.x - origin[0]) / resolution));
+        const int iy = static_cast<int>(std::floor((p.y - origin[1]) / resolution));
+        const int iz = static_cast<int>(std::floor((p.z - origin[2]) / resolution));
+        if(ix < 0 || ix >= size[0] || iy < 0 || iy >= size[1] || iz < 0 || iz >= size[2]) continue;
+
+        Accumulator& a = accumulators[(static_cast<size_t>(iz) * size[1] + iy) * size[0] + ix];
+        a.sum[0] += p.x; a.sum[1] += p.y; a.sum[2] += p.z;
+        a.outer[0] += p.x * p.x; a.outer[1] += p.x * p.y; a.outer[2] += p.x * p.z;
+        a.outer[3] += p.y * p.y; a.outer[4] += p.y * p.z; a.outer[5] += p.z * p.z;
+        a.count++;
+
+        if(x_min <= p.x && p.x <= x_max && y_min <= p.y && p.y <= y_max){
+            const int px = static_cast<int>(std::floor(p.x / xy_step));
+            const int py = static_cast<int>(std::floor(p.y / xy_step));
+            const uint64_t key = (static_cast<uint64_t>(static_cast<uint32_t>(px)) << 32) | static_cast<uint32_t>(py);
+            auto column = ground.find(key);
+            if(column == ground.end()){
+                ground[key] = p.z;
+            }else{
+                column->second = std::min(column->second, p.z);
+            }
+        }
+    }
+
+    const double blur_variance = 0.25 * resolution * resolution;
+    grid.assign(grid_num, -1);
+    cells.reserve(accumulators.size());
+    for(const auto& entry : accumulators){
+        const Accumulator& a = entry.second;
+        if(a.count < MIN_CELL_POINTS) continue;
+
+        const Eigen::Vector3d mean(a.sum[0] / a.count, a.sum[1] / a.count, a.sum[2] / a.count);
+        Eigen::Matrix3d covariance;
+        covariance << a.outer[0], a.outer[1], a.outer[2],
+                      a.outer[1], a.outer[3], a.outer[4],
+                      a.outer[2], a.outer[4], a.outer[5];
+        covariance = (covariance - a.count * mean * mean.transpose()) / (a.count - 1);
+
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(covariance);
+        Eigen::Vector3d eigen_values = solver.eigenvalues();
+        const double min_value = std::max(eigen_values(2) * MIN_EIGEN_RATIO, 1e-6);
+        // blurred by the spacing of the candidates, so that the nearest one still scores high
+        for(int i = 0; i < 3; i++) eigen_values(i) = std::max(eigen_values(i), min_value) + blur_variance;
+        const Eigen::Matrix3d inverse = solver.eigenvectors() * eigen_values.cwiseInverse().asDiagonal() * solver.eigenvectors().transpose();
+
+        Cell cell;
+        for(int i = 0; i < 3; i++) cell.mean[i] = static_cast<float>(mean(i));
+        cell.inverse[0] = inverse(0, 0); cell.inverse[1] = inverse(0, 1); cell.inverse[2] = inverse(0, 2);
+        cell.inverse[3] = inverse(1, 1); cell.inverse[4] = inverse(1, 2); cell.inverse[5] = inverse(2, 2);
+        grid[entry.first] = static_cast<int32_t>(cells.size());
+        cells.push_back(cell);
+    }
+
+    /*------ candidate positions: mapped columns of the region ------*/
+    // sorted, the hash order is not deterministic across runs (ties of the search)
+    std::vector<std::pair<uint64_t, float> > sorted(ground.begin(), ground.end());
+    std::sort(sorted.begin(), sorted.end());
+    positions.reserve(3 * sorted.size());
+    for(const auto& entry : sorted){
+        const int px = static_cast<int>(static_cast<uint32_t>(entry.first >> 32));
+        const int py = static_cast<int>(static_cast<uint32_t>(entry.first & 0xffffffff));
+        positions.push_back(static_cast<float>((px + 0.5) * xy_step));
+        positions.push_back(static_cast<float>((py + 0.5) * xy_step));
+        positions.push_back(entry.second);
+    }
+
+    std::cout << "relocalization grid: " << size[0] << " x " << size[1] << " x " << size[2]
+              << ", ndt cells: " << cells.size() << ", candidate positions: " << sorted.size() << std::endl;
+    return !cells.empty() && !positions.empty();
+}
+
+
+bool
+Relocalizer::search(const Cloud& scan, std::vector<Candidate>& candidates) const
+{
+    candidates.clear();
+    if(!is_built() || scan.points.empty()) return false;
+
+    /*------ height of the sensor above the ground ------*/
+    // a low percentile of the scan around the sensor (the ground), the candidates are put
+    // this high above the lowest point of their column
+    std::vector<float> low;
+    for(const auto& p : scan.points){
+        if(p.x * p.x + p.y * p.y < GROUND_RADIUS * GROUND_RADIUS) low.push_back(p.z);
+    }
+    if(low.empty()){
+        for(const auto& p : scan.points) low.push_back(p.z);
+    }
+    std::nth_element(low.begin(), low.begin() + low.size() / 20, low.end());
+    const float height = -low[low.size() / 20];
+
+    /*------ subsample of the scan, rotated once per heading ------*/
+    // the ground fits everywhere, only the structure above it tells the places apart
+    // (unless there is too little of it)
+    std::vector<int> structure;
+    for(size_t i = 0; i < scan.points.size(); i++){
+        if(scan.points[i].z + height > GROUND_CLEARANCE) structure.push_back(static_cast<int>(i));
+    }
+    if(structure.size() < std::min<size_t>(sample_num, scan.points.size() / 10)){
+        structure.resize(scan.points.size());
+        for(size_t i = 0; i < structure.size(); i++) structure[i] = static_cast<int>(i);
+    }
+    // interleaved, so that the first quarter of the sample covers the whole scan as well
+    const size_t stride = std::max<size_t>(1, structure.size() / sample_num);
+    std::vector<float> sample_x, sample_y, sample_z;
+    for(size_t offset = 0; offset < 4 * stride; offset += stride){
+        for(size_t i = offset; i < structure.size(); i += 4 * stride){
+            const pcl::PointXYZI& p = scan.points[structure[i]];
+            sample_x.push_back(p.x);
+            sample_y.push_back(p.y);
+            sample_z.push_back(p.z + height);
+        }
+    }
+    const int n = static_cast<int>(sample_x.size());
+    std::vector<float> rotated_x(yaw_steps * n), rotated_y(yaw_steps * n);
+    for(int k = 0; k < yaw_steps; k++){
+        const double yaw = 2.0 * M_PI * k / yaw_steps;
+        const float c = static_cast<float>(std::cos(yaw)), s = static_cast<float>(std::sin(yaw));
+        for(int i = 0; i < n; i++){
+            rotated_x[k * n + i] = c * sample_x[i] - s * sample_y[i];
+            rotated_y[k * n + i] = s * sample_x[i] + c * sample_y[i];
+        }
+    }
+
+    /*------ score of every candidate ------*/
+#ifdef _OPENMP
+    const int threads = num_threads > 0 ? num_threads : omp_get_max_threads();
+#else
+    const int threads = 1;
+#endif
+    const float inverse_resolution = static_cast<float>(1.0 / resolution);
+    const float ox = static_cast<float>(origin[0]), oy = static_cast<float>(origin[1]), oz = static_cast<float>(origin[2]);
+    auto score_of = [&](float tx, float ty, float tz, int k, int num) -> float {
+        const float* rx = &rotated_x[k * n];
+        const float* ry = &rotated_y[k * n];
+        float score = 0.0f;
+        for(int i = 0; i < num; i++){
+            const float x = rx[i] + tx, y = ry[i] + ty, pz = sample_z[i] + tz;
+            const float fx = (x - ox) * inverse_resolution, fy = (y - oy) * inverse_resolution, fz = (pz - oz) * inverse_resolution;
+            if(fx < 0.0f || fy < 0.0f || fz < 0.0f) continue;
+            const int ix = static_cast<int>(fx), iy = static_cast<int>(fy), iz = static_cast<int>(fz);
+            if(ix >= size[0] || iy >= size[1] || iz >= size[2]) continue;
+            const int32_t index = grid[(static_cast<size_t>(iz) * size[1] + iy) * size[0] + ix];
+            if(index < 0) continue;
+
+            const Cell& cell = cells[index];
+            const float dx = x - cell.mean[0], dy = y - cell.mean[1], dz = pz - cell.mean[2];
+            const float* m = cell.inverse;
+            const float q = dx * (m[0] * dx + 2.0f * (m[1] * dy + m[2] * dz)) + dy * (m[3] * dy + 2.0f * m[4] * dz) + m[5] * dz * dz;
+            score += std::exp(-0.5f * q);
+        }
+        return score;
+    };
+
+    // 1. every candidate with a quarter of the points (the sample is spread over the scan),
+    // 2. the best of 1. with all points
+    const long position_num = static_cast<long>(positions.size() / 3);
+    const int quarter = std::max(1, n / 4);
+    const size_t keep = static_cast<size_t>(candidate_num) * 64;
+    std::vector<Candidate> best;
+
+    #pragma omp parallel num_threads(threads)
+    {
+        std::vector<Candidate> local;
+        local.reserve(2 * keep);
+
+        #pragma omp for schedule(dynamic, 16) nowait
+        for(long p = 0; p < position_num; p++){
+            for(int k = 0; k < yaw_steps; k++){
+                Candidate candidate;
+                const float* position = &positions[3 * p];
+                candidate.x = position[0];
+                candidate.y = position[1];
+                candidate.z = position[2] + height;
+                candidate.yaw = k;  // index until the rescoring
+                candidate.score = score_of(position[0], position[1], position[2], k, quarter);
+                local.push_back(candidate);
+                if(local.size() >= 2 * keep){
+                    std::nth_element(local.begin(), local.begin() + keep, local.end(), better);
+                    local.resize(keep);
+                }
+            }
+        }
+
+        #pragma omp critical
+        best.insert(best.end(), local.begin(), local.end());
+    }
+
+    #pragma omp parallel for schedule(dynamic, 16) num_threads(threads)
+    for(long i = 0; i < static_cast<long>(best.size()); i++){
+        Candidate& candidate = best[i];
+        const int k = static_cast<int>(candidate.yaw);
+        candidate.score = score_of(static_cast<float>(candidate.x), static_cast<float>(candidate.y),
+                                   static_cast<float>(candidate.z) - height, k, n);
+        candidate.yaw = 2.0 * M_PI * k / yaw_steps;
+    }
+
+    /*------ best distinct candidates ------*/
+    std::sort(best.begin(), best.end(), better);
+    const double min_distance = 2.0 * xy_step;
+    const double min_angle = 2.0 * 2.0 * M_PI / yaw_steps;
+    for(const Candidate& candidate : best){
+        bool distinct = true;
+        for(const Candidate& selected : candidates){
+            const double angle = std::fabs(std::remainder(candidate.yaw - selected.yaw, 2.0 * M_PI));
+            if(std::hypot(candidate.x - selected.x, candidate.y - selected.y) < min_distance && angle < min_angle){
+                distinct = false;
+                break;
+            }
+        }
+        if(!distinct) continue;
+        candidates.push_back(candidate);
+        if(static_cast<int>(candidates.size()) >= candidate_num) break;
+    }
+    return !candidates.empty();
+}
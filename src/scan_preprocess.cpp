@@ -0,0 +1,329 @@
+/* scan_preprocess.cpp
+ *
+ * conversion, cropping and voxel downsample of the received scans
+ *
+*/
+
+#include<iostream>
+#include<cstring>
+#include<cmath>
+#include<limits>
+
+#include"scan_preprocess.hpp"
+
+namespace{
+
+const uint64_t INVALID_KEY = ~static_cast<uint64_t>(0);
+const int KEY_BITS = 21;
+const int64_t KEY_OFFSET = static_cast<int64_t>(1) << (KEY_BITS - 1);
+const uint64_t KEY_MASK = (static_cast<uint64_t>(1) << KEY_BITS) - 1;
+
+// where the time of a point comes from (deskew)
+enum TimeSource{
+    TIME_RELATIVE_SEC,      // "time" float32 [s] from the sweep start
+    TIME_RELATIVE_NSEC,     // "t" uint32 [ns] from the sweep start
+    TIME_ABSOLUTE,          // "timestamp" float64 [s]
+    TIME_COLUMN,            // column of an organized cloud
+    TIME_AZIMUTH,           // azimuth from the first point
+};
+
+inline float
+read_float(const uint8_t* ptr)
+{
+    float v;
+    std::memcpy(&v, ptr, sizeof(float));
+    return v;
+}
+
+inline float
+read_value(const uint8_t* ptr, uint8_t datatype)
+{
+    switch(datatype){
+        case sensor_msgs::PointField::FLOAT32: return read_float(ptr);
+        case sensor_msgs::PointField::UINT8: return static_cast<float>(*ptr);
+        case sensor_msgs::PointField::UINT16: { uint16_t v; std::memcpy(&v, ptr, sizeof(v)); return static_cast<float>(v); }
+        case sensor_msgs::PointField::FLOAT64: { double v; std::memcpy(&v, ptr, sizeof(v)); return static_cast<float>(v); }
+        default: return 0.0f;
+    }
+}
+
+// NaN points fail the comparison as well, a NaN or infinite z also without the band
+inline bool
+in_range(float x, float y, float z, float r, bool use_band, float z_min, float z_max)
+{
+    bool valid = (-r <= x && x <= r && -r <= y && y <= r);
+    if(use_band) valid = valid && (z_min <= z && z <= z_max);
+    else valid = valid && std::fabs(z) <= std::numeric_limits<float>::max();
+    return valid;
+}
+
+inline uint64_t
+hash_key(uint64_t key)
+{
+    return key * 0x9E3779B97F4A7C15ull;
+}
+
+}
+
+
+ScanPreprocessor::ScanPreprocessor() :
+    range(20.0),
+    height_min(0.0), height_max(0.0),
+    voxel_size(0.0),
+    num_threads(1),
+    read_crop_histogram(NULL),
+    voxel_histogram(NULL),
+    deskew_histogram(NULL),
+    deskew(false),
+    scan_period(0.1),
+    stamp_at_end(true),
+    velocity_x(0), velocity_y(0), yaw_rate(0),
+    generation(0)
+{
+}
+
+
+void
+ScanPreprocessor::prepare_table(size_t num)
+{
+    size_t capacity = 1024;
+    while(capacity < 2 * num) capacity <<= 1;
+    if(table.size() < capacity){
+        table.assign(capacity, Voxel());
+        generation = 0;
+    }
+    // slots of older generations are empty, so the table is never cleared per scan
+    if(++generation == 0){
+        for(auto& voxel : table) voxel.generation = 0;
+        generation = 1;
+    }
+    order.clear();
+}
+
+
+bool
+ScanPreprocessor::convert(const sensor_msgs::PointCloud2& msg, Cloud& output)
+{
+    int x_offset = -1, y_offset = -1, z_offset = -1, i_offset = -1, t_offset = -1;
+    uint8_t i_datatype = 0;
+    TimeSource time_source = msg.height > 1 ? TIME_COLUMN : TIME_AZIMUTH;
+    for(const auto& field : msg.fields){
+        if(field.name == "x" && field.datatype == sensor_msgs::PointField::FLOAT32) x_offset = field.offset;
+        else if(field.name == "y" && field.datatype == sensor_msgs::PointField::FLOAT32) y_offset = field.offset;
+        else if(field.name == "z" && field.datatype == sensor_msgs::PointField::FLOAT32) z_offset = field.offset;
+        else if(field.name == "intensity"){
+            i_offset = field.offset;
+            i_datatype = field.datatype;
+        }
+        else if(field.name == "time" && field.datatype == sensor_msgs::PointField::FLOAT32){
+            t_offset = field.offset;
+            time_source = TIME_RELATIVE_SEC;
+        }
+        else if(field.name == "t" && field.datatype == sensor_msgs::PointField::UINT32){
+            t_offset = field.offset;
+            time_source = TIME_RELATIVE_NSEC;
+        }
+        else if(field.name == "timestamp" && field.datatype == sensor_msgs::PointField::FLOAT64){
+            t_offset = field.offset;
+            time_source = TIME_ABSOLUTE;
+        }
+    }
+    if(x_offset < 0 || y_offset < 0 || z_offset < 0){
+        std::cout << "\033[31mscan has no float32 x/y/z fields\033[0m" << std::endl;
+        return false;
+    }
+    if(msg.data.size() < static_cast<size_t>(msg.row_step) * msg.height){
+        std::cout << "\033[31mscan data is shorter than row_step * height\033[0m" << std::endl;
+        return false;
+    }
+
+    const long num = static_cast<long>(msg.width) * msg.height;
+    buffer_x.resize(num);
+    buffer_y.resize(num);
+    buffer_z.resize(num);
+    buffer_i.resize(num);
+    buffer_valid.resize(num);
+    keys.resize(num);
+
+    /*------ 1. read + crop + height band ------*/
+    const uint8_t* data = msg.data.data();
+    const uint32_t width = msg.width, point_step = msg.point_step, row_step = msg.row_step;
+    const float r = static_cast<float>(range);
+    const bool use_band = height_min < height_max;
+    const float z_min = static_cast<float>(height_min), z_max = static_cast<float>(height_max);
+
+    // a scan taken at rest is not touched
+    const bool use_deskew = deskew && (velocity_x != 0.0 || velocity_y != 0.0 || yaw_rate != 0.0);
+    // point time relative to the header stamp [s]
+    const float time_offset = static_cast<float>(stamp_at_end ? -scan_period : 0.0);
+    const double stamp = msg.header.stamp.toSec();
+    const float period = static_cast<float>(scan_period);
+    const float column_period = period / width;
+    float azimuth_start = 0.0f;
+    if(use_deskew){
+        buffer_t.resize(num);
+        if(time_source == TIME_AZIMUTH){
+            for(long k = 0; k < num; k++){
+                const uint8_t* ptr = data + (k / width) * static_cast<size_t>(row_step) + (k % width) * static_cast<size_t>(point_step);
+                const float x = read_float(ptr + x_offset), y = read_float(ptr + y_offset);
+                if(std::isfinite(x) && std::isfinite(y) && (x != 0.0f || y != 0.0f)){
+                    azimuth_start = std::atan2(y, x);
+                    break;
+                }
+            }
+        }
+    }
+
+    {
+        ScopedTimer timer(read_crop_histogram);
+        #pragma omp parallel for schedule(static) num_threads(num_threads) if(num_threads > 1)
+        for(long k = 0; k < num; k++){
+            const uint8_t* ptr = data + (k / width) * static_cast<size_t>(row_step) + (k % width) * static_cast<size_t>(point_step);
+            const float x = read_float(ptr + x_offset);
+            const float y = read_float(ptr + y_offset);
+            const float z = read_float(ptr + z_offset);
+            buffer_x[k] = x;
+            buffer_y[k] = y;
+            buffer_z[k] = z;
+            buffer_i[k] = (i_offset < 0) ? 0.0f : read_value(ptr + i_offset, i_datatype);
+            if(!use_deskew){
+                buffer_valid[k] = in_range(x, y, z, r, use_band, z_min, z_max);
+                continue;
+            }
+
+            // cropped after the motion compensation
+            float t;
+            switch(time_source){
+                case TIME_RELATIVE_SEC: t = read_float(ptr + t_offset) + time_offset; break;
+                case TIME_RELATIVE_NSEC: { uint32_t ns; std::memcpy(&ns, ptr + t_offset, sizeof(ns)); t = ns * 1e-9f + time_offset; break; }
+                case TIME_ABSOLUTE: { double ts; std::memcpy(&ts, ptr + t_offset, sizeof(ts)); t = static_cast<float>(ts - stamp); break; }
+                case TIME_COLUMN: t = (k % width) * column_period + time_offset; break;
+                case TIME_AZIMUTH:
+                default: {
+                    float delta = azimuth_start - std::atan2(y, x);
+                    if(delta < 0.0f) delta += static_cast<float>(2.0 * M_PI);
+                    t = delta * static_cast<float>(0.5 / M_PI) * period + time_offset;
+                    break;
+                }
+            }
+            buffer_t[k] = t;
+        }
+    }
+
+    /*------ 1'. deskew + crop + height band ------*/
+    if(use_deskew){
+        ScopedTimer timer(deskew_histogram);
+        const float vx = static_cast<float>(velocity_x), vy = static_cast<float>(velocity_y), w = static_cast<float>(yaw_rate);
+        float* bx = buffer_x.data();
+        float* by = buffer_y.data();
+        const float* bz = buffer_z.data();
+        const float* bt = buffer_t.data();
+        uint8_t* bv = buffer_valid.data();
+
+        #pragma omp parallel for simd schedule(static) num_threads(num_threads) if(num_threads > 1)
+        for(long k = 0; k < num; k++){
+            // sensor pose at the point time relative to the one at the header stamp
+            const float dt = bt[k];
+            const float yaw = w * dt;
+            const float yaw2 = yaw * yaw;
+            // series of cos / sin, |yaw| < 0.5 rad within a sweep: error < 3e-5
+            const float c = 1.0f - yaw2 * (0.5f - yaw2 * (1.0f / 24.0f));
+            const float s = yaw * (1.0f - yaw2 * (1.0f / 6.0f - yaw2 * (1.0f / 120.0f)));
+            // translation along the heading at the middle of the interval
+            const float tx = (vx - 0.5f * yaw * vy) * dt;
+            const float ty = (vy + 0.5f * yaw * vx) * dt;
+            const float x = c * bx[k] - s * by[k] + tx;
+            const float y = s * bx[k] + c * by[k] + ty;
+            bx[k] = x;
+            by[k] = y;
+            bv[k] = in_range(x, y, bz[k], r, use_band, z_min, z_max);
+        }
+    }
+
+    output.points.clear();
+    ScopedTimer voxel_timer(voxel_histogram);
+
+    if(voxel_size <= 0.0){
+        for(long k = 0; k < num; k++){
+            if(!buffer_valid[k]) continue;
+            pcl::PointXYZI p;
+            p.x = buffer_x[k];
+            p.y = buffer_y[k];
+            p.z = buffer_z[k];
+            p.intensity = buffer_i[k];
+            output.points.push_back(p);
+        }
+    }else{
+        /*------ 2. voxel keys ------*/
+        const float inverse_leaf = 1.0f / static_cast<float>(voxel_size);
+        const float* bx = buffer_x.data();
+        const float* by = buffer_y.data();
+        const float* bz = buffer_z.data();
+        const uint8_t* bv = buffer_valid.data();
+        uint64_t* bk = keys.data();
+        const float key_limit = static_cast<float>(KEY_OFFSET);
+
+        // only a cropped point within the key range is converted to integers (the conversion of NaN or
+        // of a value out of range is undefined), the others are selected away as floats before it
+        #pragma omp parallel for simd schedule(static) num_threads(num_threads) if(num_threads > 1)
+        for(long k = 0; k < num; k++){
+            const float fx = std::floor(bx[k] * inverse_leaf);
+            const float fy = std::floor(by[k] * inverse_leaf);
+            const float fz = std::floor(bz[k] * inverse_leaf);
+            const bool keyed = bv[k] && std::fabs(fx) < key_limit && std::fabs(fy) < key_limit && std::fabs(fz) < key_limit;
+            const uint64_t ix = static_cast<uint64_t>(static_cast<int64_t>(keyed ? fx : 0.0f) + KEY_OFFSET) & KEY_MASK;
+            const uint64_t iy = static_cast<uint64_t>(static_cast<int64_t>(keyed ? fy : 0.0f) + KEY_OFFSET) & KEY_MASK;
+            const uint64_t iz = static_cast<uint64_t>(static_cast<int64_t>(keyed ? fz : 0.0f) + KEY_OFFSET) & KEY_MASK;
+            const uint64_t key = (ix << (2 * KEY_BITS)) | (iy << KEY_BITS) | iz;
+            bk[k] = keyed ? key : INVALID_KEY;
+        }
+
+        /*------ 3. centroid accumulation ------*/
+        prepare_table(num);
+        const uint64_t mask = table.size() - 1;
+        int shift = 0;
+        while((static_cast<uint64_t>(1) << shift) < table.size()) shift++;
+
+        for(long k = 0; k < num; k++){
+            const uint64_t key = keys[k];
+            if(key == INVALID_KEY) continue;
+
+            uint64_t slot = hash_key(key) >> (64 - shift);
+            while(table[slot].generation == generation && table[slot].key != key){
+                slot = (slot + 1) & mask;
+            }
+            Voxel& voxel = table[slot];
+            if(voxel.generation != generation){
+                voxel.key = key;
+                voxel.x = voxel.y = voxel.z = voxel.intensity = 0.0f;
+                voxel.count = 0;
+                voxel.generation = generation;
+                order.push_back(static_cast<uint32_t>(slot));
+            }
+            voxel.x += buffer_x[k];
+            voxel.y += buffer_y[k];
+            voxel.z += buffer_z[k];
+            voxel.intensity += buffer_i[k];
+            voxel.count++;
+        }
+
+        output.points.resize(order.size());
+        for(size_t n = 0; n < order.size(); n++){
+            const Voxel& voxel = table[order[n]];
+            const float inv_count = 1.0f / static_cast<float>(voxel.count);
+            pcl::PointXYZI& p = output.points[n];
+            p.x = voxel.x * inv_count;
+            p.y = voxel.y * inv_count;
+            p.z = voxel.z * inv_count;
+            p.intensity = voxel.intensity * inv_count;
+        }
+    }
+
+    output.width = output.points.size();
+    output.height = 1;
+    output.is_dense = true;
+    output.header.frame_id = msg.header.frame_id;
+    output.header.stamp = msg.header.stamp.toNSec() / 1000ull;
+    output.header.seq = msg.header.seq;
+    return true;
+}
@@ -0,0 +1,181 @@
+/* test_ekf_localizer.cpp
+ *
+ * out-of-sequence fusion of late NDT results with PREDICT_ON_INPUT
+ *
+*/
+
+#include<cmath>
+#include<string>
+
+#include<gtest/gtest.h>
+
+#include"ndt_localizer/ekf_localizer.hpp"
+
+namespace{
+
+const double START = 100.0;
+const double IMU_RATE = 400.0;
+const double ODOM_RATE = 100.0;
+
+ParamMap
+make_params(double max_delay = 0.5)
+{
+    ParamMap param;
+    param.set("INIT_X", "0");
+    param.set("INIT_Y", "0");
+    param.set("INIT_YAW", "0");
+    param.set("init_sig_x", "1.0");
+    param.set("init_sig_y", "1.0");
+    param.set("init_sig_yaw", "1.0");
+    param.set("Pred_a1", "1e-4");
+    param.set("Pred_a2", "1e-4");
+    param.set("Pred_a3", "1e-4");
+    param.set("Pred_a4", "1e-4");
+    param.set("NDT_sig_X", "0.01");
+    param.set("NDT_sig_Y", "0.01");
+    param.set("NDT_sig_Yaw", "0.01");
+    param.set("mode_pointing_ini_pose_on_rviz", "false");
+    param.set("PREDICT_ON_INPUT", "true");
+    param.set("NDT_MAX_DELAY", std::to_string(max_delay));
+    return param;
+}
+
+// imu and odom at their rates from begin to end, the robot standing still or at v [m/s] and w [rad/s]
+void
+feed_inputs(EKFLocalizer& ekf, double begin, double end, double v = 0.0, double w = 0.0)
+{
+    const double imu_period = 1.0 / IMU_RATE;
+    const double odom_per_imu = IMU_RATE / ODOM_RATE;
+    int n = 0;
+    for(double t = begin; t < end; t += imu_period, n++){
+        sensor_msgs::ImuPtr imu(new sensor_msgs::Imu);
+        imu->header.stamp = ros::Time(t);
+        imu->angular_velocity.z = w;
+        ekf.imuCallback(imu);
+        if(n % static_cast<int>(odom_per_imu) == 0){
+            nav_msgs::OdometryPtr odom(new nav_msgs::Odometry);
+            odom->header.stamp = ros::Time(t);
+            odom->header.frame_id = "odom";
+            odom->child_frame_id = "base_link";
+            odom->twist.twist.linear.x = v;
+            ekf.odomCallback(odom);
+        }
+    }
+}
+
+void
+send_ndt(EKFLocalizer& ekf, double stamp, double x, double y = 0.0, double yaw = 0.0)
+{
+    nav_msgs::OdometryPtr ndt(new nav_msgs::Odometry);
+    ndt->header.stamp = ros::Time(stamp);
+    ndt->header.frame_id = "map";
+    ndt->pose.pose.position.x = x;
+    ndt->pose.pose.position.y = y;
+    ndt->pose.pose.orientation = tf::createQuaternionMsgFromYaw(yaw);
+    ekf.ndtCallback(ndt);
+}
+
+void
+expect_same_state(const nav_msgs::Odometry& a, const nav_msgs::Odometry& b)
+{
+    EXPECT_NEAR(a.pose.pose.position.x, b.pose.pose.position.x, 1e-3);
+    EXPECT_NEAR(a.pose.pose.position.y, b.pose.pose.position.y, 1e-3);
+    EXPECT_NEAR(tf::getYaw(a.pose.pose.orientation), tf::getYaw(b.pose.pose.orientation), 1e-3);
+    EXPECT_NEAR(a.pose.covariance[0], b.pose.covariance[0], 1e-4);
+    EXPECT_NEAR(a.pose.covariance[7], b.pose.covariance[7], 1e-4);
+    EXPECT_NEAR(a.pose.covariance[35], b.pose.covariance[35], 1e-4);
+}
+
+}
+
+
+// 150 ms late at 500 input messages per second: far more steps behind than a count sized by HZ holds
+TEST(EKFLocalizer, FusesLateNdtWithPredictOnInput)
+{
+    EKFLocalizer ekf(make_params());
+    feed_inputs(ekf, START, START + 1.0);
+    send_ndt(ekf, START + 0.85, 0.5);
+    feed_inputs(ekf, START + 1.0, START + 1.01);
+    ASSERT_TRUE(ekf.update(START + 1.01));
+
+    // prior variance 1.0, observation variance 0.01: nearly at the observation
+    EXPECT_NEAR(ekf.get_odom().pose.pose.position.x, 0.5, 0.02);
+}
+
+
+TEST(EKFLocalizer, DropsNdtOlderThanMaxDelay)
+{
+    EKFLocalizer ekf(make_params());
+    feed_inputs(ekf, START, START + 1.0);
+    send_ndt(ekf, START + 0.3, 0.5);
+    feed_inputs(ekf, START + 1.0, START + 1.01);
+    ASSERT_TRUE(ekf.update(START + 1.01));
+
+    EXPECT_NEAR(ekf.get_odom().pose.pose.position.x, 0.0, 1e-3);
+}
+
+
+// the state at the scan stamp is corrected and the steps after it are replayed: the same as in time
+TEST(EKFLocalizer, LateNdtMatchesInOrderFusion)
+{
+    EKFLocalizer late(make_params());
+    feed_inputs(late, START, START + 1.0);
+    send_ndt(late, START + 0.85, 0.5);
+    feed_inputs(late, START + 1.0, START + 1.01);
+    ASSERT_TRUE(late.update(START + 1.01));
+
+    EKFLocalizer in_order(make_params());
+    feed_inputs(in_order, START, START + 0.85);
+    send_ndt(in_order, START + 0.85, 0.5);
+    feed_inputs(in_order, START + 0.85, START + 1.01);
+    ASSERT_TRUE(in_order.update(START + 1.01));
+
+    EXPECT_NEAR(late.get_odom().pose.pose.position.x, in_order.get_odom().pose.pose.position.x, 1e-3);
+    EXPECT_NEAR(late.get_odom().pose.covariance[0], in_order.get_odom().pose.covariance[0], 1e-4);
+}
+
+
+
+// driving a curve, the replayed steps move the corrected pose along: the same as fused in time,
+// and far from the result of fusing the old pose at the current step
+TEST(EKFLocalizer, MovingLateNdtMatchesInOrderFusion)
+{
+    const double v = 1.0, w = 0.5;
+    // the pose at the scan stamp off the dead reckoning by 0.3 m sideways and 0.1 rad
+    const double t = 0.85, yaw = w * t;
+    const double x = v / w * std::sin(yaw) - 0.3 * std::sin(yaw);
+    const double y = v / w * (1.0 - std::cos(yaw)) + 0.3 * std::cos(yaw);
+
+    EKFLocalizer late(make_params());
+    feed_inputs(late, START, START + 1.0, v, w);
+    send_ndt(late, START + t, x, y, yaw + 0.1);
+    feed_inputs(late, START + 1.0, START + 1.01, v, w);
+    ASSERT_TRUE(late.update(START + 1.01));
+
+    EKFLocalizer in_order(make_params());
+    feed_inputs(in_order, START, START + t, v, w);
+    send_ndt(in_order, START + t, x, y, yaw + 0.1);
+    feed_inputs(in_order, START + t, START + 1.01, v, w);
+    ASSERT_TRUE(in_order.update(START + 1.01));
+
+    expect_same_state(late.get_odom(), in_order.get_odom());
+
+    // without the history the old pose is fused at the current step, about 0.15 m behind
+    EKFLocalizer at_now(make_params(0.0));
+    feed_inputs(at_now, START, START + 1.0, v, w);
+    send_ndt(at_now, START + t, x, y, yaw + 0.1);
+    feed_inputs(at_now, START + 1.0, START + 1.01, v, w);
+    ASSERT_TRUE(at_now.update(START + 1.01));
+
+    const double distance = std::hypot(late.get_odom().pose.pose.position.x - at_now.get_odom().pose.pose.position.x,
+                                       late.get_odom().pose.pose.position.y - at_now.get_odom().pose.pose.position.y);
+    EXPECT_GT(distance, 0.1);
+}
+
+
+int
+main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
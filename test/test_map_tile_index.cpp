@@ -0,0 +1,133 @@
+/* test_map_tile_index.cpp
+ *
+ * quantized tile storage of the map: decoded points, memory, window
+ *
+*/
+
+#include<map>
+#include<random>
+#include<utility>
+
+#include<gtest/gtest.h>
+
+#include"ndt_localizer/map_tile_index.hpp"
+
+namespace{
+
+const int POINT_NUM = 200000;
+const double CELL = 0.1;        // every point in a cell of its own, ±JITTER around the center
+const double JITTER = 0.03;
+const int CELLS = 2000;         // 200 m x 200 m around the origin
+
+typedef std::pair<int, int> Key;
+
+Key
+key_of(const pcl::PointXYZI& p)
+{
+    return Key(static_cast<int>(std::floor(p.x / CELL)), static_cast<int>(std::floor(p.y / CELL)));
+}
+
+// deterministic map: POINT_NUM points in distinct cells, z in -3 .. 20 m, intensity 0 .. 255
+void
+make_map(MapTileIndex::Cloud& cloud, std::map<Key, pcl::PointXYZI>& by_key)
+{
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<int> cell(-CELLS / 2, CELLS / 2 - 1);
+    std::uniform_real_distribution<float> jitter(-JITTER, JITTER), z(-3.0f, 20.0f), intensity(0.0f, 255.0f);
+    while(by_key.size() < static_cast<size_t>(POINT_NUM)){
+        const Key key(cell(gen), cell(gen));
+        if(by_key.count(key)) continue;
+        pcl::PointXYZI p;
+        p.x = (key.first + 0.5) * CELL + jitter(gen);
+        p.y = (key.second + 0.5) * CELL + jitter(gen);
+        p.z = z(gen);
+        p.intensity = intensity(gen);
+        by_key[key] = p;
+        cloud.points.push_back(p);
+    }
+}
+
+}
+
+
+TEST(MapTileIndex, DecodedPointsMatchTheCloud)
+{
+    MapTileIndex::Cloud cloud;
+    std::map<Key, pcl::PointXYZI> by_key;
+    make_map(cloud, by_key);
+
+    MapTileIndex index(10.0, true);
+    index.build(cloud);
+    ASSERT_EQ(index.get_point_num(), cloud.points.size());
+
+    MapTileIndex::Cloud decoded;
+    index.query(-1000, 1000, -1000, 1000, decoded);
+    ASSERT_EQ(decoded.points.size(), cloud.points.size());
+
+    // half a step of rounding, z steps are at most the height range of a tile over 65535
+    const double xy_tolerance = index.get_xy_scale() / 2 + 1e-5;
+    const double z_tolerance = 23.0 / 65535 / 2 + 1e-5;
+    const double intensity_tolerance = index.get_intensity_scale() / 2 + 1e-4;
+    for(const auto& p : decoded.points){
+        const auto it = by_key.find(key_of(p));
+        ASSERT_TRUE(it != by_key.end());
+        EXPECT_NEAR(p.x, it->second.x, xy_tolerance);
+        EXPECT_NEAR(p.y, it->second.y, xy_tolerance);
+        EXPECT_NEAR(p.z, it->second.z, z_tolerance);
+        EXPECT_NEAR(p.intensity, it->second.intensity, intensity_tolerance);
+    }
+}
+
+
+TEST(MapTileIndex, BytesPerPoint)
+{
+    MapTileIndex::Cloud cloud;
+    std::map<Key, pcl::PointXYZI> by_key;
+    make_map(cloud, by_key);
+
+    MapTileIndex with_intensity(10.0, true);
+    with_intensity.build(cloud);
+    EXPECT_LT(static_cast<double>(with_intensity.get_memory_bytes()) / cloud.points.size(), 8.5);
+
+    MapTileIndex without_intensity(10.0, false);
+    without_intensity.build(cloud);
+    EXPECT_LT(static_cast<double>(without_intensity.get_memory_bytes()) / cloud.points.size(), 6.5);
+
+    MapTileIndex::Cloud decoded;
+    without_intensity.query(-1000, 1000, -1000, 1000, decoded);
+    for(const auto& p : decoded.points) ASSERT_EQ(p.intensity, 0.0f);
+}
+
+
+// the window holds whole tiles: as many points as count() over the same square, after moving too
+TEST(MapTileIndex, WindowFollowsTheRobot)
+{
+    MapTileIndex::Cloud cloud;
+    std::map<Key, pcl::PointXYZI> by_key;
+    make_map(cloud, by_key);
+
+    MapTileIndex index(10.0, true);
+    index.build(cloud);
+
+    const double range = 20.0;
+    MapTileIndex::Cloud window;
+    EXPECT_TRUE(index.update_window(5.0, 5.0, range, window));
+    EXPECT_EQ(window.points.size(), index.count(5.0 - range, 5.0 + range, 5.0 - range, 5.0 + range));
+    // same tiles: nothing changes
+    EXPECT_FALSE(index.update_window(6.0, 6.0, range, window));
+    EXPECT_TRUE(index.update_window(25.0, 5.0, range, window));
+    EXPECT_EQ(window.points.size(), index.count(25.0 - range, 25.0 + range, 5.0 - range, 5.0 + range));
+
+    MapTileIndex::Cloud crop;
+    index.query(25.0 - range, 25.0 + range, 5.0 - range, 5.0 + range, crop);
+    EXPECT_LE(crop.points.size(), window.points.size());
+    EXPECT_GT(crop.points.size(), 0u);
+}
+
+
+int
+main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,165 @@
+/* test_scan_preprocess.cpp
+ *
+ * fused crop + voxel downsample of ScanPreprocessor against pcl::VoxelGrid
+ *
+*/
+
+#include<cmath>
+#include<cstring>
+#include<limits>
+#include<map>
+#include<random>
+#include<tuple>
+
+#include<gtest/gtest.h>
+
+#include<pcl/filters/voxel_grid.h>
+
+#include"ndt_localizer/scan_preprocess.hpp"
+
+namespace{
+
+const double RANGE = 20.0;
+const double LEAF = 0.5;
+const int ROWS = 32;
+const int COLUMNS = 1000;
+
+typedef std::tuple<int, int, int> VoxelIndex;
+
+VoxelIndex
+voxel_of(const pcl::PointXYZI& p)
+{
+    const float inverse_leaf = 1.0f / static_cast<float>(LEAF);
+    return VoxelIndex(static_cast<int>(std::floor(p.x * inverse_leaf)),
+                      static_cast<int>(std::floor(p.y * inverse_leaf)),
+                      static_cast<int>(std::floor(p.z * inverse_leaf)));
+}
+
+// organized x, y, z, intensity (float32) cloud, out to twice RANGE: every 7th point NaN as the
+// missing returns of a velodyne, and a few with an infinite or huge z
+void
+make_scan(sensor_msgs::PointCloud2& msg, ScanPreprocessor::Cloud& finite)
+{
+    const char* names[] = {"x", "y", "z", "intensity"};
+    msg.fields.clear();
+    for(int i = 0; i < 4; i++){
+        sensor_msgs::PointField field;
+        field.name = names[i];
+        field.offset = 4 * i;
+        field.datatype = sensor_msgs::PointField::FLOAT32;
+        field.count = 1;
+        msg.fields.push_back(field);
+    }
+    msg.header.frame_id = "velodyne";
+    msg.height = ROWS;
+    msg.width = COLUMNS;
+    msg.point_step = 16;
+    msg.row_step = msg.point_step * COLUMNS;
+    msg.is_bigendian = false;
+    msg.is_dense = false;
+    msg.data.assign(static_cast<size_t>(msg.row_step) * ROWS, 0);
+
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<float> xy(-2 * RANGE, 2 * RANGE), z(-2.0f, 5.0f), intensity(0.0f, 255.0f);
+    finite.points.clear();
+    for(int k = 0; k < ROWS * COLUMNS; k++){
+        float p[4] = {xy(gen), xy(gen), z(gen), intensity(gen)};
+        if(k % 7 == 0){
+            p[0] = p[1] = p[2] = std::numeric_limits<float>::quiet_NaN();
+        }else if(k % 101 == 0){
+            p[2] = std::numeric_limits<float>::infinity();
+        }else if(k % 103 == 0){
+            p[2] = 1e30f;
+        }else if(std::fabs(p[0]) <= RANGE && std::fabs(p[1]) <= RANGE){
+            pcl::PointXYZI point;
+            point.x = p[0];
+            point.y = p[1];
+            point.z = p[2];
+            point.intensity = p[3];
+            finite.points.push_back(point);
+        }
+        std::memcpy(msg.data.data() + static_cast<size_t>(k) * msg.point_step, p, sizeof(p));
+    }
+    finite.width = finite.points.size();
+    finite.height = 1;
+}
+
+void
+expect_same_voxels(const ScanPreprocessor::Cloud& output, const ScanPreprocessor::Cloud& reference)
+{
+    ASSERT_EQ(output.points.size(), reference.points.size());
+    std::map<VoxelIndex, pcl::PointXYZI> by_voxel;
+    for(const auto& p : reference.points) by_voxel[voxel_of(p)] = p;
+    ASSERT_EQ(by_voxel.size(), reference.points.size());
+
+    for(const auto& p : output.points){
+        const auto it = by_voxel.find(voxel_of(p));
+        ASSERT_TRUE(it != by_voxel.end());
+        EXPECT_NEAR(p.x, it->second.x, 1e-4);
+        EXPECT_NEAR(p.y, it->second.y, 1e-4);
+        EXPECT_NEAR(p.z, it->second.z, 1e-4);
+        EXPECT_NEAR(p.intensity, it->second.intensity, 1e-2);
+    }
+}
+
+}
+
+
+// the hashed voxel centroids equal pcl::VoxelGrid on the cropped finite points, up to their order
+TEST(ScanPreprocessor, MatchesVoxelGrid)
+{
+    sensor_msgs::PointCloud2 msg;
+    ScanPreprocessor::Cloud::Ptr finite(new ScanPreprocessor::Cloud);
+    make_scan(msg, *finite);
+
+    ScanPreprocessor::Cloud reference;
+    pcl::VoxelGrid<pcl::PointXYZI> voxel;
+    voxel.setLeafSize(LEAF, LEAF, LEAF);
+    voxel.setInputCloud(finite);
+    voxel.filter(reference);
+
+    for(int threads : {1, 4}){
+        ScanPreprocessor preprocessor;
+        preprocessor.set_range(RANGE);
+        preprocessor.set_voxel_size(LEAF);
+        preprocessor.set_num_threads(threads);
+        ScanPreprocessor::Cloud output;
+        ASSERT_TRUE(preprocessor.convert(msg, output));
+        expect_same_voxels(output, reference);
+    }
+}
+
+
+// NaN, infinite and out-of-range points never reach the output, with and without the voxel grid;
+// a huge but finite z is kept by the crop alone, but has no voxel key
+TEST(ScanPreprocessor, DropsNonFinitePoints)
+{
+    sensor_msgs::PointCloud2 msg;
+    ScanPreprocessor::Cloud finite;
+    make_scan(msg, finite);
+
+    for(double leaf : {0.0, LEAF}){
+        ScanPreprocessor preprocessor;
+        preprocessor.set_range(RANGE);
+        preprocessor.set_voxel_size(leaf);
+        ScanPreprocessor::Cloud output;
+        ASSERT_TRUE(preprocessor.convert(msg, output));
+        size_t huge = 0;
+        for(const auto& p : output.points){
+            ASSERT_TRUE(std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z));
+            EXPECT_LE(std::fabs(p.x), RANGE);
+            EXPECT_LE(std::fabs(p.y), RANGE);
+            if(std::fabs(p.z) > 5.0f) huge++;
+        }
+        if(leaf <= 0) EXPECT_EQ(output.points.size() - huge, finite.points.size());
+        else EXPECT_EQ(huge, 0u);
+    }
+}
+
+
+int
+main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}